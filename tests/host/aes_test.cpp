@@ -0,0 +1,125 @@
+//
+// AES-128 block cipher and counter mode against the NIST vectors.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o aes_test aes_test.cpp
+//       ../lib/tinyhci/tinyhci_aes.cpp
+//
+#include "host.h"
+#include "tinyhci_aes.h"
+
+// NVMEM_AES128_KEY_FILEID, for aes_read_key and aes_write_key.
+static uint8_t host_key_file[AES_KEY_SIZE];
+
+int nvmem_read(uint8_t file_id, uint32_t length, uint32_t offset, void *buffer)
+{
+  CHECK(file_id == NVMEM_AES128_KEY_FILEID && offset + length <= AES_KEY_SIZE);
+  memcpy(buffer, host_key_file + offset, length);
+  return length;
+}
+
+int nvmem_write(uint8_t file_id, uint32_t length, uint32_t offset, const void *buffer)
+{
+  CHECK(file_id == NVMEM_AES128_KEY_FILEID && offset + length <= AES_KEY_SIZE);
+  memcpy(host_key_file + offset, buffer, length);
+  return length;
+}
+
+static std::string hex(const char *digits)
+{
+  std::string bytes;
+  for (; digits[0] && digits[1]; digits += 2)
+    bytes += (char)strtoul(std::string(digits, 2).c_str(), NULL, 16);
+  return bytes;
+}
+
+// SP 800-38A F.5.1, CTR-AES128.Encrypt.
+static const std::string ctr_key = hex("2b7e151628aed2a6abf7158809cf4f3c");
+static const std::string ctr_counter = hex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+static const std::string ctr_plaintext = hex(
+  "6bc1bee22e409f96e93d7e117393172a"
+  "ae2d8a571e03ac9c9eb76fac45af8e51"
+  "30c81c46a35ce411e5fbc1191a0a52ef"
+  "f69f2445df4f9b17ad2b417be66c3710");
+static const std::string ctr_ciphertext = hex(
+  "874d6191b620e3261bef6864990db6ce"
+  "9806f66b7970fdff8617187bb9fffdff"
+  "5ae4df3edbd5d35e5b4f09020db03eab"
+  "1e031dda2fbe03d1792170a0f3009cee");
+
+static void test_block(void)
+{
+  // FIPS-197 C.1.
+  std::string key = hex("000102030405060708090a0b0c0d0e0f");
+  std::string block = hex("00112233445566778899aabbccddeeff");
+  uint32_t round_keys[44];
+  aes_expand_key(round_keys, (const uint8_t *)key.data());
+  aes_encrypt_block(round_keys, (uint8_t *)&block[0]);
+  CHECK(block == hex("69c4e0d86a7b0430d8cdb78070b4c55a"));
+}
+
+static void test_ctr(void)
+{
+  AesCtr aes;
+  std::string data = ctr_plaintext;
+  aes.begin((const uint8_t *)ctr_key.data(), (const uint8_t *)ctr_counter.data());
+  aes.crypt((uint8_t *)&data[0], data.size());
+  CHECK(data == ctr_ciphertext);
+
+  // Decrypting is the same operation.
+  aes.begin((const uint8_t *)ctr_key.data(), (const uint8_t *)ctr_counter.data());
+  aes.crypt((uint8_t *)&data[0], data.size());
+  CHECK(data == ctr_plaintext);
+}
+
+static void test_split(void)
+{
+  // Calls of every size from 0 to 17 continue the same stream across block boundaries.
+  AesCtr aes;
+  std::string data = ctr_plaintext;
+  aes.begin((const uint8_t *)ctr_key.data(), (const uint8_t *)ctr_counter.data());
+  size_t offset = 0;
+  for (size_t size = 0; offset < data.size(); size = (size + 1) % 18)
+  {
+    size_t n = data.size() - offset < size ? data.size() - offset : size;
+    aes.crypt((uint8_t *)&data[offset], n);
+    offset += n;
+  }
+  CHECK(data == ctr_ciphertext);
+}
+
+static void test_send(void)
+{
+  // The ciphertext goes to the send path: from RAM, encrypted in place; and from flash.
+  AesCtr aes;
+  std::string data = ctr_plaintext.substr(0, 20);
+  aes.begin((const uint8_t *)ctr_key.data(), (const uint8_t *)ctr_counter.data());
+  aes.send_data((uint8_t *)&data[0], data.size());
+  CHECK(data == ctr_ciphertext.substr(0, 20));
+  CHECK(host_take_tx() == ctr_ciphertext.substr(0, 20));
+
+  static const char plaintext[] PROGMEM =
+    "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+    "\xae\x2d\x8a\x57";
+  aes.begin((const uint8_t *)ctr_key.data(), (const uint8_t *)ctr_counter.data());
+  aes.send_data_P(plaintext, 20);
+  CHECK(host_take_tx() == ctr_ciphertext.substr(0, 20));
+}
+
+static void test_key_file(void)
+{
+  uint8_t key[AES_KEY_SIZE];
+  CHECK(aes_write_key((const uint8_t *)ctr_key.data()) == ESUCCESS);
+  CHECK(aes_read_key(key) == ESUCCESS);
+  CHECK(std::string((const char *)key, AES_KEY_SIZE) == ctr_key);
+}
+
+int main()
+{
+  test_block();
+  test_ctr();
+  test_split();
+  test_send();
+  test_key_file();
+
+  return host_result();
+}
@@ -0,0 +1,153 @@
+//
+// CoapServer request parsing, responses and retransmission handling.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o coap_test coap_test.cpp
+//       ../lib/tinyhci/tinyhci_coap.cpp
+//
+#include "host.h"
+#include "tinyhci_coap.h"
+
+#define CLIENT_IP                 0x0a000002
+#define CLIENT_PORT               40000
+
+static int temp_calls, led_calls;
+static std::string led_payload;
+static int16_t led_format;
+
+static void temp(const CoapRequest &request, CoapResponse &response)
+{
+  CHECK(request.method == COAP_GET);
+  temp_calls++;
+  response.begin(COAP_CONTENT, COAP_FORMAT_TEXT);
+  response.print("21.5");
+}
+
+static void led(const CoapRequest &request, CoapResponse &)
+{
+  led_calls++;
+  led_payload.assign((const char *)request.payload, request.payload_length);
+  led_format = request.content_format;
+}
+
+const char temp_path[] PROGMEM = "sensors/temp";
+const char led_path[] PROGMEM = "led";
+const char hello_path[] PROGMEM = "hello";
+const char hello_body[] PROGMEM = "hi there";
+
+const CoapResource resources[] PROGMEM =
+{
+  { temp_path, temp, NULL, 0, 0 },
+  { led_path, led, NULL, 0, 0 },
+  { hello_path, NULL, hello_body, sizeof(hello_body) - 1, COAP_FORMAT_TEXT },
+};
+
+static CoapServer coap(resources, sizeof(resources) / sizeof(resources[0]));
+
+// Sends a datagram to the server and returns its answer, if any.
+static std::string request(const std::string &datagram, uint16_t port = CLIENT_PORT)
+{
+  host_from.sin_family = AF_INET;
+  host_from.sin_port = htons(port);
+  host_from.sin_addr.s_addr = htonl(CLIENT_IP);
+  host_rx = datagram;
+  coap.poll();
+  CHECK(host_rx.empty());
+  std::string answer = host_take_tx();
+  if (!answer.empty())
+    CHECK(!memcmp(&host_to, &host_from, sizeof(host_to)));
+  return answer;
+}
+
+static void test_get(void)
+{
+  // Confirmable GET of a two-segment path, with a token.
+  std::string get("\x42\x01\x12\x34\xaa\xbb\xb7sensors\x04temp", 19);
+  CHECK(request(get) == std::string("\x62\x45\x12\x34\xaa\xbb\xc0\xff" "21.5", 12));
+  CHECK(temp_calls == 1);
+
+  // A retransmission of the last request gets the same answer without running the handler.
+  CHECK(request(get) == std::string("\x62\x45\x12\x34\xaa\xbb\xc0\xff" "21.5", 12));
+  CHECK(temp_calls == 1);
+}
+
+static void test_put(void)
+{
+  // Confirmable PUT with a Content-Format and a payload; the code defaults to 2.04 Changed.
+  std::string put("\x40\x03\x00\x01\xb3led\x10\xff" "1", 11);
+  CHECK_BYTES(request(put), "\x60\x44\x00\x01");
+  CHECK(led_calls == 1);
+  CHECK(led_payload == "1");
+  CHECK(led_format == COAP_FORMAT_TEXT);
+
+  // The same message ID from another port is a different request.
+  CHECK_BYTES(request(put, CLIENT_PORT + 1), "\x60\x44\x00\x01");
+  CHECK(led_calls == 2);
+}
+
+static void test_static_body(void)
+{
+  // A non-confirmable request gets a non-confirmable response with the server's next ID.
+  CHECK(request(std::string("\x50\x01\x00\x02\xb5hello", 10)) ==
+        std::string("\x50\x45\x10\x01\xc0\xff" "hi there", 14));
+
+  // Only GET is allowed on a static body.
+  CHECK_BYTES(request(std::string("\x40\x02\x00\x03\xb5hello", 10)), "\x60\x85\x00\x03");
+}
+
+static void test_old_retransmission(void)
+{
+  // An older retransmission of a PUT gets its response code again, without running the handler.
+  CHECK_BYTES(request(std::string("\x40\x03\x00\x01\xb3led\x10\xff" "1", 11)), "\x60\x44\x00\x01");
+  CHECK(led_calls == 2);
+
+  // One of a GET is answered again.
+  CHECK(request(std::string("\x50\x01\x00\x02\xb5hello", 10)) ==
+        std::string("\x50\x45\x10\x02\xc0\xff" "hi there", 14));
+
+  // The code is that of the original response, here an error.
+  CHECK_BYTES(request(std::string("\x40\x02\x00\x03\xb5hello", 10)), "\x60\x85\x00\x03");
+
+  // Once COAP_DEDUP newer requests have arrived, a request is no longer recognised.
+  for (int i = 0; i < COAP_DEDUP; i++)
+    request(std::string("\x40\x01\x01\x00\xb5hello", 10).replace(3, 1, 1, (char)i));
+  CHECK_BYTES(request(std::string("\x40\x03\x00\x01\xb3led\x10\xff" "1", 11)), "\x60\x44\x00\x01");
+  CHECK(led_calls == 3);
+}
+
+static void test_errors(void)
+{
+  // Unknown critical option 9.
+  CHECK_BYTES(request(std::string("\x40\x01\x00\x10\x90\x25hello", 11)), "\x60\x82\x00\x10");
+
+  // An option longer than the datagram.
+  CHECK_BYTES(request(std::string("\x40\x01\x00\x11\xb5hi", 7)), "\x60\x80\x00\x11");
+
+  // A payload marker without a payload.
+  CHECK_BYTES(request(std::string("\x40\x03\x00\x12\xb3led\xff", 9)), "\x60\x80\x00\x12");
+
+  // A path that is not a resource.
+  CHECK_BYTES(request(std::string("\x40\x01\x00\x13\xb1x", 6)), "\x60\x84\x00\x13");
+
+  // A confirmable ping is reset; a non-confirmable one, and responses, are ignored.
+  CHECK_BYTES(request(std::string("\x40\x00\x00\x14", 4)), "\x70\x00\x00\x14");
+  CHECK(request(std::string("\x50\x00\x00\x15", 4)).empty());
+  CHECK(request(std::string("\x60\x45\x00\x16", 4)).empty());
+
+  // Not CoAP version 1.
+  CHECK(request(std::string("\x80\x01\x00\x17", 4)).empty());
+  CHECK(led_calls == 3 && temp_calls == 1);
+}
+
+int main()
+{
+  host_millis = 0x1000;
+  CHECK(coap.begin() == ESUCCESS);
+
+  test_get();
+  test_put();
+  test_static_body();
+  test_old_retransmission();
+  test_errors();
+
+  return host_result();
+}
@@ -0,0 +1,194 @@
+//
+// Host test harness
+//
+// Stands in for the CC3000 so the protocol modules can be run on a PC.  Each test is one
+// program built from its own source, which includes this header once, and the modules it
+// tests, for example:
+//
+//   cd tests/host
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o websocket_test websocket_test.cpp
+//       ../lib/tinyhci/tinyhci_websocket.cpp ../lib/tinyhci/tinyhci_http.cpp
+//       ../lib/tinyhci/tinyhci_http_parser.cpp
+//   ./websocket_test
+//
+// The peer is a script: bytes it sends are queued in host_rx and handed out by recv a few at a
+// time, so parsers see their input split at awkward places.  Data packets sent by the module are
+// appended to host_tx.  A test prints each failed CHECK and exits non-zero if any failed.
+//
+// startup_bench.cpp is the exception: it builds tinyhci.cpp itself, against a model of the
+// CC3000's SPI interface, to time the startup path.
+//
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string>
+#include "tinyhci.h"
+
+#define HOST_SD                   5       // socket of the scripted connection
+
+static int host_failures;
+
+#define CHECK(x)                                                          \
+  do {                                                                    \
+    if (!(x)) {                                                           \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x);        \
+      host_failures++;                                                    \
+    }                                                                     \
+  } while (0)
+
+#define CHECK_BYTES(s, bytes) CHECK((s) == std::string(bytes, sizeof(bytes) - 1))
+
+static std::string host_rx;               // bytes the peer has sent and not yet received
+static size_t host_rx_piece = 5;          // most bytes handed out by one recv
+static bool host_rx_closed;               // the peer closes once host_rx is received
+static std::string host_tx;               // data packets sent, back to back
+static int host_packets;
+static int host_mtu = 100;
+static int host_send_size;                // size given to send_begin
+static int host_send_count;               // bytes added since send_begin
+static int host_opened;                   // sockets opened
+static int host_closed = -1;              // last socket closed
+static int host_accept_sd = -1;           // accept hands this out once
+static bool host_timers_expired;
+static unsigned long host_millis;
+static sockaddr_in host_from;             // sender of the datagrams in host_rx
+static sockaddr_in host_to;               // address of the last sendto
+
+inline int host_result(void)
+{
+  if (host_failures)
+    printf("%d checks failed\n", host_failures);
+  return host_failures ? 1 : 0;
+}
+
+// Takes what has been sent so far.
+inline std::string host_take_tx(void)
+{
+  std::string tx;
+  tx.swap(host_tx);
+  host_packets = 0;
+  return tx;
+}
+
+char *utoa(unsigned value, char *buffer, int)
+{
+  sprintf(buffer, "%u", value);
+  return buffer;
+}
+
+char *ultoa(unsigned long value, char *buffer, int)
+{
+  sprintf(buffer, "%lu", value);
+  return buffer;
+}
+
+unsigned long millis(void) { return host_millis; }
+
+void hci_timer_start(hci_timer *, uint32_t) {}
+bool hci_timer_expired(const hci_timer *) { return host_timers_expired; }
+uint8_t hci_peer_closed(int) { return 0; }
+
+int socket(long, long, long)
+{
+  host_opened++;
+  return HOST_SD;
+}
+int setsockopt(long, long, long, const void *, unsigned long) { return 0; }
+int bind(int, _sockaddr_t *, int) { return 0; }
+int listen(int, int) { return 0; }
+int connect(int, const sockaddr *, long) { return 0; }
+
+int accept(int, sockaddr_t *, unsigned long *)
+{
+  int sd = host_accept_sd;
+  host_accept_sd = -1;
+  return sd >= 0 ? sd : ESOCKINPROGRESS;
+}
+
+int closesocket(int sd)
+{
+  host_closed = sd;
+  return 0;
+}
+
+int select(long nfds, fd_set *readsds, fd_set *, fd_set *, timeval *)
+{
+  if (host_rx.empty() && !host_rx_closed)
+  {
+    if (readsds)
+      FD_ZERO(readsds);
+    return 0;
+  }
+  return nfds ? 1 : 0;
+}
+
+int recv(int, void *buffer, int size, int)
+{
+  size_t count = host_rx.size();
+  if (count > (size_t)size)
+    count = size;
+  if (count > host_rx_piece)
+    count = host_rx_piece;
+  memcpy(buffer, host_rx.data(), count);
+  host_rx.erase(0, count);
+  return count;
+}
+
+int recvfrom(int, void *buffer, int size, int, sockaddr *from, socklen_t *fromlen)
+{
+  // One datagram per call.
+  int count = host_rx.size() < (size_t)size ? host_rx.size() : size;
+  memcpy(buffer, host_rx.data(), count);
+  host_rx.clear();
+  memcpy(from, &host_from, sizeof(host_from));
+  *fromlen = sizeof(host_from);
+  return count;
+}
+
+int sendto(int, const void *buffer, int size, int, const sockaddr *to, socklen_t)
+{
+  host_tx.append((const char *)buffer, size);
+  host_packets++;
+  memcpy(&host_to, to, sizeof(host_to));
+  return size;
+}
+
+int send_mtu(void) { return host_mtu; }
+
+int send_begin(int, int size, int)
+{
+  if (size > host_mtu)
+  {
+    printf("send_begin: %d bytes is more than the MTU\n", size);
+    host_failures++;
+  }
+  host_send_size = size;
+  host_send_count = 0;
+  host_packets++;
+  return 0;
+}
+
+void send_data(const void *buffer, int size)
+{
+  host_tx.append((const char *)buffer, size);
+  host_send_count += size;
+}
+
+void send_data_P(const void PROGMEM *buffer, int size)
+{
+  send_data(buffer, size);
+}
+
+int send_end(void)
+{
+  if (host_send_count != host_send_size)
+  {
+    printf("send_end: %d bytes sent, %d announced\n", host_send_count, host_send_size);
+    host_failures++;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,156 @@
+//
+// HttpClient request framing and response parsing.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o http_client_test http_client_test.cpp
+//       ../lib/tinyhci/tinyhci_http_client.cpp
+//
+#include "host.h"
+#include "tinyhci_http_client.h"
+
+#define SERVER_IP                 0x0a000001
+
+static std::string body;                  // body pieces, each followed by '|'
+
+static void on_body(void *context, const uint8_t *data, size_t size)
+{
+  CHECK(context == &body);
+  CHECK(size > 0);
+  body.append((const char *)data, size);
+  body += "|";
+}
+
+static HttpClient client(on_body, &body);
+
+// Feeds the server's response and waits for it to complete.
+static int respond(const std::string &response)
+{
+  body.clear();
+  host_rx = response;
+  return client.response();
+}
+
+static void test_request(void)
+{
+  static const char post[] PROGMEM = "POST";
+  static const char headers[] PROGMEM = "Accept: */*\r\n";
+  host_mtu = 30;
+  CHECK(client.request(post, SERVER_IP, 80, "example.com", "/api/x", headers, "hello=1", 7) == ESUCCESS);
+  host_mtu = 100;
+
+  std::string expected =
+    "POST /api/x HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Accept: */*\r\n"
+    "Content-Length: 7\r\n"
+    "\r\n"
+    "hello=1";
+  CHECK(host_packets == (int)(expected.size() + 29) / 30);
+  CHECK(host_take_tx() == expected);
+  CHECK(host_opened == 1);
+}
+
+static void test_content_length(void)
+{
+  // The body ends at Content-Length; the connection is kept.
+  host_rx_piece = 4;
+  CHECK(respond("HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Other: y\r\n\r\nabcde") == 200);
+  CHECK(body == "ab|cde|");
+  CHECK(client.content_length() == 5);
+  CHECK(client.content_range_start() == -1);
+  CHECK(host_closed == -1);
+}
+
+static void test_chunked(void)
+{
+  // The kept connection is reused, an interim response is skipped, and chunk extensions and
+  // trailers are ignored.
+  CHECK(client.request(PSTR("GET"), SERVER_IP, 80, "example.com", "/") == ESUCCESS);
+  CHECK(host_take_tx() == "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n");
+  CHECK(host_opened == 1);
+
+  host_rx_piece = 7;
+  CHECK(respond(
+    "HTTP/1.1 100 Continue\r\n\r\n"
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5;x=y\r\nhello\r\n"
+    "1A\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+    "0\r\nTrailer: z\r\n\r\n") == 200);
+  CHECK(body == "hello|a|bcdefgh|ijklmno|pqrstuv|wxyz|");
+  CHECK(client.content_length() == -1);
+  CHECK(host_closed == -1);
+}
+
+static void test_head(void)
+{
+  // A HEAD response has no body whatever its headers say.
+  host_rx_piece = 3;
+  CHECK(client.request(PSTR("HEAD"), SERVER_IP, 80, "example.com", "/") == ESUCCESS);
+  host_take_tx();
+  CHECK(respond("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n") == 200);
+  CHECK(body.empty());
+}
+
+static void test_range(void)
+{
+  client.range(1000);
+  CHECK(client.request(PSTR("GET"), SERVER_IP, 80, "example.com", "/image.bin") == ESUCCESS);
+  CHECK(host_take_tx() == "GET /image.bin HTTP/1.1\r\nHost: example.com\r\nRange: bytes=1000-\r\n\r\n");
+  CHECK(respond("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 1000-1001/1002\r\n"
+                "Content-Length: 2\r\n\r\nzz") == 206);
+  CHECK(body == "zz|");
+  CHECK(client.content_range_start() == 1000);
+}
+
+static void test_close_delimited(void)
+{
+  // Without a length the body runs until the server closes the connection.
+  host_rx_piece = 100;
+  CHECK(client.request(PSTR("GET"), SERVER_IP, 80, "example.com", "/") == ESUCCESS);
+  host_take_tx();
+  host_rx_closed = true;
+  CHECK(respond("HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\nstuff") == 404);
+  host_rx_closed = false;
+  CHECK(body == "stuff|");
+  CHECK(host_closed == HOST_SD);
+}
+
+static void test_malformed(void)
+{
+  CHECK(client.request(PSTR("GET"), SERVER_IP, 80, "example.com", "/") == ESUCCESS);
+  CHECK(host_opened == 2);
+  host_take_tx();
+  host_closed = -1;
+  CHECK(respond("HTTP/1.1 2x0 OK\r\n\r\n") == EFAIL);
+  CHECK(host_closed == HOST_SD);
+}
+
+static void test_stall(void)
+{
+  // A server that stops sending mid-body is given up on once the idle timer expires.
+  CHECK(client.request(PSTR("GET"), SERVER_IP, 80, "example.com", "/") == ESUCCESS);
+  host_take_tx();
+  host_rx = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nab";
+  while (!host_rx.empty())
+    CHECK(client.poll() == 0);
+  CHECK(client.poll() == 0);
+
+  host_closed = -1;
+  host_timers_expired = true;
+  CHECK(client.poll() == EFAIL);
+  host_timers_expired = false;
+  CHECK(host_closed == HOST_SD);
+}
+
+int main()
+{
+  test_request();
+  test_content_length();
+  test_chunked();
+  test_head();
+  test_range();
+  test_close_delimited();
+  test_malformed();
+  test_stall();
+
+  return host_result();
+}
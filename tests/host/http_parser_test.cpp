@@ -0,0 +1,161 @@
+//
+// HttpParser request line, headers, pipelining and limits.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o http_parser_test http_parser_test.cpp
+//       ../lib/tinyhci/tinyhci_http_parser.cpp
+//
+#include "host.h"
+#include "tinyhci_http_parser.h"
+
+// Parses text piece bytes at a time until a request is ready; returns the bytes consumed.
+static size_t parse(HttpParser &parser, const std::string &text, size_t piece)
+{
+  size_t offset = 0;
+  while (offset < text.size() && !parser.ready())
+  {
+    size_t size = text.size() - offset < piece ? text.size() - offset : piece;
+    size_t used = parser.parse((const uint8_t *)text.data() + offset, size);
+    CHECK(used <= size);
+    offset += used;
+    if (!used)
+      break;
+  }
+  return offset;
+}
+
+static uint32_t path_hash(uint32_t seed, const char *path)
+{
+  uint32_t hash = http_hash_begin(seed);
+  while (*path)
+    hash = http_hash_step(hash, *path++);
+  return hash;
+}
+
+static void test_request(void)
+{
+  std::string text =
+    "GET /css/site.css?v=2 HTTP/1.1\r\n"
+    "Host: device\r\n"
+    "User-Agent: a header value much longer than any token the parser keeps\r\n"
+    "IF-NONE-MATCH: \"5d41\"\r\n"
+    "\r\n";
+
+  // Whole, and a byte at a time.
+  for (size_t piece = text.size(); piece; piece = piece > 1 ? 1 : 0)
+  {
+    HttpParser parser;
+    parser.hash_seed = 0x1234;
+    parser.reset();
+    CHECK(parse(parser, text, piece) == text.size());
+    CHECK(parser.ready());
+    CHECK(parser.request.method == HTTP_METHOD_GET);
+    CHECK(!strcmp(parser.request.path, "/css/site.css"));
+    CHECK(parser.request.path_hash == path_hash(0x1234, "/css/site.css"));
+    CHECK(!strcmp(parser.request.if_none_match, "\"5d41\""));
+    CHECK(parser.request.flags == HTTP_REQUEST_HTTP_1_1);
+    CHECK(parser.request.keep_alive);
+  }
+}
+
+static void test_connection(void)
+{
+  HttpParser parser;
+  CHECK(parse(parser, "GET / HTTP/1.0\r\n\r\n", 3) == 18);
+  CHECK(parser.ready());
+  CHECK(!parser.request.keep_alive);
+  CHECK(!(parser.request.flags & HTTP_REQUEST_HTTP_1_1));
+
+  parser.reset();
+  parse(parser, "GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n", 3);
+  CHECK(parser.request.keep_alive);
+
+  parser.reset();
+  parse(parser, "GET / HTTP/1.1\r\nConnection: close\r\n\r\n", 3);
+  CHECK(!parser.request.keep_alive);
+}
+
+static void test_pipelining(void)
+{
+  // A POST body is skipped after next, and the request behind it is parsed.
+  std::string text =
+    "POST /api/config HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+    "DELETE /api/x HTTP/1.1\r\n\r\n";
+  HttpParser parser;
+  size_t used = parse(parser, text, 5);
+  CHECK(parser.ready());
+  CHECK(parser.request.method == HTTP_METHOD_POST);
+  CHECK(parser.request.content_length == 3);
+  CHECK(text.compare(used, 3, "abc") == 0);
+
+  parser.next();
+  used += parse(parser, text.substr(used), 5);
+  CHECK(used == text.size());
+  CHECK(parser.ready());
+  CHECK(parser.request.method == HTTP_METHOD_DELETE);
+  CHECK(!strcmp(parser.request.path, "/api/x"));
+  CHECK(parser.request.content_length == 0);
+}
+
+static void test_websocket_key(void)
+{
+  HttpParser parser;
+  parse(parser,
+    "GET /ws HTTP/1.1\r\n"
+    "Upgrade: WebSocket\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "\r\n", 1);
+  CHECK(parser.request.flags & HTTP_REQUEST_UPGRADE);
+  CHECK(!strcmp(parser.request.websocket_key, "dGhlIHNhbXBsZSBub25jZQ=="));
+
+  // Keys of the wrong length are dropped.
+  parser.reset();
+  parse(parser, "GET /ws HTTP/1.1\r\nSec-WebSocket-Key: c2hvcnQ=\r\n\r\n", 1);
+  CHECK(!parser.request.websocket_key[0]);
+}
+
+static void test_accept_encoding(void)
+{
+  const char *requests[] =
+  {
+    "GET / HTTP/1.1\r\nAccept-Encoding: deflate, br, zstd, GZip\r\n\r\n",
+    "GET / HTTP/1.1\r\naccept-encoding: ggzip\r\n\r\n",
+    "GET / HTTP/1.1\r\nAccept-Encoding: identity\r\n\r\n",
+    "GET / HTTP/1.1\r\nAccept: gzip\r\n\r\n",
+  };
+  for (int i = 0; i < 4; i++)
+  {
+    HttpParser parser;
+    parse(parser, requests[i], 1);
+    CHECK(parser.ready());
+    CHECK(!(parser.request.flags & HTTP_REQUEST_GZIP) == (i >= 2));
+  }
+}
+
+static void test_limits(void)
+{
+  HttpParser parser;
+  std::string path(HTTP_MAX_PATH + 10, 'a');
+  parse(parser, "GET /" + path + " HTTP/1.1\r\n\r\n", 7);
+  CHECK(parser.ready());
+  CHECK(parser.request.flags & HTTP_REQUEST_PATH_TOO_LONG);
+
+  parser.reset();
+  parse(parser, "POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", 7);
+  CHECK(parser.request.flags & HTTP_REQUEST_CHUNKED);
+
+  parser.reset();
+  parse(parser, "GET / HTTP/1.1\r\nContent-Length: 12x\r\n\r\n", 7);
+  CHECK(parser.request.flags & HTTP_REQUEST_MALFORMED);
+}
+
+int main()
+{
+  test_request();
+  test_connection();
+  test_pipelining();
+  test_websocket_key();
+  test_accept_encoding();
+  test_limits();
+
+  return host_result();
+}
@@ -0,0 +1,151 @@
+//
+// MqttClient packet encoding, batching, keep alive and decoder.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o mqtt_test mqtt_test.cpp
+//       ../lib/tinyhci/tinyhci_mqtt.cpp
+//
+#include "host.h"
+#include "tinyhci_mqtt.h"
+
+#define BROKER_IP                 0x0a000001
+
+static std::string message;               // message being received
+static std::string messages;              // complete messages as topic=payload, each followed by '|'
+
+static void on_message(void *context, const char *topic, const uint8_t *data, size_t size, uint8_t flags)
+{
+  CHECK(context == &messages);
+  if (flags & MQTT_FIRST)
+    message = std::string(topic) + "=";
+  message.append((const char *)data, size);
+  if (flags & MQTT_FINAL)
+    messages += message + "|";
+}
+
+static MqttClient mqtt(on_message, &messages);
+
+static void poll(bool timers_expired)
+{
+  host_timers_expired = timers_expired;
+  mqtt.poll();
+  host_timers_expired = false;
+}
+
+static void test_refused(void)
+{
+  // CONNACK with return code 5, not authorized.
+  host_rx = std::string("\x20\x02\x00\x05", 4);
+  CHECK(mqtt.connect(BROKER_IP, 1883, "dev1", 60) == EFAIL);
+  CHECK(!mqtt.connected());
+  CHECK_BYTES(host_take_tx(), "\x10\x10\x00\x04MQTT\x04\x02\x00\x3c\x00\x04" "dev1");
+}
+
+static void test_connect(void)
+{
+  host_rx = std::string("\x20\x02\x00\x00", 4);
+  CHECK(mqtt.connect(BROKER_IP, 1883, "dev1", 60, "u", "p") == ESUCCESS);
+  CHECK(mqtt.connected());
+  CHECK_BYTES(host_take_tx(), "\x10\x16\x00\x04MQTT\x04\xc2\x00\x3c\x00\x04" "dev1\x00\x01u\x00\x01p");
+}
+
+static void test_subscribe(void)
+{
+  CHECK(mqtt.subscribe("a/#") == ESUCCESS);
+  CHECK_BYTES(host_take_tx(), "\x82\x08\x00\x01\x00\x03" "a/#\x00");
+}
+
+static void test_batching(void)
+{
+  // Small messages wait in the queue, then leave together in one packet.
+  for (int i = 0; i < 5; i++)
+    CHECK(mqtt.publish("t/x", "12.5", 4) == ESUCCESS);
+  CHECK(host_tx.empty());
+
+  CHECK(mqtt.flush() == ESUCCESS);
+  CHECK(host_packets == 1);
+  std::string publish("\x30\x09\x00\x03t/x12.5", 11);
+  CHECK(host_take_tx() == publish + publish + publish + publish + publish);
+
+  // A message too big for the queue is sent behind it, and large packets are split at the MTU.
+  static const char payload[] PROGMEM =
+    "012345678901234567890123456789012345678901234567890123456789"
+    "012345678901234567890123456789012345678901234567890123456789";
+  host_mtu = 60;
+  CHECK(mqtt.publish("t/x", "1", 1) == ESUCCESS);
+  CHECK(mqtt.publish_P("t/big", payload, 120, 1) == ESUCCESS);
+  CHECK(host_packets == 3);
+  CHECK(host_take_tx() == std::string("\x30\x06\x00\x03t/x1", 8) +
+                          std::string("\x31\x7f\x00\x05t/big", 9) + payload);
+  host_mtu = 100;
+}
+
+static void test_decoder(void)
+{
+  // Messages split across receives, one at QoS 1, an empty one, a ping response, and a topic
+  // longer than MQTT_MAX_TOPIC.
+  std::string topic(40, 't');
+  host_rx =
+    std::string("\x30\x0a\x00\x03" "a/b" "hello", 12) +
+    std::string("\x32\x06\x00\x01" "c" "\x00\x05" "z", 8) +
+    std::string("\x30\x05\x00\x03" "a/e", 7) +
+    std::string("\xd0\x00", 2) +
+    std::string("\x30\x2b\x00\x28", 4) + topic + "x";
+  messages.clear();
+  for (int i = 0; i < 100 && !host_rx.empty(); i++)
+    poll(false);
+  CHECK(messages == "a/b=hello|c=z|a/e=|" + topic.substr(0, MQTT_MAX_TOPIC) + "=x|");
+  CHECK(host_tx.empty());
+}
+
+static void test_batch_timer(void)
+{
+  CHECK(mqtt.publish("t/x", "1", 1) == ESUCCESS);
+  poll(false);
+  CHECK(host_tx.empty());
+
+  // Once due, the queue leaves ahead of the ping.
+  poll(true);
+  CHECK(host_packets == 2);
+  CHECK_BYTES(host_take_tx(), "\x30\x06\x00\x03t/x1\xc0\x00");
+}
+
+static void test_keep_alive(void)
+{
+  // A ping answered in time keeps the connection; the next one unanswered closes it.
+  host_rx = std::string("\xd0\x00", 2);
+  poll(false);
+  poll(true);
+  CHECK(mqtt.connected());
+  CHECK_BYTES(host_take_tx(), "\xc0\x00");
+
+  host_closed = -1;
+  poll(true);
+  CHECK(!mqtt.connected());
+  CHECK(host_closed == HOST_SD);
+}
+
+static void test_disconnect(void)
+{
+  host_rx = std::string("\x20\x02\x00\x00", 4);
+  CHECK(mqtt.connect(BROKER_IP, 1883, "dev1", 0) == ESUCCESS);
+  host_take_tx();
+
+  CHECK(mqtt.publish("t/x", "1", 1) == ESUCCESS);
+  mqtt.disconnect();
+  CHECK(!mqtt.connected());
+  CHECK_BYTES(host_take_tx(), "\x30\x06\x00\x03t/x1\xe0\x00");
+}
+
+int main()
+{
+  test_refused();
+  test_connect();
+  test_subscribe();
+  test_batching();
+  test_decoder();
+  test_batch_timer();
+  test_keep_alive();
+  test_disconnect();
+
+  return host_result();
+}
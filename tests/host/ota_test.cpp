@@ -0,0 +1,223 @@
+//
+// OtaDownload into a memory sink: interrupted downloads, resume with Range, restarts and the
+// CRC check.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o ota_test ota_test.cpp
+//       ../lib/tinyhci/tinyhci_ota.cpp ../lib/tinyhci/tinyhci_http_client.cpp
+//
+#include "host.h"
+#include "tinyhci_ota.h"
+
+#define SERVER_IP                 0x0a000001
+#define IMAGE_SIZE                1000    // not a whole number of pages
+
+//
+// MemoryStorage
+//
+// Keeps the image in RAM.  A write completes only after busy has been polled a few times, and
+// the page is copied then, so a download that reuses a page before storage is done with it
+// stores the wrong bytes.
+//
+class MemoryStorage : public OtaStorage
+{
+public:
+  MemoryStorage() { reset(); }
+
+  void reset(void)
+  {
+    image.clear();
+    pending = NULL;
+    commits = 0;
+    committed_size = committed_crc = 0;
+  }
+
+  virtual int write(uint32_t offset, const uint8_t *page, uint16_t size)
+  {
+    CHECK(!pending);
+    CHECK(offset % OTA_PAGE_SIZE == 0);
+    CHECK(size == OTA_PAGE_SIZE || offset + size == IMAGE_SIZE);
+    CHECK(offset <= image.size());
+    pending = page;
+    pending_offset = offset;
+    pending_size = size;
+    countdown = 3;
+    return ESUCCESS;
+  }
+
+  virtual bool busy(void)
+  {
+    if (!pending)
+      return false;
+    if (--countdown)
+      return true;
+
+    image.resize(pending_offset);
+    image.append((const char *)pending, pending_size);
+    pending = NULL;
+    return false;
+  }
+
+  virtual int commit(uint32_t size, uint32_t crc)
+  {
+    CHECK(!pending);
+    commits++;
+    committed_size = size;
+    committed_crc = crc;
+    return ESUCCESS;
+  }
+
+  std::string image;
+  int commits;
+  uint32_t committed_size;
+  uint32_t committed_crc;
+
+private:
+  const uint8_t *pending;
+  uint32_t pending_offset;
+  uint16_t pending_size;
+  int countdown;
+};
+
+static MemoryStorage storage;
+static OtaDownload download(storage);
+static std::string image;
+
+// Bitwise CRC-32, to check the table-driven one.
+static uint32_t crc32(const std::string &data)
+{
+  uint32_t crc = 0xffffffffUL;
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    crc ^= (uint8_t)data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320UL : 0);
+  }
+  return ~crc;
+}
+
+// Feeds the server's answer, closing the connection after it if close is set, and polls the
+// download until it stops making progress.
+static int serve(const std::string &response, bool close)
+{
+  host_rx = response;
+  host_rx_closed = close;
+  int result = OTA_IN_PROGRESS;
+  for (int i = 0; i < 10000 && result == OTA_IN_PROGRESS && (!host_rx.empty() || close); i++)
+    result = download.poll();
+  host_rx_closed = false;
+  return result;
+}
+
+static std::string ok(size_t from)
+{
+  char header[80];
+  sprintf(header, "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n", (unsigned)(image.size() - from));
+  return header;
+}
+
+static std::string partial(size_t from)
+{
+  char header[120];
+  sprintf(header, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %u-%u/%u\r\nContent-Length: %u\r\n\r\n",
+          (unsigned)from, (unsigned)image.size() - 1, (unsigned)image.size(), (unsigned)(image.size() - from));
+  return header;
+}
+
+// Starts a download and drops the connection after 300 bytes of the image.
+static void interrupted(uint32_t expected_crc)
+{
+  storage.reset();
+  CHECK(download.begin(SERVER_IP, 80, "updates.example.com", "/fw.bin", expected_crc) == ESUCCESS);
+  CHECK(host_take_tx() == "GET /fw.bin HTTP/1.1\r\nHost: updates.example.com\r\n\r\n");
+
+  CHECK(serve(ok(0) + image.substr(0, 300), true) == EFAIL);
+  CHECK(download.written() == 2 * OTA_PAGE_SIZE);
+  CHECK(download.size() == IMAGE_SIZE);
+}
+
+static void test_crc32(void)
+{
+  const uint8_t check[] = "123456789";
+  CHECK(~ota_crc32(0xffffffffUL, check, 9) == 0xcbf43926UL);
+}
+
+static void test_resume(void)
+{
+  interrupted(crc32(image));
+
+  // The rest is asked for from the last page handed to storage.
+  CHECK(download.resume() == ESUCCESS);
+  CHECK(host_take_tx() == "GET /fw.bin HTTP/1.1\r\nHost: updates.example.com\r\nRange: bytes=256-\r\n\r\n");
+  CHECK(serve(partial(256) + image.substr(256), false) == OTA_COMPLETE);
+
+  CHECK(storage.image == image);
+  CHECK(storage.commits == 1);
+  CHECK(storage.committed_size == IMAGE_SIZE);
+  CHECK(storage.committed_crc == crc32(image));
+  CHECK(download.crc() == crc32(image));
+}
+
+static void test_restart(void)
+{
+  // A server that ignores the range sends the whole image again, which is stored from the start.
+  interrupted(crc32(image));
+  CHECK(download.resume() == ESUCCESS);
+  host_take_tx();
+  CHECK(serve(ok(0) + image, false) == OTA_COMPLETE);
+
+  CHECK(storage.image == image);
+  CHECK(storage.commits == 1);
+  CHECK(storage.committed_crc == crc32(image));
+}
+
+static void test_wrong_range(void)
+{
+  // A 206 from another offset is refused rather than stored in the wrong place.
+  interrupted(0);
+  CHECK(download.resume() == ESUCCESS);
+  host_take_tx();
+  CHECK(serve(partial(0) + image, false) == EFAIL);
+  CHECK(download.written() == 2 * OTA_PAGE_SIZE);
+  CHECK(storage.commits == 0);
+}
+
+static void test_bad_crc(void)
+{
+  storage.reset();
+  CHECK(download.begin(SERVER_IP, 80, "updates.example.com", "/fw.bin", crc32(image) ^ 1) == ESUCCESS);
+  host_take_tx();
+  CHECK(serve(ok(0) + image, false) == EFAIL);
+  CHECK(storage.image == image);
+  CHECK(storage.commits == 0);
+}
+
+static void test_stall(void)
+{
+  // A server that stops sending fails the download once the idle timer expires.
+  storage.reset();
+  CHECK(download.begin(SERVER_IP, 80, "updates.example.com", "/fw.bin") == ESUCCESS);
+  host_take_tx();
+  CHECK(serve(ok(0) + image.substr(0, 500), false) == OTA_IN_PROGRESS);
+  CHECK(download.poll() == OTA_IN_PROGRESS);
+
+  host_timers_expired = true;
+  CHECK(download.poll() == EFAIL);
+  host_timers_expired = false;
+  CHECK(download.written() == 3 * OTA_PAGE_SIZE);
+}
+
+int main()
+{
+  for (int i = 0; i < IMAGE_SIZE; i++)
+    image += (char)(i * 7 + (i >> 8));
+  host_rx_piece = 50;
+
+  test_crc32();
+  test_resume();
+  test_restart();
+  test_wrong_range();
+  test_bad_crc();
+  test_stall();
+
+  return host_result();
+}
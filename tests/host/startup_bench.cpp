@@ -0,0 +1,594 @@
+//
+// Boot-to-first-response benchmark.
+//
+// Runs the driver itself against a model of the CC3000 on the far side of the SPI bus, and
+// brings up a web server the way tests/server does, until the first page has been served.
+// The startup profile is then printed, phase by phase, with the command and SPI traffic it
+// took; and the program fails if a phase is missing or out of order.
+//
+// Time is simulated.  The MCU side costs a fixed time per SPI byte, pin access and clock read,
+// roughly those of a 16 MHz AVR.  The CC3000 side takes the latencies below, which are round
+// figures, not measurements of a module.  What the benchmark shows is how the driver's own
+// waits and round trips add up on top of them, so a change to the startup path shows up as a
+// change in the report; for a real board's numbers, read the profile from its serial port.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o startup_bench startup_bench.cpp
+//       ../lib/tinyhci/tinyhci.cpp ../lib/tinyhci/tinyhci_http.cpp
+//       ../lib/tinyhci/tinyhci_http_parser.cpp
+//
+#include <Arduino.h>
+#include <SPI.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "tinyhci.h"
+#include "tinyhci_http.h"
+
+//
+// MCU costs, in nanoseconds.
+//
+#define MCU_SPI_NS                1500    // one byte at 8 MHz, and the loop around it
+#define MCU_PIN_NS                4000    // digitalRead or digitalWrite
+#define MCU_CLOCK_NS              2000    // millis or micros
+
+//
+// CC3000 latencies, in microseconds.
+//
+#define CC3K_POWER_UP_US          100000  // EN high to IRQ low, ready for the first command
+#define CC3K_LINK_START_US        300000  // firmware start
+#define CC3K_ASSERT_US            50      // IRQ asserted after nCS goes low
+#define CC3K_GAP_US               50      // IRQ held high after a transfer
+#define CC3K_COMMAND_US           500     // response to an ordinary command
+#define CC3K_ASSOCIATE_US         1500000 // wlan_connect to associated
+#define CC3K_DHCP_US              500000  // associated to an address
+#define CC3K_TX_US                5000    // a sent buffer is freed
+#define CLIENT_US                 200000  // listen to the first client connecting
+
+#define RUN_LIMIT_US              120000000
+
+// Pins and opcodes, as in tinyhci.cpp.
+#define CC3K_CS_PIN               6
+#define CC3K_IRQ_PIN              7
+#define CC3K_EN_PIN               5
+
+#define CC3K_TYPE_CMND            0x01
+#define CC3K_TYPE_DATA            0x02
+#define CC3K_TYPE_EVNT            0x04
+
+#define CC3K_CMND_WLAN_CONNECT    0x0001
+#define CC3K_CMND_SET_POLICY      0x0004
+#define CC3K_CMND_EVENT_MASK      0x0008
+#define CC3K_CMND_SEND            0x0081
+#define CC3K_DATA_RECV            0x0085
+#define CC3K_CMND_READ_SP_VERSION 0x0207
+#define CC3K_CMND_SOCKET          0x1001
+#define CC3K_CMND_BIND            0x1002
+#define CC3K_CMND_RECV            0x1004
+#define CC3K_CMND_ACCEPT          0x1005
+#define CC3K_CMND_LISTEN          0x1006
+#define CC3K_CMND_SELECT          0x1008
+#define CC3K_CMND_SETSOCKOPT      0x1009
+#define CC3K_CMND_CLOSE_SOCKET    0x100B
+#define CC3K_NETAPP_SET_TIMERS    0x2009
+#define CC3K_CMND_LINK_START      0x4000
+#define CC3K_CMND_BUFFER_SIZE     0x400B
+
+#define CC3K_BUFFERS              6
+#define CC3K_BUFFER_SIZE          1468
+#define CC3K_SP_VERSION           ((1UL << 16) | (28UL << 24))    // 1.28
+
+//
+// Arduino
+//
+HardwareSerial Serial;
+SPIClass SPI;
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return putchar(c) == EOF ? 0 : 1;
+}
+
+char *utoa(unsigned value, char *buffer, int radix)
+{
+  return ultoa(value, buffer, radix);
+}
+
+char *ultoa(unsigned long value, char *buffer, int radix)
+{
+  sprintf(buffer, radix == 16 ? "%lX" : "%lu", value);
+  return buffer;
+}
+
+//
+// CC3000 model
+//
+// Packets to the MCU wait in cc3k_out until due; the CC3000 then pulls IRQ low and the MCU
+// reads the first due one.  A write starts when the MCU pulls nCS low with IRQ high, and is
+// answered once nCS goes high again.
+//
+struct packet
+{
+  uint64_t due;                           // ns
+  std::string bytes;                      // from the packet type on
+};
+
+struct socket_model
+{
+  bool open;
+  bool nonblock;
+  std::string rx;                         // from the peer, not yet received
+  std::string tx;                         // sent to the peer
+};
+
+enum { XFER_NONE, XFER_WRITE, XFER_READ };
+
+static uint64_t now;                      // ns since power on
+static bool en, cs_low, irq_low, edge;
+static bool running, first_command;
+static uint64_t ready_at, assert_at, idle_at;
+static void (*isr)(void);
+static bool interrupts_enabled = true, in_isr;
+
+static int xfer;
+static std::string xfer_bytes;
+static size_t xfer_pos;
+static std::vector<packet> cc3k_out;
+static packet reading;
+
+static uint16_t event_mask;
+static socket_model sockets[8];
+static uint64_t client_at;
+static int client_sd = -1;
+static uint64_t first_close;
+
+static unsigned long commands, events, spi_bytes;
+
+static std::string u16(uint16_t v)
+{
+  return std::string(1, (char)v) + (char)(v >> 8);
+}
+
+static std::string u32(uint32_t v)
+{
+  return u16(v) + u16(v >> 16);
+}
+
+static uint32_t get_u32(const std::string &bytes, size_t offset)
+{
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = (v << 8) | (uint8_t)bytes[offset + i];
+  return v;
+}
+
+static void queue(uint64_t due, const std::string &bytes)
+{
+  packet p = { due, bytes };
+  cc3k_out.push_back(p);
+}
+
+static void event(uint16_t opcode, const std::string &args, uint64_t delay_us = CC3K_COMMAND_US)
+{
+  if ((opcode & 0x8000) && (opcode & event_mask & 0x7fff))
+    return;
+  queue(now + delay_us * 1000, std::string(1, (char)CC3K_TYPE_EVNT) + u16(opcode) + (char)args.size() + args);
+}
+
+static void result(uint16_t opcode, uint32_t value)
+{
+  event(opcode, std::string(1, '\0') + u32(value));
+}
+
+static int free_socket(void)
+{
+  for (int sd = 0; sd < 8; sd++)
+    if (!sockets[sd].open)
+      return sd;
+  return -1;
+}
+
+static void accept_reply(uint32_t sd, uint64_t delay_us)
+{
+  int32_t client = ESOCKINPROGRESS;
+  if (client_at && now + delay_us * 1000 >= client_at && client_sd < 0)
+  {
+    client = client_sd = free_socket();
+    sockets[client].open = true;
+    sockets[client].rx = "GET / HTTP/1.1\r\nHost: device\r\nConnection: close\r\n\r\n";
+  }
+  event(CC3K_CMND_ACCEPT, std::string(1, '\0') + u32(sd) + u32(client) + std::string(8, '\0'), delay_us);
+}
+
+static void command(uint16_t opcode, const std::string &args)
+{
+  commands++;
+  switch (opcode)
+  {
+  case CC3K_CMND_LINK_START:
+    event(opcode, std::string(1, '\0'), CC3K_LINK_START_US);
+    break;
+
+  case CC3K_CMND_BUFFER_SIZE:
+    event(opcode, std::string(1, '\0') + (char)CC3K_BUFFERS + u16(CC3K_BUFFER_SIZE));
+    break;
+
+  case CC3K_CMND_EVENT_MASK:
+    event_mask = get_u32(args, 0);
+    result(opcode, 0);
+    break;
+
+  case CC3K_CMND_READ_SP_VERSION:
+    result(opcode, CC3K_SP_VERSION);
+    break;
+
+  case CC3K_CMND_WLAN_CONNECT:
+    result(opcode, 0);
+    event(HCI_EVNT_WLAN_UNSOL_CONNECT, "", CC3K_ASSOCIATE_US);
+    event(HCI_EVNT_WLAN_UNSOL_DHCP, std::string("\0\x0b\x00\xa8\xc0", 5) + std::string(16, '\0'),
+          CC3K_ASSOCIATE_US + CC3K_DHCP_US);
+    break;
+
+  case CC3K_CMND_SOCKET:
+    {
+      int sd = free_socket();
+      if (sd >= 0)
+        sockets[sd] = socket_model();
+      if (sd >= 0)
+        sockets[sd].open = true;
+      result(opcode, sd);
+    }
+    break;
+
+  case CC3K_CMND_SETSOCKOPT:
+    if (get_u32(args, 8) == SOCKOPT_ACCEPT_NONBLOCK)
+      sockets[get_u32(args, 0) & 7].nonblock = args[20] == SOCK_ON;
+    result(opcode, 0);
+    break;
+
+  case CC3K_CMND_LISTEN:
+    client_at = now + CLIENT_US * 1000ULL;
+    result(opcode, 0);
+    break;
+
+  case CC3K_CMND_ACCEPT:
+    {
+      uint32_t sd = get_u32(args, 0);
+      uint64_t delay_us = CC3K_COMMAND_US;
+      if (!sockets[sd & 7].nonblock && client_at > now)
+        delay_us += (client_at - now) / 1000;
+      accept_reply(sd, delay_us);
+    }
+    break;
+
+  case CC3K_CMND_SELECT:
+    {
+      uint32_t requested = get_u32(args, 24), readable = 0;
+      for (int sd = 0; sd < 8; sd++)
+        if ((requested & (1 << sd)) && !sockets[sd].rx.empty())
+          readable |= 1 << sd;
+      uint64_t delay_us = CC3K_COMMAND_US;
+      if (!readable && get_u32(args, 20))
+        delay_us += get_u32(args, 36) * 1000000ULL + get_u32(args, 40);
+      event(opcode, std::string(1, '\0') + u32(readable ? 1 : 0) + u32(readable) + u32(0) + u32(0), delay_us);
+    }
+    break;
+
+  case CC3K_CMND_RECV:
+    {
+      uint32_t sd = get_u32(args, 0) & 7;
+      std::string data = sockets[sd].rx.substr(0, get_u32(args, 4));
+      sockets[sd].rx.erase(0, data.size());
+      event(opcode, std::string(1, '\0') + u32(sd) + u32(data.size()) + u32(0));
+      if (!data.empty())
+        queue(now + CC3K_COMMAND_US * 1000, std::string(1, (char)CC3K_TYPE_DATA) + (char)CC3K_DATA_RECV +
+              (char)24 + u16(24 + data.size()) + std::string(24, '\0') + data);
+    }
+    break;
+
+  case CC3K_CMND_CLOSE_SOCKET:
+    {
+      uint32_t sd = get_u32(args, 0) & 7;
+      sockets[sd].open = false;
+      if ((int)sd == client_sd && !first_close)
+        first_close = now;
+      result(opcode, 0);
+    }
+    break;
+
+  case CC3K_CMND_SET_POLICY:
+  case CC3K_CMND_BIND:
+  case CC3K_NETAPP_SET_TIMERS:
+    result(opcode, 0);
+    break;
+
+  default:
+    printf("unexpected command %04x\n", opcode);
+    result(opcode, (uint32_t)EFAIL);
+    break;
+  }
+}
+
+static void sent(const std::string &args, const std::string &data)
+{
+  commands++;
+  uint32_t sd = get_u32(args, 0) & 7;
+  sockets[sd].tx += data;
+  event(HCI_EVNT_SEND, std::string(1, '\0') + u32(sd) + u32(data.size()));
+  event(HCI_EVNT_DATA_UNSOL_FREE_BUFF, std::string(1, '\0') + u16(1) + (char)sd + '\0' + u16(1), CC3K_TX_US);
+}
+
+// Handles a packet written by the MCU: the SPI header, then the packet from its type on.
+static void written(const std::string &bytes)
+{
+  if (bytes.size() < 9 || bytes[0] != 0x01)
+  {
+    printf("malformed write of %u bytes\n", (unsigned)bytes.size());
+    return;
+  }
+
+  uint8_t type = bytes[5];
+  if (type == CC3K_TYPE_CMND)
+  {
+    uint16_t opcode = (uint8_t)bytes[6] | ((uint8_t)bytes[7] << 8);
+    command(opcode, bytes.substr(9, (uint8_t)bytes[8]));
+  }
+  else if (type == CC3K_TYPE_DATA && (uint8_t)bytes[6] == CC3K_CMND_SEND)
+  {
+    uint8_t args_size = bytes[7];
+    uint16_t total = (uint8_t)bytes[8] | ((uint8_t)bytes[9] << 8);
+    sent(bytes.substr(10, args_size), bytes.substr(10 + args_size, total - args_size));
+  }
+}
+
+static void set_irq(bool low)
+{
+  if (low && !irq_low)
+    edge = true;
+  irq_low = low;
+}
+
+// Index of the first due packet, or -1.
+static int next_packet(void)
+{
+  int next = -1;
+  for (size_t i = 0; i < cc3k_out.size(); i++)
+    if (cc3k_out[i].due <= now && (next < 0 || cc3k_out[i].due < cc3k_out[next].due))
+      next = i;
+  return next;
+}
+
+static void tick(void)
+{
+  if (now > RUN_LIMIT_US * 1000ULL)
+  {
+    printf("no response after %u s\n", RUN_LIMIT_US / 1000000);
+    exit(1);
+  }
+
+  if (en && !running && now >= ready_at)
+  {
+    running = first_command = true;
+    set_irq(true);
+  }
+
+  if (cs_low && assert_at && now >= assert_at)
+  {
+    assert_at = 0;
+    xfer = XFER_WRITE;
+    set_irq(true);
+  }
+
+  if (running && !first_command && !cs_low && !irq_low && now >= idle_at && next_packet() >= 0)
+    set_irq(true);
+
+  while (edge && isr && interrupts_enabled && !in_isr)
+  {
+    edge = false;
+    in_isr = true;
+    isr();
+    in_isr = false;
+  }
+}
+
+static void advance(uint64_t ns)
+{
+  now += ns;
+  tick();
+}
+
+uint8_t SPIClass::transfer(uint8_t out)
+{
+  advance(MCU_SPI_NS);
+  spi_bytes++;
+  if (xfer == XFER_WRITE)
+  {
+    xfer_bytes += (char)out;
+    return 0;
+  }
+  if (xfer != XFER_READ)
+    return 0;
+
+  size_t i = xfer_pos++;
+  size_t size = reading.bytes.size();
+  if (i == 3)
+    return size >> 8;
+  if (i == 4)
+    return size & 0xff;
+  return i >= 5 && i - 5 < size ? reading.bytes[i - 5] : 0;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  advance(MCU_PIN_NS);
+
+  if (pin == CC3K_EN_PIN && value == HIGH && !en)
+  {
+    en = true;
+    ready_at = now + CC3K_POWER_UP_US * 1000ULL;
+  }
+  else if (pin == CC3K_EN_PIN && value == LOW)
+  {
+    en = running = first_command = false;
+    cc3k_out.clear();
+    xfer = XFER_NONE;
+    set_irq(false);
+  }
+  else if (pin == CC3K_CS_PIN && value == LOW && !cs_low)
+  {
+    cs_low = true;
+    xfer_bytes.clear();
+    xfer_pos = 0;
+    if (!running)
+    {
+      xfer = XFER_NONE;
+    }
+    else if (first_command)
+    {
+      xfer = XFER_WRITE;
+    }
+    else if (irq_low)
+    {
+      int next = next_packet();
+      xfer = XFER_READ;
+      reading = cc3k_out[next];
+      cc3k_out.erase(cc3k_out.begin() + next);
+      events++;
+    }
+    else
+    {
+      xfer = XFER_NONE;
+      assert_at = now + CC3K_ASSERT_US * 1000;
+    }
+  }
+  else if (pin == CC3K_CS_PIN && value == HIGH && cs_low)
+  {
+    cs_low = false;
+    assert_at = 0;
+    idle_at = now + CC3K_GAP_US * 1000;
+    if (xfer == XFER_WRITE)
+      written(xfer_bytes);
+    first_command = first_command && xfer != XFER_WRITE;
+    xfer = XFER_NONE;
+    set_irq(first_command);
+  }
+
+  tick();
+}
+
+int digitalRead(uint8_t pin)
+{
+  advance(MCU_PIN_NS);
+  return pin == CC3K_IRQ_PIN && irq_low ? LOW : HIGH;
+}
+
+void pinMode(uint8_t, uint8_t)
+{
+  advance(MCU_PIN_NS);
+}
+
+unsigned long millis(void)
+{
+  advance(MCU_CLOCK_NS);
+  return now / 1000000;
+}
+
+unsigned long micros(void)
+{
+  advance(MCU_CLOCK_NS);
+  return now / 1000;
+}
+
+void delay(unsigned long ms)
+{
+  while (ms--)
+    advance(1000000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  advance(us * 1000ULL);
+}
+
+void attachInterrupt(uint8_t, void (*handler)(void), int)
+{
+  isr = handler;
+  edge = false;
+}
+
+void detachInterrupt(uint8_t)
+{
+  isr = NULL;
+}
+
+void interrupts(void)
+{
+  interrupts_enabled = true;
+  tick();
+}
+
+void noInterrupts(void)
+{
+  interrupts_enabled = false;
+}
+
+//
+// Sketch
+//
+// tests/server, less the serial output.
+//
+const char index_path[] PROGMEM = "/";
+const char index_body[] PROGMEM = "<!doctype html>\n<html><body>Hello from tinyhci!</body></html>\n";
+const char html_type[] PROGMEM = "text/html";
+
+static void serve_index(const HttpRequest &, HttpResponse &response)
+{
+  response.begin(200, html_type, sizeof(index_body) - 1);
+  response.write_P(index_body, sizeof(index_body) - 1);
+  response.flush();
+  hci_profile_mark(HCI_PROFILE_RESPONSE);
+}
+
+const HttpRoute routes[] PROGMEM =
+{
+  { index_path, html_type, NULL, 0, serve_index },
+};
+
+static HttpServer server(routes, sizeof(routes) / sizeof(routes[0]));
+
+int main()
+{
+  wlan_init();
+
+  wlan_ioctl_set_connection_policy(false, false, false);
+  wlan_connect(WLAN_SEC_WPA2, "bench", 5, 0, (unsigned char *)"password", 8);
+  while (!wifi_dhcp)
+    millis();
+
+  unsigned long dhcp = 14400, arp = 3600, keepalive = 30, inactivity = 0;
+  netapp_timeout_values(&dhcp, &arp, &keepalive, &inactivity);
+  server.begin(80);
+
+  while (!hci_profile_time(HCI_PROFILE_RESPONSE))
+    server.poll();
+  while (!first_close)
+    server.poll();
+
+  hci_profile_report();
+  printf("commands: %lu, events and data: %lu, SPI bytes: %lu\n", commands, events, spi_bytes);
+
+  int failures = 0;
+  for (uint8_t phase = 0; phase < HCI_PROFILE_PHASES; phase++)
+  {
+    if (!hci_profile_time(phase) || (phase && hci_profile_time(phase) < hci_profile_time(phase - 1)))
+    {
+      printf("phase %u missing or out of order\n", phase);
+      failures++;
+    }
+  }
+  if (sockets[client_sd].tx.compare(0, 15, "HTTP/1.1 200 OK") != 0)
+  {
+    printf("unexpected response: %s\n", sockets[client_sd].tx.c_str());
+    failures++;
+  }
+  return failures ? 1 : 0;
+}
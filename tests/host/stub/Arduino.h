@@ -0,0 +1,92 @@
+// Just enough of Arduino.h to build the protocol modules on the host; see ../host.h.  The pin,
+// interrupt and timing functions are only defined by programs that build tinyhci.cpp itself,
+// see ../startup_bench.cpp.
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+// tinyhci.h declares the CC3000's own select, fd_set and timeval, so keep the C library's out.
+#define _SYS_SELECT_H
+#define __timeval_defined
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#undef __FD_SETSIZE
+
+// Flash is ordinary memory on the host.
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+
+#define LOW                       0
+#define HIGH                      1
+#define INPUT                     0
+#define OUTPUT                    1
+#define INPUT_PULLUP              2
+#define FALLING                   2
+#define DEC                       10
+#define HEX                       16
+
+char *utoa(unsigned value, char *buffer, int radix);
+char *ultoa(unsigned long value, char *buffer, int radix);
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void attachInterrupt(uint8_t number, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t number);
+void interrupts(void);
+void noInterrupts(void);
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--)
+      n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(unsigned long n, int base = DEC)
+  {
+    char buffer[12];
+    return write(ultoa(n, buffer, base));
+  }
+  size_t print(long n, int base = DEC)
+  {
+    if (n >= 0 || base != DEC)
+      return print((unsigned long)n, base);
+    return write("-") + print((unsigned long)-n, base);
+  }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t println(void) { return write("\r\n"); }
+  template <typename T> size_t println(T value) { return print(value) + println(); }
+  template <typename T> size_t println(T value, int base) { return print(value, base) + println(); }
+  virtual void flush() {}
+};
+
+class HardwareSerial : public Print
+{
+public:
+  virtual size_t write(uint8_t c);
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
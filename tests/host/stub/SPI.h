@@ -0,0 +1,23 @@
+// Just enough of SPI.h to build tinyhci.cpp on the host; see ../startup_bench.cpp.
+#ifndef __HOST_SPI_H__
+#define __HOST_SPI_H__
+
+#include <stdint.h>
+
+#define SPI_MODE1                 1
+#define MSBFIRST                  1
+#define SPI_CLOCK_DIV2            4
+
+class SPIClass
+{
+public:
+  void begin(void) {}
+  void setDataMode(uint8_t) {}
+  void setBitOrder(uint8_t) {}
+  void setClockDivider(uint8_t) {}
+  uint8_t transfer(uint8_t out);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,168 @@
+//
+// WebSocket handshake and framing, through HttpServer and HttpParser.
+//
+//   g++ -std=gnu++11 -Wall -Istub -I../lib/tinyhci -o websocket_test websocket_test.cpp
+//       ../lib/tinyhci/tinyhci_websocket.cpp ../lib/tinyhci/tinyhci_http.cpp
+//       ../lib/tinyhci/tinyhci_http_parser.cpp
+//
+#include "host.h"
+#include "tinyhci_http.h"
+#include "tinyhci_websocket.h"
+
+static std::string message;               // message being received
+static std::string messages;              // complete messages, each followed by '|'
+static uint8_t message_opcode;
+
+static void on_message(WebSocket &, uint8_t opcode, const uint8_t *data, size_t size, uint8_t flags)
+{
+  if (flags & WEBSOCKET_FIRST)
+  {
+    message.clear();
+    message_opcode = opcode;
+  }
+  CHECK(opcode == message_opcode);
+  message.append((const char *)data, size);
+  if (flags & WEBSOCKET_FINAL)
+    messages += message + "|";
+}
+
+static WebSocket socket_a(on_message);
+static WebSocket *upgrading;
+
+static void serve_ws(const HttpRequest &request, HttpResponse &response)
+{
+  upgrading->accept(request, response);
+}
+
+const char ws_path[] PROGMEM = "/ws";
+const HttpRoute routes[] PROGMEM =
+{
+  { ws_path, NULL, NULL, 0, serve_ws, NULL, 0 },
+};
+
+static HttpServer server(routes, sizeof(routes) / sizeof(routes[0]));
+
+// Connects a client to server and upgrades it to socket; returns the server's response.
+static std::string handshake(WebSocket &socket)
+{
+  upgrading = &socket;
+  host_accept_sd = HOST_SD;
+  host_rx =
+    "GET /ws HTTP/1.1\r\n"
+    "Host: device\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+  for (int i = 0; i < 100 && !host_rx.empty(); i++)
+    server.poll();
+  return host_take_tx();
+}
+
+static void receive(WebSocket &socket, const std::string &frames)
+{
+  host_rx = frames;
+  for (int i = 0; i < 100 && !host_rx.empty(); i++)
+    socket.poll();
+}
+
+static void test_handshake(void)
+{
+  std::string response = handshake(socket_a);
+
+  // The key and accept value are the example from RFC 6455.
+  CHECK(response.find("HTTP/1.1 101 ") == 0);
+  CHECK(response.find("Upgrade: websocket\r\n") != std::string::npos);
+  CHECK(response.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != std::string::npos);
+  CHECK(socket_a.connected());
+  CHECK(host_closed == -1);
+}
+
+static void test_masked_text(void)
+{
+  // "Hello", masked, from RFC 6455 section 5.7.
+  messages.clear();
+  receive(socket_a, std::string("\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58", 11));
+  CHECK(messages == "Hello|");
+  CHECK(message_opcode == WEBSOCKET_TEXT);
+  CHECK(host_take_tx().empty());
+}
+
+static void test_fragments_and_ping(void)
+{
+  // "abc" and "de" in two fragments, with a ping between them, then an empty message.
+  messages.clear();
+  receive(socket_a, std::string(
+    "\x02\x83\x00\x00\x00\x00" "abc"
+    "\x89\x82\x00\x00\x00\x00" "pq"
+    "\x80\x82\x01\x02\x03\x04" "\x65\x67"
+    "\x82\x80\x09\x09\x09\x09", 31));
+  CHECK(messages == "abcde||");
+  CHECK(message_opcode == WEBSOCKET_BINARY);
+  CHECK_BYTES(host_take_tx(), "\x8a\x02pq");
+}
+
+static void test_send(void)
+{
+  std::string text(300, 'x');
+  CHECK(socket_a.send(WEBSOCKET_TEXT, text.data(), text.size()) == ESUCCESS);
+  CHECK(host_packets == 4);
+  std::string tx = host_take_tx();
+  CHECK(tx.size() == 304);
+  CHECK(tx.compare(0, 4, std::string("\x81\x7e\x01\x2c", 4)) == 0);
+  CHECK(tx.compare(4, std::string::npos, text) == 0);
+
+  CHECK(socket_a.send_text("hi") == ESUCCESS);
+  CHECK_BYTES(host_take_tx(), "\x81\x02hi");
+}
+
+static void test_close(void)
+{
+  receive(socket_a, std::string("\x88\x82\x00\x00\x00\x00\x03\xe8", 8));
+  CHECK_BYTES(host_take_tx(), "\x88\x02\x03\xe8");
+  CHECK(!socket_a.connected());
+  CHECK(host_closed == HOST_SD);
+}
+
+static void test_protocol_error(void)
+{
+  WebSocket socket_b(on_message);
+  handshake(socket_b);
+  CHECK(socket_b.connected());
+
+  // Client frames must be masked.
+  host_closed = -1;
+  receive(socket_b, std::string("\x81\x02hi", 4));
+  CHECK_BYTES(host_take_tx(), "\x88\x02\x03\xea");
+  CHECK(!socket_b.connected());
+  CHECK(host_closed == HOST_SD);
+}
+
+static void test_not_upgrade(void)
+{
+  // The handler refuses requests that are not upgrades.
+  WebSocket socket_c(on_message);
+  upgrading = &socket_c;
+  host_accept_sd = HOST_SD;
+  host_rx = "GET /ws HTTP/1.1\r\nHost: device\r\n\r\n";
+  for (int i = 0; i < 100 && !host_rx.empty(); i++)
+    server.poll();
+  CHECK(host_take_tx().find("HTTP/1.1 400 ") == 0);
+  CHECK(!socket_c.connected());
+}
+
+int main()
+{
+  CHECK(server.begin(80) == ESUCCESS);
+
+  test_handshake();
+  test_masked_text();
+  test_fragments_and_ping();
+  test_send();
+  test_close();
+  test_protocol_error();
+  test_not_upgrade();
+
+  return host_result();
+}
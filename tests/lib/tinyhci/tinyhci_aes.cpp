@@ -0,0 +1 @@
+../../../tinyhci_aes.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_aes.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_client.h
\ No newline at end of file
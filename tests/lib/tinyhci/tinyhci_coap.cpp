@@ -0,0 +1 @@
+../../../tinyhci_coap.cpp
\ No newline at end of file
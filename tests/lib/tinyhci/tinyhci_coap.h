@@ -0,0 +1 @@
+../../../tinyhci_coap.h
\ No newline at end of file
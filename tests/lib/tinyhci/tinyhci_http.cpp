@@ -0,0 +1 @@
+../../../tinyhci_http.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_http.h
\ No newline at end of file
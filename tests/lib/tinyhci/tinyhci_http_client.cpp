@@ -0,0 +1 @@
+../../../tinyhci_http_client.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_http_client.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_http_parser.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_http_parser.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_mqtt.cpp
\ No newline at end of file
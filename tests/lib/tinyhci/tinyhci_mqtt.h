@@ -0,0 +1 @@
+../../../tinyhci_mqtt.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_ota.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_ota.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_sntp.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_sntp.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_socket.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_websocket.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../tinyhci_websocket.h
\ No newline at end of file
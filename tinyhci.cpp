@@ -30,11 +30,6 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #define wdt_reset()
 #endif
 
-//
-// Define the fw version of the CC3000 module you are running against.
-//
-#define CC3000_FW_VERSION         132
-
 //
 // Redefine these based on your particular hardware.
 //
@@ -43,6 +38,43 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #define CC3K_EN_PIN               5
 #define CC3K_IRQ_NUM              4
 
+//
+// Power-up timing, in milliseconds.  The CC3000 is held off for CC3K_POWER_OFF_TIME, after which
+// the init sequence follows the IRQ line rather than fixed delays; as the TI host driver does.
+// A failed start is retried up to CC3K_INIT_ATTEMPTS times.
+//
+#define CC3K_POWER_OFF_TIME       50
+#define CC3K_INIT_ATTEMPTS        3
+
+//
+// Deadlines, in milliseconds, for the various waits on the CC3000.
+//
+#define HCI_TIMEOUT_POWER_UP      5000  // IRQ low after CC3K_EN_PIN goes high
+#define HCI_TIMEOUT_ASSERT        1000  // IRQ assertion after nCS goes low
+#define HCI_TIMEOUT_DATA          5000  // data message following a recv response
+#define HCI_TIMEOUT_BUFFERS       5000  // free buffers for send / closesocket
+#define HCI_TIMEOUT_COMMAND       1000  // response to a command that does not block
+#define HCI_TIMEOUT_NVMEM         5000  // response to an NVMEM command, which may erase flash
+#define HCI_TIMEOUT_NONE          0xffffffff
+#define HCI_TIMEOUT_WATCHDOG      600000  // silence from the CC3000 that ends a HCI_TIMEOUT_NONE wait
+
+//
+// The IRQ deassert wait runs inside the interrupt handler where millis() does not advance,
+// so it is bounded by a number of polls instead.
+//
+#define HCI_DEASSERT_POLLS        10000
+
+//
+// The health monitor probes the CC3000 when it has been silent for this long.  Subscribing to
+// HCI_EVNT_WLAN_KEEPALIVE avoids the probes, at the cost of an event per keepalive.
+//
+#define HCI_HEALTH_PROBE_INTERVAL 15000
+
+//
+// Maximum number of event subscriptions, see wifi_subscribe.
+//
+#define HCI_MAX_SUBSCRIPTIONS     8
+
 //
 // Global variables
 //
@@ -58,6 +90,8 @@ static volatile uint8_t hci_pending_event_available;
 static volatile uint16_t hci_pending_event = 0xffff;
 
 static uint16_t hci_buffer_size;
+static uint16_t hci_sp_version;
+static uint8_t hci_capabilities;
 static uint8_t hci_buffer_count;
 static volatile uint8_t hci_available_buffer_count;
 
@@ -66,12 +100,119 @@ static uint8_t hci_pad;
 
 static volatile uint8_t hci_state;
 
+static hci_timer hci_deadline;
+static uint8_t hci_failed;
+static uint8_t hci_recovering;
+static volatile uint8_t hci_locked;
+
+static uint8_t hci_init_state;
+static uint8_t hci_init_attempts;
+static uint8_t hci_init_irq_high;
+static hci_timer hci_init_timer;
+static uint32_t hci_init_start;
+static uint32_t hci_init_time;
+
+static uint32_t hci_profile[HCI_PROFILE_PHASES];
+
+typedef struct
+{
+  uint16_t event;
+  wifi_event_handler handler;
+} hci_subscription;
+
+static hci_subscription hci_subscriptions[HCI_MAX_SUBSCRIPTIONS];
+
+//
+// Intent log
+//
+// Records how the application configured the link and its bound sockets, so that both can be
+// recreated after the CC3000 is recovered from a lockup.  See wlan_health_poll.
+//
+// Note that the SSID, key and BSSID are recorded by pointer, so the buffers passed to
+// wlan_connect must stay valid.
+//
+#define HCI_INTENT_POLICY               0x01
+#define HCI_INTENT_CONNECT              0x02
+#define HCI_INTENT_TIMEOUTS             0x04
+
+#define HCI_INTENT_BOUND                0x01
+#define HCI_INTENT_LISTENING            0x02
+#define HCI_INTENT_ACCEPT_NONBLOCK      0x04
+#define HCI_INTENT_RECV_NONBLOCK        0x08
+
+//
+// Socket table
+//
+// Tracks the state of each socket descriptor alongside its intent.  Sockets are marked peer
+// closed by HCI_EVNT_WLAN_UNSOL_TCP_CLOSE_WAIT, after which recv and send fail fast, and
+// credits count the data buffers sent on the socket but not yet freed by the CC3000.
+//
+#define HCI_SOCKET_OPEN                 0x01
+#define HCI_SOCKET_CONNECTED            0x02
+#define HCI_SOCKET_PEER_CLOSED          0x04
+
+typedef struct
+{
+  uint8_t flags;
+  uint8_t policy[3];
+  uint8_t sec_type;
+  uint8_t ssid_len;
+  uint8_t key_len;
+  const char *ssid;
+  unsigned char *key;
+  unsigned char *bssid;
+  unsigned long timeouts[4];
+} hci_link_intent;
+
+typedef struct
+{
+  volatile uint8_t state;               // HCI_SOCKET_*
+  volatile uint8_t credits;
+  uint8_t type;                         // 0 if the socket was not created by socket()
+  uint8_t protocol;
+  uint8_t flags;                        // HCI_INTENT_*
+  uint16_t port;                        // network order, as passed to bind
+  uint32_t recv_timeout;                // SOCKOPT_RECV_TIMEOUT in ms, 0 if none
+} hci_socket;
+
+static hci_link_intent hci_link;
+static hci_socket hci_sockets[8];
+static volatile int8_t hci_wait_sd = -1;
+static volatile uint8_t hci_data_expected;
+static uint8_t hci_data_from[16];       // source address of the last recvfrom data message
+static uint8_t hci_data_fromlen;
+static uint8_t hci_restore_pending;
+static uint8_t hci_patch_request = SL_PATCHES_REQUEST_DEFAULT;
+
+static volatile uint32_t hci_last_event;
+static uint32_t hci_recovery_start;
+static uint32_t hci_recovery_time;
+static uint16_t hci_recovery_count;
+
+#if USE_LATENCY_STATS
+#define HCI_LATENCY_BUCKETS 24
+
+static uint32_t hci_command_start;
+static uint16_t hci_latency_histogram[HCI_LATENCY_BUCKETS];
+static uint16_t hci_fault_interval;
+static uint16_t hci_fault_countdown;
+#endif
+
 //
 // HCI interface constants
 //
 #define HCI_STATE_IDLE                          0
 #define HCI_STATE_WAIT_ASSERT                   1
 
+#define HCI_INIT_POWER_OFF                      0
+#define HCI_INIT_POWER_ON                       1
+#define HCI_INIT_WAIT_LINK_START                2
+#define HCI_INIT_WAIT_BUFFER_SIZE               3
+#define HCI_INIT_WAIT_EVENT_MASK                4
+#define HCI_INIT_WAIT_SP_VERSION                5
+#define HCI_INIT_READY                          6
+#define HCI_INIT_FAILED                         7
+
 #define HCI_READ                                0x3
 #define HCI_WRITE                               0x1
 
@@ -87,6 +228,7 @@ static volatile uint8_t hci_state;
 #define HCI_CMND_WLAN_DISCONNECT                0x0002
 #define HCI_CMND_WLAN_IOCTL_SET_CONNECTION_POLICY 0x0004
 #define HCI_CMND_EVENT_MASK                     0x0008
+#define HCI_CMND_WLAN_IOCTL_STATUSGET           0x0009
 
 #define HCI_CMND_SEND                           0x0081
 #define HCI_CMND_SENDTO                         0x0083
@@ -96,6 +238,7 @@ static volatile uint8_t hci_state;
 #define HCI_CMND_SOCKET                         0x1001
 #define HCI_CMND_BIND                           0x1002
 #define HCI_CMND_RECV                           0x1004
+#define HCI_CMND_RECVFROM                       0x100D
 #define HCI_CMND_ACCEPT                         0x1005
 #define HCI_CMND_LISTEN                         0x1006
 #define HCI_CMND_CONNECT                        0x1007
@@ -105,22 +248,45 @@ static volatile uint8_t hci_state;
 #define HCI_CMND_GETHOSTNAME                    0x1010
 #define HCI_CMND_MDNS_ADVERTISE                 0x1011
 
+#define HCI_CMND_NVMEM_READ                     0x0201
+#define HCI_CMND_NVMEM_CREATE_ENTRY             0x0203
+#define HCI_CMND_READ_SP_VERSION                0x0207
+
+#define HCI_NETAPP_IPCONFIG                     0x2005
 #define HCI_NETAPP_SET_TIMERS                   0x2009
 
 #define HCI_CMND_SIMPLE_LINK_START              0x4000
 #define HCI_CMND_READ_BUFFER_SIZE               0x400B
 
+#define HCI_EVNT_SENDTO                         0x100F
+#define HCI_EVNT_NVMEM_WRITE                    0x0202
+
 //
 // HCI Data commands
 //
 #define HCI_DATA_RECVFROM                       0x84
 #define HCI_DATA_RECV                           0x85
 #define HCI_DATA_NVMEM                          0x91
+#define HCI_DATA_NVMEM_WRITE                    0x90
+
+//
+// Unsolicited events which can be disabled with HCI_CMND_EVENT_MASK, and those of them the driver
+// always needs for wifi_connected, wifi_dhcp and ip_addr.  HCI_EVNT_WLAN_TX_COMPLETE is not among
+// them: it is generated by the TI host driver, never by the CC3000.  The mask always keeps
+// HCI_EVNT_WLAN_UNSOL_BASE set, as TI's wlan_set_event_mask does, so it is not a required bit.
+//
+#define HCI_EVNT_WLAN_UNSOL_BASE                0x8000
+#define HCI_EVNT_MASKABLE                       (HCI_EVNT_WLAN_UNSOL_CONNECT | HCI_EVNT_WLAN_UNSOL_DISCONNECT | \
+                                                 HCI_EVNT_WLAN_UNSOL_INIT | HCI_EVNT_WLAN_UNSOL_DHCP | \
+                                                 HCI_EVNT_WLAN_ASYNC_PING_REPORT | \
+                                                 HCI_EVNT_WLAN_ASYNC_SIMPLE_CONFIG_DONE | HCI_EVNT_WLAN_KEEPALIVE)
+#define HCI_EVNT_REQUIRED                       ((HCI_EVNT_WLAN_UNSOL_CONNECT | HCI_EVNT_WLAN_UNSOL_DISCONNECT | \
+                                                  HCI_EVNT_WLAN_UNSOL_DHCP) & ~HCI_EVNT_WLAN_UNSOL_BASE)
 
 //
 // HCI Command/Event argument constants
 //
-#define SL_PATCHES_REQUEST_DEFAULT              0
+#define WLAN_STATUS_CONNECTED                   3
 
 #define HCI_ATTR __attribute__((noinline))
 
@@ -131,7 +297,60 @@ ISR(WDT_vect) // Watchdog timer interrupt.
 }
 #endif
 
-void wifi_callback(uint16_t event, uint32_t arg);
+void wifi_callback(uint16_t event, uint32_t arg) __attribute__((weak));
+static void hci_start(void);
+static int hci_select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, timeval *timeout);
+
+//
+// hci_notify
+//
+// Passes an event to its subscribed handler, if any, and then to wifi_callback if the user
+// program defines it.
+//
+HCI_ATTR
+void hci_notify(uint16_t event, uint32_t arg)
+{
+  for (uint8_t i = 0; i < HCI_MAX_SUBSCRIPTIONS; i++)
+  {
+    if (hci_subscriptions[i].event == event)
+    {
+      hci_subscriptions[i].handler(event, arg);
+      break;
+    }
+  }
+
+  if (wifi_callback)
+    wifi_callback(event, arg);
+}
+
+//
+// hci_can_recover
+//
+// Recovery is not attempted while the CC3000 is being started or recovered, to avoid recursing.
+// Failures there are retried by the init sequence, or flagged in hci_locked for later.
+//
+static uint8_t hci_can_recover(void)
+{
+  return !hci_recovering && (hci_init_state == HCI_INIT_READY || hci_init_state == HCI_INIT_FAILED);
+}
+
+//
+// Timers
+//
+// Timers compare the elapsed time against the timeout rather than computing an absolute
+// expiry time, so they keep working when millis() wraps around.
+//
+void hci_timer_start(hci_timer *timer, uint32_t timeout)
+{
+  timer->start = millis();
+  timer->timeout = timeout;
+}
+
+bool hci_timer_expired(const hci_timer *timer)
+{
+  return (uint32_t)(millis() - timer->start) >= timer->timeout;
+}
+
 //
 // hci_transfer
 //
@@ -210,7 +429,7 @@ void hci_read_array(uint8_t *data, uint16_t length)
 //  and will not overrun it; sending nothing.
 //
 HCI_ATTR
-uint8_t hci_write_u8(uint8_t v)
+void hci_write_u8(uint8_t v)
 {
   if (hci_payload_size > 0)
   {
@@ -301,8 +520,18 @@ void hci_end_receive(void)
 
   // 6. The CC3000 device deasserts an IRQ line.
   wdt_reset();
+  uint16_t polls = HCI_DEASSERT_POLLS;
   while (digitalRead(CC3K_IRQ_PIN) == LOW)
-    ; // intentionally no wdt_reset()
+  {
+    // intentionally no wdt_reset()
+    if (--polls == 0)
+    {
+      // Can't recover from here as we may be inside the interrupt handler.
+      // The next command will do it.
+      hci_locked = 1;
+      break;
+    }
+  }
 }
 
 //
@@ -330,6 +559,8 @@ void hci_dispatch_event(void)
 
   uint32_t arg = 0;
 
+  hci_last_event = millis();
+
   if (rx_event_type == hci_pending_event)
   {
     hci_pending_event_available = 1;
@@ -339,6 +570,7 @@ void hci_dispatch_event(void)
     switch (rx_event_type)
     {
     case HCI_EVNT_WLAN_UNSOL_CONNECT:
+      hci_profile_mark(HCI_PROFILE_ASSOCIATED);
       wifi_connected = 1;
       DEBUG_LV3(SERIAL_PRINTVAR(wifi_connected));
       break;
@@ -351,6 +583,7 @@ void hci_dispatch_event(void)
       break;
 
     case HCI_EVNT_WLAN_UNSOL_DHCP:
+      hci_profile_mark(HCI_PROFILE_DHCP);
       wifi_dhcp = 1;
       DEBUG_LV3(SERIAL_PRINTVAR(wifi_dhcp));
       hci_read_u8(); // status
@@ -363,7 +596,9 @@ void hci_dispatch_event(void)
     case HCI_EVNT_WLAN_UNSOL_TCP_CLOSE_WAIT:
       hci_read_u8(); // Status
       arg = hci_read_u32_le(); // Read socket number
-      DEBUG_LV3(SERIAL_PRINTVAR(client_socket));
+      DEBUG_LV3(SERIAL_PRINTVAR(arg));
+      if (arg < 8)
+        hci_sockets[arg].state |= HCI_SOCKET_PEER_CLOSED;
       break;
 
     case HCI_EVNT_DATA_UNSOL_FREE_BUFF:
@@ -372,8 +607,13 @@ void hci_dispatch_event(void)
         uint16_t fce_count = hci_read_u16_le();
         for (uint16_t i = 0; i < fce_count; i++)
         {
-          hci_read_u16_le(); // ??
-          hci_available_buffer_count += hci_read_u16_le();
+          // Each entry is the socket, a block mode byte, and the number of buffers freed.
+          uint8_t sd = hci_read_u8();
+          hci_read_u8();
+          uint16_t freed = hci_read_u16_le();
+          hci_available_buffer_count += freed;
+          if (sd < 8)
+            hci_sockets[sd].credits = freed < hci_sockets[sd].credits ? hci_sockets[sd].credits - freed : 0;
         }
         DEBUG_LV3(SERIAL_PRINTVAR(hci_available_buffer_count));
       }
@@ -384,7 +624,7 @@ void hci_dispatch_event(void)
     }
 
     // Callback to user program.
-    wifi_callback(rx_event_type, arg);
+    hci_notify(rx_event_type, arg);
 
     hci_end_receive();
   }
@@ -397,11 +637,18 @@ void hci_dispatch_event(void)
 // It skips over the data arguments and flags data as being available, before returning
 // from the interrupt.  We are presumed to be inside a function that is expecting data.
 //
-// Known issue: Unexpected data is currently not handled, see the implementation of recv.
+// Data that arrives when no function is expecting it, e.g. for a recv that was abandoned
+// because the peer closed, is discarded.
 //
 HCI_ATTR
 void hci_dispatch_data(void)
 {
+  if (!hci_data_expected)
+  {
+    hci_end_receive();
+    return;
+  }
+
   uint8_t rx_data_type = hci_read_u8();
   DEBUG_LV3(SERIAL_PRINTVAR_HEX(rx_data_type));
 
@@ -411,8 +658,19 @@ void hci_dispatch_data(void)
   uint16_t rx_payload_size = hci_read_u16_le();
   DEBUG_LV3(SERIAL_PRINTVAR(rx_payload_size));
 
+  // recvfrom data carries the length of the source address at offset 4, and the address at 16.
+  hci_data_fromlen = 0;
   for (uint8_t i = 0; i < rx_args_size; i++)
-    hci_read_u8();
+  {
+    uint8_t arg = hci_read_u8();
+    if (rx_data_type == HCI_DATA_BSD_RECVFROM)
+    {
+      if (i == 4)
+        hci_data_fromlen = arg < sizeof(hci_data_from) ? arg : sizeof(hci_data_from);
+      else if (i >= 16 && i < 16 + sizeof(hci_data_from))
+        hci_data_from[i - 16] = arg;
+    }
+  }
 
   hci_data_available = 1;
 }
@@ -465,6 +723,117 @@ void hci_irq(void)
   }
 }
 
+//
+// hci_recover
+//
+// Power cycles the CC3000 and runs the init sequence again.  Called when a wait on the
+// CC3000 misses its deadline, as the module is then presumed to be locked up.
+//
+// The link configuration is then replayed from the intent log.  Bound sockets are recreated
+// with their original descriptors by wlan_health_poll once DHCP completes; all other sockets
+// are lost, and are reported to the user program as a bitmask of socket descriptors in the
+// argument of HCI_EVNT_CC3000_LOCKED.
+//
+HCI_ATTR
+void hci_recover(void)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  hci_recovering = 1;
+  hci_recovery_start = millis();
+  hci_recovery_count++;
+
+  uint8_t lost_sockets = 0;
+  for (uint8_t sd = 0; sd < 8; sd++)
+  {
+    if (hci_sockets[sd].flags & HCI_INTENT_BOUND)
+      hci_restore_pending = 1;
+    else if (hci_sockets[sd].state & HCI_SOCKET_OPEN)
+      lost_sockets |= 1 << sd;
+    hci_sockets[sd].state = 0;
+    hci_sockets[sd].credits = 0;
+  }
+  hci_data_expected = 0;
+  wifi_connected = 0;
+  wifi_dhcp = 0;
+
+  detachInterrupt(CC3K_IRQ_NUM);
+  digitalWrite(CC3K_CS_PIN, HIGH);
+  hci_state = HCI_STATE_IDLE;
+  hci_locked = 0;
+
+  hci_start();
+
+  if (!hci_locked && (hci_link.flags & HCI_INTENT_POLICY))
+    wlan_ioctl_set_connection_policy(hci_link.policy[0], hci_link.policy[1], hci_link.policy[2]);
+
+  if (!hci_locked && (hci_link.flags & HCI_INTENT_TIMEOUTS))
+  {
+    unsigned long timeouts[4];
+    memcpy(timeouts, hci_link.timeouts, sizeof(timeouts));
+    netapp_timeout_values(&timeouts[0], &timeouts[1], &timeouts[2], &timeouts[3]);
+  }
+
+  if (!hci_locked && (hci_link.flags & HCI_INTENT_CONNECT))
+    wlan_connect(hci_link.sec_type, hci_link.ssid, hci_link.ssid_len, hci_link.bssid, hci_link.key, hci_link.key_len);
+
+  hci_last_event = millis();
+  hci_recovery_time = hci_last_event - hci_recovery_start;
+
+  hci_recovering = 0;
+
+  hci_notify(HCI_EVNT_CC3000_LOCKED, lost_sockets);
+}
+
+//
+// hci_fail
+//
+// Called when a wait misses its deadline.  Recovers the CC3000 (unless we are already
+// recovering, in which case the next command tries again) and then marks the current
+// command as failed.  The rest of the command is then a no-op, as the payload size is
+// zeroed, and it returns EFAIL to the caller.
+//
+HCI_ATTR
+void hci_fail(void)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  digitalWrite(CC3K_CS_PIN, HIGH);
+  hci_pending_event = 0xffff;
+  hci_state = HCI_STATE_IDLE;
+
+  if (hci_can_recover())
+    hci_recover();
+  else
+    hci_locked = 1;
+
+  hci_payload_size = 0;
+  hci_pad = 0;
+  hci_failed = 1;
+}
+
+//
+// hci_wait_assert
+//
+// Waits for the interrupt handler to see the IRQ assertion that follows nCS going low.
+//
+HCI_ATTR
+uint8_t hci_wait_assert(void)
+{
+  hci_timer_start(&hci_deadline, HCI_TIMEOUT_ASSERT);
+  wdt_reset();
+  while (hci_state != HCI_STATE_IDLE)
+  {
+    // intentionally no wdt_reset()
+    if (hci_timer_expired(&hci_deadline))
+    {
+      hci_fail();
+      return 0;
+    }
+  }
+  return 1;
+}
+
 //
 // hci_begin_first_command
 //
@@ -481,13 +850,15 @@ void hci_begin_first_command(uint16_t opcode, uint16_t argsSize)
   // 1. The master detects the IRQ line low: in this case the detection of IRQ low does not
   //    indicate the intention of the CC3000 device to communicate with the master but rather
   //    CC3000 readiness after power up.
-  uint16_t start = millis();
+  hci_failed = 0;
+  hci_timer_start(&hci_deadline, HCI_TIMEOUT_POWER_UP);
   while (digitalRead(CC3K_IRQ_PIN) != LOW)
   {
-    if (millis() - start >= 5000)
+    if (hci_timer_expired(&hci_deadline))
     {
       SERIAL_PRINTLN("Failed to detect CC3000.  Check wiring?");
-      for (;;);
+      hci_fail();
+      return;
     }
     wdt_reset();
   }
@@ -496,7 +867,7 @@ void hci_begin_first_command(uint16_t opcode, uint16_t argsSize)
   digitalWrite(CC3K_CS_PIN, LOW);
 
   // 3. The master introduces a delay of at least 50 μs before starting actual transmission of data.
-  delay(50);
+  delayMicroseconds(50);
 
   // 4. The master transmits the first 4 bytes of the SPI header.
   hci_pad = (argsSize & 1) == 0;
@@ -507,7 +878,7 @@ void hci_begin_first_command(uint16_t opcode, uint16_t argsSize)
   hci_transfer(0);
 
   // 5. The master introduces a delay of at least an additional 50 μs.
-  delay(50);
+  delayMicroseconds(50);
 
   // 6. The master transmits the rest of the packet.
   hci_transfer(0);
@@ -527,6 +898,14 @@ void hci_begin_command(uint16_t opcode, uint16_t argsSize)
 {
   DEBUG_LV3(SERIAL_PRINTFUNCTION());
 
+  hci_failed = 0;
+  if (hci_locked && hci_can_recover())
+    hci_recover();
+
+#if USE_LATENCY_STATS
+  hci_command_start = micros();
+#endif
+
   // Generic Host Write Operation
   hci_state = HCI_STATE_WAIT_ASSERT;
 
@@ -534,9 +913,8 @@ void hci_begin_command(uint16_t opcode, uint16_t argsSize)
   digitalWrite(CC3K_CS_PIN, LOW);
 
   // 2. The CC3000 device asserts IRQ when ready to receive the data.
-  wdt_reset();
-  while (hci_state != HCI_STATE_IDLE)
-    ; // intentionally no wdt_reset()
+  if (!hci_wait_assert())
+    return;
 
   // 3. The master starts the write transaction. The write transaction consists of a 5-byte header
   //    followed by the payload and a padding byte (if required: remember, the total packet length
@@ -556,20 +934,26 @@ void hci_begin_command(uint16_t opcode, uint16_t argsSize)
 }
 
 //
-// hci_end_command_begin_receive
+// hci_end_command
 //
-// Finishes sending a command and also prepares to wait for its response event.
+// Finishes sending a command and also prepares to receive its response event, which can then
+// be polled for with hci_poll_receive.
 //
 // These are done as a functional unit to ensure we are prepared for the event interrupt
 // before we finalize sending the command.
 //
+// Returns 0 if the command already failed.
+//
 HCI_ATTR
-void hci_end_command_begin_receive(uint16_t event, uint32_t timeout)
+uint8_t hci_end_command(uint16_t event, uint32_t timeout)
 {
+  if (hci_failed)
+    return 0;
+
   hci_pending_event = event;
   hci_pending_event_available = 0;
   hci_data_available = 0;
-  uint32_t tmr = millis() + timeout;
+  hci_timer_start(&hci_deadline, timeout);
 
   if (hci_pad)
     hci_transfer(0);
@@ -578,13 +962,98 @@ void hci_end_command_begin_receive(uint16_t event, uint32_t timeout)
   digitalWrite(CC3K_CS_PIN, HIGH);
 
   // 5. The CC3000 device deasserts the IRQ line.
+  return 1;
+}
+
+//
+// hci_poll_receive
+//
+// Returns 1 once the response event is available, 0 while still waiting for it, -1 once its
+// deadline has passed or the interrupt handler has flagged a lockup, or -2 if the peer of the
+// socket being waited on (hci_wait_sd) has closed.
+//
+// Waits without a deadline (HCI_TIMEOUT_NONE) are still watched: if the CC3000 has sent nothing
+// at all for HCI_TIMEOUT_WATCHDOG since the wait began, it is presumed locked up and recovered.
+//
+HCI_ATTR
+int8_t hci_poll_receive(void)
+{
+  if (hci_pending_event_available)
+    return 1;
+  if (hci_locked || hci_timer_expired(&hci_deadline))
+    return -1;
+  if (hci_deadline.timeout == HCI_TIMEOUT_NONE)
+  {
+    uint32_t now = millis();
+    if ((uint32_t)(now - hci_deadline.start) >= HCI_TIMEOUT_WATCHDOG &&
+        (uint32_t)(now - hci_last_event) >= HCI_TIMEOUT_WATCHDOG)
+      return -1;
+  }
+  if (hci_wait_sd >= 0 && (hci_sockets[hci_wait_sd].state & HCI_SOCKET_PEER_CLOSED))
+    return -2;
+  return 0;
+}
+
+//
+// hci_end_command_begin_receive
+//
+// Finishes sending a command and waits for its response event.
+//
+// Returns 0 if the command failed, in which case the CC3000 has been recovered and there
+// is nothing to receive; or if the wait was abandoned because the peer closed, in which case
+// the response is discarded when it arrives.
+//
+HCI_ATTR
+uint8_t hci_end_command_begin_receive(uint16_t event, uint32_t timeout)
+{
+  if (!hci_end_command(event, timeout))
+    return 0;
+
+#if USE_LATENCY_STATS
+  if (hci_fault_interval && --hci_fault_countdown == 0)
+  {
+    // Pretend the response never arrived.
+    hci_fault_countdown = hci_fault_interval;
+    hci_fail();
+  }
+#endif
 
   wdt_reset();
-  while (!hci_pending_event_available && millis() <= tmr)
-    ; // intentionally no wdt_reset().
-  if (tmr < millis()) {
-    wifi_callback(HCI_EVNT_CC3000_LOCKED, 0);
+  while (!hci_failed)
+  {
+    // intentionally no wdt_reset().
+    int8_t result = hci_poll_receive();
+    if (result > 0)
+      break;
+    if (result == -1)
+      hci_fail();
+    if (result == -2)
+    {
+      noInterrupts();
+      uint8_t available = hci_pending_event_available;
+      if (!available)
+        hci_pending_event = 0xffff;
+      interrupts();
+
+      if (available)
+        break;
+      return 0;
+    }
   }
+
+#if USE_LATENCY_STATS
+  uint32_t elapsed = micros() - hci_command_start;
+  uint8_t bucket = 0;
+  while (elapsed > 1 && bucket < HCI_LATENCY_BUCKETS - 1)
+  {
+    elapsed >>= 1;
+    bucket++;
+  }
+  if (hci_latency_histogram[bucket] != 0xffff)
+    hci_latency_histogram[bucket]++;
+#endif
+
+  return !hci_failed;
 }
 
 //
@@ -597,6 +1066,14 @@ void hci_begin_data(uint16_t opcode, uint8_t argsSize, uint16_t bufferSize)
 {
   DEBUG_LV3(SERIAL_PRINTFUNCTION());
 
+  hci_failed = 0;
+  if (hci_locked && hci_can_recover())
+    hci_recover();
+
+#if USE_LATENCY_STATS
+  hci_command_start = micros();
+#endif
+
   // Generic Host Write Operation
 
   // 1. The master asserts nCS (that is, drives the signal low) and waits for IRQ assertion.
@@ -605,9 +1082,8 @@ void hci_begin_data(uint16_t opcode, uint8_t argsSize, uint16_t bufferSize)
   digitalWrite(CC3K_CS_PIN, LOW);
 
   // 2. The CC3000 device asserts IRQ when ready to receive the data.
-  wdt_reset();
-  while (hci_state != HCI_STATE_IDLE)
-    ; // intentionally no wdt_reset().
+  if (!hci_wait_assert())
+    return;
 
   // 3. The master starts the write transaction. The write transaction consists of a 5-byte header
   //    followed by the payload and a padding byte (if required: remember, the total packet length
@@ -637,13 +1113,96 @@ void hci_begin_data(uint16_t opcode, uint8_t argsSize, uint16_t bufferSize)
 // See recv for known issues regarding client drops.
 //
 HCI_ATTR
-void hci_wait_data(void)
+uint8_t hci_wait_data(void)
 {
   DEBUG_LV3(SERIAL_PRINTFUNCTION());
 
+  hci_timer_start(&hci_deadline, HCI_TIMEOUT_DATA);
   wdt_reset();
   while (!hci_data_available)
-    ; // intentionally no wdt_reset()
+  {
+    // intentionally no wdt_reset()
+    if (hci_timer_expired(&hci_deadline))
+    {
+      hci_fail();
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//
+// hci_wait_drained
+//
+// Waits until the CC3000 has freed all data buffers sent on the given socket.
+//
+HCI_ATTR
+uint8_t hci_wait_drained(int sd)
+{
+  if (sd < 0 || sd >= 8)
+    return 1;
+
+  hci_timer_start(&hci_deadline, HCI_TIMEOUT_BUFFERS);
+  wdt_reset();
+  while (hci_sockets[sd].credits)
+  {
+    // intentionally no wdt_reset()
+    if (hci_timer_expired(&hci_deadline))
+    {
+      hci_fail();
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//
+// hci_socket_timeout
+//
+// Returns the deadline for a command which the CC3000 holds until data or a client arrives.
+// These are only bounded if the socket is non-blocking or has a receive timeout; otherwise
+// they wait until the peer closes or a lockup is detected, at the latest by the
+// HCI_TIMEOUT_WATCHDOG check in hci_poll_receive.
+//
+static uint32_t hci_socket_timeout(int sd, uint8_t nonblock_flag)
+{
+  if (sd < 0 || sd >= 8 || (hci_sockets[sd].flags & nonblock_flag))
+    return HCI_TIMEOUT_COMMAND;
+  if (hci_sockets[sd].recv_timeout)
+    return hci_sockets[sd].recv_timeout + HCI_TIMEOUT_COMMAND;
+  return HCI_TIMEOUT_NONE;
+}
+
+//
+// hci_peer_closed
+//
+// Returns whether the peer of a connected socket has closed.
+//
+uint8_t hci_peer_closed(int sd)
+{
+  return sd >= 0 && sd < 8 && (hci_sockets[sd].state & HCI_SOCKET_PEER_CLOSED);
+}
+
+//
+// hci_wait_buffers
+//
+// Waits until at least the given number of the CC3000's data buffers are free.
+//
+HCI_ATTR
+uint8_t hci_wait_buffers(uint8_t count)
+{
+  hci_timer_start(&hci_deadline, HCI_TIMEOUT_BUFFERS);
+  wdt_reset();
+  while (hci_available_buffer_count < count)
+  {
+    // intentionally no wdt_reset()
+    if (hci_timer_expired(&hci_deadline))
+    {
+      hci_fail();
+      return 0;
+    }
+  }
+  return 1;
 }
 
 //
@@ -667,7 +1226,8 @@ void hci_read_status(void)
 HCI_ATTR
 uint32_t hci_end_command_receive_u32_result(uint16_t event, uint32_t timeout)
 {
-  hci_end_command_begin_receive(event, timeout);
+  if (!hci_end_command_begin_receive(event, timeout))
+    return EFAIL;
 
   hci_read_status();
 
@@ -679,10 +1239,13 @@ uint32_t hci_end_command_receive_u32_result(uint16_t event, uint32_t timeout)
   return result;
 }
 
-void wlan_init(void)
+//
+// hci_setup
+//
+// Configures the MCU side of the interface: watchdog, pins and SPI.
+//
+static void hci_setup(void)
 {
-  DEBUG_LV2(SERIAL_PRINTFUNCTION());
-
 #if USE_WATCHDOG
   cli();  // disable all interrupts
   wdt_reset(); // reset the WDT timer
@@ -705,30 +1268,22 @@ void wlan_init(void)
 #endif
 
   pinMode(CC3K_EN_PIN, OUTPUT);
-  digitalWrite(CC3K_EN_PIN, LOW);
-  delay(500);
-
   pinMode(CC3K_CS_PIN, OUTPUT);
   pinMode(CC3K_IRQ_PIN, INPUT_PULLUP);
 
-  digitalWrite(CC3K_CS_PIN, HIGH);
-  digitalWrite(CC3K_EN_PIN, HIGH);
-  delay(100);
-
   SPI.begin();
   SPI.setDataMode(SPI_MODE1);
   SPI.setBitOrder(MSBFIRST);
   SPI.setClockDivider(SPI_CLOCK_DIV2);
-  delay(100);
-
-  hci_begin_first_command(HCI_CMND_SIMPLE_LINK_START, 1);
-  hci_write_u8(SL_PATCHES_REQUEST_DEFAULT);
-  attachInterrupt(CC3K_IRQ_NUM, hci_irq, FALLING);
-  hci_end_command_begin_receive(HCI_CMND_SIMPLE_LINK_START, 1000);
-  hci_end_receive();
+}
 
-  hci_begin_command(HCI_CMND_READ_BUFFER_SIZE, 0);
-  hci_end_command_begin_receive(HCI_CMND_READ_BUFFER_SIZE, 1000);
+//
+// hci_receive_buffer_size
+//
+// Receives the number and size of the CC3000's data buffers, all of which are presumed free.
+//
+static void hci_receive_buffer_size(void)
+{
   hci_read_status();
   hci_buffer_count = hci_read_u8();
   hci_available_buffer_count = hci_buffer_count;
@@ -736,16 +1291,390 @@ void wlan_init(void)
   hci_buffer_size = hci_read_u16_le();
   DEBUG_LV2(SERIAL_PRINTVAR(hci_buffer_size));
   hci_end_receive();
+}
 
-  hci_begin_command(HCI_CMND_EVENT_MASK, 4);
-  hci_write_u32_le(HCI_EVNT_WLAN_KEEPALIVE | HCI_EVNT_WLAN_UNSOL_INIT);
-  hci_end_command_begin_receive(HCI_CMND_EVENT_MASK, 1000);
+//
+// hci_receive_sp_version
+//
+// Receives the service pack version, and from it the capabilities of the firmware; so that
+// functions which depend on them test a flag rather than the version.  A version that could
+// not be read is 0, and has no capabilities.
+//
+static void hci_receive_sp_version(void)
+{
+  hci_read_status();
+  uint32_t version = hci_read_u32_le();
+  hci_sp_version = ((version >> 16) & 0xff) * 100 + (version >> 24);
+  DEBUG_LV2(SERIAL_PRINTVAR(hci_sp_version));
   hci_end_receive();
+
+  hci_capabilities = 0;
+  // From 1.32 the firmware no longer advertises mDNS services; it has to be done in software.
+  if (hci_sp_version && hci_sp_version < 132)
+    hci_capabilities |= WLAN_CAP_MDNS_ADVERTISE;
 }
 
-#define MIN_TIMER_VAL_SECONDS      20
-#define MIN_TIMER_SET(t)    if ((0 != t) && (t < MIN_TIMER_VAL_SECONDS)) \
-                            { \
+//
+// hci_begin_event_mask
+//
+// Tells the CC3000 which unsolicited events not to send: all of those that can be masked,
+// except the ones the driver needs and those with a subscribed handler.
+//
+static void hci_begin_event_mask(void)
+{
+  uint16_t mask = (HCI_EVNT_MASKABLE & ~HCI_EVNT_REQUIRED) | HCI_EVNT_WLAN_UNSOL_BASE;
+  for (uint8_t i = 0; i < HCI_MAX_SUBSCRIPTIONS; i++)
+    if ((hci_subscriptions[i].event & HCI_EVNT_MASKABLE) == hci_subscriptions[i].event)
+      mask &= ~hci_subscriptions[i].event | HCI_EVNT_WLAN_UNSOL_BASE;
+  DEBUG_LV2(SERIAL_PRINTVAR_HEX(mask));
+
+  hci_begin_command(HCI_CMND_EVENT_MASK, 4);
+  hci_write_u32_le(mask);
+}
+
+//
+// hci_init_retry
+//
+// Powers the CC3000 off to start over after a failed init step, or gives up.
+//
+static void hci_init_retry(void)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  detachInterrupt(CC3K_IRQ_NUM);
+  digitalWrite(CC3K_CS_PIN, HIGH);
+  digitalWrite(CC3K_EN_PIN, LOW);
+  hci_pending_event = 0xffff;
+  hci_state = HCI_STATE_IDLE;
+  hci_failed = 0;
+
+  if (++hci_init_attempts >= CC3K_INIT_ATTEMPTS)
+  {
+    SERIAL_PRINTLN("Failed to start CC3000.  Check wiring?");
+    hci_init_state = HCI_INIT_FAILED;
+    hci_locked = 1;
+    return;
+  }
+
+  hci_timer_start(&hci_init_timer, CC3K_POWER_OFF_TIME);
+  hci_init_state = HCI_INIT_POWER_OFF;
+}
+
+//
+// wlan_init_step
+//
+// Advances the init sequence by one step without blocking, see wlan_init_begin.
+//
+// Returns WLAN_INIT_BUSY until the CC3000 is ready, then WLAN_INIT_READY; or WLAN_INIT_FAILED
+// if it could not be started.
+//
+int8_t wlan_init_step(void)
+{
+  int8_t result;
+
+  switch (hci_init_state)
+  {
+  case HCI_INIT_POWER_OFF:
+    if (!hci_timer_expired(&hci_init_timer))
+      break;
+
+    hci_init_irq_high = digitalRead(CC3K_IRQ_PIN) != LOW;
+    digitalWrite(CC3K_CS_PIN, HIGH);
+    digitalWrite(CC3K_EN_PIN, HIGH);
+    hci_timer_start(&hci_init_timer, HCI_TIMEOUT_POWER_UP);
+    hci_init_state = HCI_INIT_POWER_ON;
+    break;
+
+  case HCI_INIT_POWER_ON:
+    // The CC3000 signals that it is ready for the first command by pulling IRQ low.  If IRQ
+    // was already low when it was enabled, wait for it to go high first.  Start over if
+    // neither happens in time, whichever level IRQ is stuck at.
+    if (digitalRead(CC3K_IRQ_PIN) != LOW)
+    {
+      hci_init_irq_high = 1;
+      if (hci_timer_expired(&hci_init_timer))
+        hci_init_retry();
+      break;
+    }
+    if (!hci_init_irq_high)
+    {
+      if (hci_timer_expired(&hci_init_timer))
+        hci_init_retry();
+      break;
+    }
+
+    hci_begin_first_command(HCI_CMND_SIMPLE_LINK_START, 1);
+    hci_write_u8(hci_patch_request);
+    attachInterrupt(CC3K_IRQ_NUM, hci_irq, FALLING);
+    if (!hci_end_command(HCI_CMND_SIMPLE_LINK_START, 1000))
+      hci_init_retry();
+    else
+      hci_init_state = HCI_INIT_WAIT_LINK_START;
+    break;
+
+  case HCI_INIT_WAIT_LINK_START:
+    result = hci_poll_receive();
+    if (result == 0)
+      break;
+    if (result > 0)
+    {
+      hci_end_receive();
+      hci_begin_command(HCI_CMND_READ_BUFFER_SIZE, 0);
+      if (hci_end_command(HCI_CMND_READ_BUFFER_SIZE, 1000))
+      {
+        hci_init_state = HCI_INIT_WAIT_BUFFER_SIZE;
+        break;
+      }
+    }
+    hci_init_retry();
+    break;
+
+  case HCI_INIT_WAIT_BUFFER_SIZE:
+    result = hci_poll_receive();
+    if (result == 0)
+      break;
+    if (result > 0)
+    {
+      hci_receive_buffer_size();
+      hci_begin_event_mask();
+      if (hci_end_command(HCI_CMND_EVENT_MASK, 1000))
+      {
+        hci_init_state = HCI_INIT_WAIT_EVENT_MASK;
+        break;
+      }
+    }
+    hci_init_retry();
+    break;
+
+  case HCI_INIT_WAIT_EVENT_MASK:
+    result = hci_poll_receive();
+    if (result == 0)
+      break;
+    if (result < 0)
+    {
+      hci_init_retry();
+      break;
+    }
+
+    hci_end_receive();
+    hci_begin_command(HCI_CMND_READ_SP_VERSION, 0);
+    if (hci_end_command(HCI_CMND_READ_SP_VERSION, 1000))
+      hci_init_state = HCI_INIT_WAIT_SP_VERSION;
+    else
+      hci_init_retry();
+    break;
+
+  case HCI_INIT_WAIT_SP_VERSION:
+    result = hci_poll_receive();
+    if (result == 0)
+      break;
+    if (result < 0)
+    {
+      hci_init_retry();
+      break;
+    }
+
+    hci_receive_sp_version();
+    hci_init_state = HCI_INIT_READY;
+    hci_locked = 0;
+    hci_init_time = millis() - hci_init_start;
+    hci_last_event = millis();
+    hci_profile_mark(HCI_PROFILE_INIT);
+    DEBUG_LV2(SERIAL_PRINTVAR(hci_init_time));
+    break;
+  }
+
+  if (hci_init_state == HCI_INIT_READY)
+    return WLAN_INIT_READY;
+  if (hci_init_state == HCI_INIT_FAILED)
+    return WLAN_INIT_FAILED;
+  return WLAN_INIT_BUSY;
+}
+
+//
+// hci_init_restart
+//
+// Powers the CC3000 off and restarts the init sequence.
+//
+static void hci_init_restart(void)
+{
+  hci_init_start = millis();
+  hci_init_attempts = 0;
+  hci_init_state = HCI_INIT_POWER_OFF;
+  digitalWrite(CC3K_EN_PIN, LOW);
+  hci_timer_start(&hci_init_timer, CC3K_POWER_OFF_TIME);
+}
+
+//
+// hci_start
+//
+// Power cycles the CC3000 and runs the whole init sequence.  Used by both wlan_init and
+// hci_recover.
+//
+static void hci_start(void)
+{
+  hci_init_restart();
+  while (wlan_init_step() == WLAN_INIT_BUSY)
+    wdt_reset();
+}
+
+void wlan_init(uint8_t patches)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  hci_patch_request = patches;
+  hci_setup();
+  hci_start();
+}
+
+//
+// wlan_init_begin
+//
+// Starts the init sequence without blocking.  Call wlan_init_step repeatedly (e.g. from loop())
+// until it returns WLAN_INIT_READY before using any other function; other peripherals can be
+// set up in the meantime.
+//
+// patches selects which service packs the CC3000 runs, see SL_PATCHES_REQUEST_DEFAULT.  The
+// choice is kept when the CC3000 is restarted after a lockup.
+//
+void wlan_init_begin(uint8_t patches)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  hci_patch_request = patches;
+  hci_setup();
+  hci_init_restart();
+}
+
+//
+// wlan_init_time
+//
+// Returns the time the last init sequence took to get the CC3000 ready, in milliseconds.
+//
+uint32_t wlan_init_time(void)
+{
+  return hci_init_time;
+}
+
+//
+// wlan_sp_version
+//
+// Returns the service pack version read during init, e.g. 132 for 1.32; or 0 if unknown.
+//
+uint16_t wlan_sp_version(void)
+{
+  return hci_sp_version;
+}
+
+//
+// wlan_capabilities
+//
+// Returns the WLAN_CAP_* flags of the running firmware, for choosing code paths once.
+//
+uint8_t wlan_capabilities(void)
+{
+  return hci_capabilities;
+}
+
+//
+// wlan_init_warm
+//
+// Use instead of wlan_init after an MCU-only reset (e.g. by the watchdog), when the CC3000 may
+// still be running and associated.  If the CC3000 responds, the buffer and link state are read
+// back from it and any sockets left over from before the reset are closed; the CC3000 is not
+// power cycled and keeps its association.  Otherwise this falls back to wlan_init.
+//
+// Returns 1 if the CC3000 was resumed, or 0 if it was cold started.
+//
+// Note that CC3K_EN_PIN must not be pulled low while the MCU is in reset for this to work.
+//
+uint8_t wlan_init_warm(void)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  hci_init_start = millis();
+
+  // Drive EN high before making it an output, so that it never glitches low.
+  digitalWrite(CC3K_EN_PIN, HIGH);
+  digitalWrite(CC3K_CS_PIN, HIGH);
+  hci_setup();
+
+  // Discard anything the CC3000 was trying to send when the MCU reset.  A CC3000 that has just
+  // powered up also holds IRQ low, waiting for its first command, but won't send a sensible
+  // header; in which case it is cold started.
+  hci_recovering = 1;
+  hci_locked = 0;
+  uint8_t warm = 1;
+  for (uint8_t i = 0; warm && digitalRead(CC3K_IRQ_PIN) == LOW; i++)
+  {
+    hci_begin_receive();
+    uint8_t rx_type = hci_read_u8();
+    warm = i < 8 && hci_payload_size < 2048 && (rx_type == HCI_TYPE_EVNT || rx_type == HCI_TYPE_DATA);
+    if (!warm)
+      hci_payload_size = 0;
+    hci_end_receive();
+  }
+
+  if (warm)
+  {
+    attachInterrupt(CC3K_IRQ_NUM, hci_irq, FALLING);
+    hci_begin_command(HCI_CMND_READ_BUFFER_SIZE, 0);
+    warm = hci_end_command_begin_receive(HCI_CMND_READ_BUFFER_SIZE, 1000);
+    if (warm)
+      hci_receive_buffer_size();
+  }
+  hci_recovering = 0;
+
+  if (!warm)
+  {
+    DEBUG_LV2(SERIAL_PRINTLN("Cold starting CC3000"));
+    detachInterrupt(CC3K_IRQ_NUM);
+    hci_locked = 0;
+    hci_start();
+    return 0;
+  }
+
+  hci_init_state = HCI_INIT_READY;
+  hci_init_time = millis() - hci_init_start;
+
+  hci_begin_event_mask();
+  if (hci_end_command_begin_receive(HCI_CMND_EVENT_MASK, 1000))
+    hci_end_receive();
+
+  hci_begin_command(HCI_CMND_READ_SP_VERSION, 0);
+  if (hci_end_command_begin_receive(HCI_CMND_READ_SP_VERSION, 1000))
+    hci_receive_sp_version();
+
+  for (uint8_t sd = 0; sd < 8; sd++)
+    closesocket(sd);
+
+  hci_begin_command(HCI_CMND_WLAN_IOCTL_STATUSGET, 0);
+  wifi_connected = hci_end_command_receive_u32_result(HCI_CMND_WLAN_IOCTL_STATUSGET, 1000) == WLAN_STATUS_CONNECTED;
+  DEBUG_LV2(SERIAL_PRINTVAR(wifi_connected));
+
+  if (wifi_connected)
+  {
+    hci_begin_command(HCI_NETAPP_IPCONFIG, 0);
+    if (hci_end_command_begin_receive(HCI_NETAPP_IPCONFIG, 1000))
+    {
+      hci_read_status();
+      ip_addr[3] = hci_read_u8();
+      ip_addr[2] = hci_read_u8();
+      ip_addr[1] = hci_read_u8();
+      ip_addr[0] = hci_read_u8();
+      hci_end_receive();
+      wifi_dhcp = ip_addr[0] != 0;
+      DEBUG_LV2(SERIAL_PRINTVAR(wifi_dhcp));
+    }
+  }
+
+  hci_last_event = millis();
+  return 1;
+}
+
+#define MIN_TIMER_VAL_SECONDS      20
+#define MIN_TIMER_SET(t)    if ((0 != t) && (t < MIN_TIMER_VAL_SECONDS)) \
+                            { \
                                 t = MIN_TIMER_VAL_SECONDS; \
                             }
 
@@ -764,13 +1693,23 @@ long netapp_timeout_values(unsigned long *aucDHCP, unsigned long *aucARP, unsign
   MIN_TIMER_SET(*aucKeepalive)
   MIN_TIMER_SET(*aucInactivity)
 
+  hci_link.flags |= HCI_INTENT_TIMEOUTS;
+  hci_link.timeouts[0] = *aucDHCP;
+  hci_link.timeouts[1] = *aucARP;
+  hci_link.timeouts[2] = *aucKeepalive;
+  hci_link.timeouts[3] = *aucInactivity;
+
   hci_begin_command(HCI_NETAPP_SET_TIMERS, 16);
   hci_write_u32_le(*aucDHCP);
   hci_write_u32_le(*aucARP);
   hci_write_u32_le(*aucKeepalive);
   hci_write_u32_le(*aucInactivity);
 
-  return hci_end_command_receive_u32_result(HCI_NETAPP_SET_TIMERS, 1000);
+  long result = hci_end_command_receive_u32_result(HCI_NETAPP_SET_TIMERS, 1000);
+  if (result == 0)
+    hci_profile_mark(HCI_PROFILE_TIMEOUTS);
+
+  return result;
 }
 
 int32_t wlan_ioctl_set_connection_policy(bool should_connect_to_open_ap, bool should_use_fast_connect, bool use_profiles)
@@ -782,6 +1721,11 @@ int32_t wlan_ioctl_set_connection_policy(bool should_connect_to_open_ap, bool sh
     SERIAL_PRINTVAR(use_profiles);
     )
 
+  hci_link.flags |= HCI_INTENT_POLICY;
+  hci_link.policy[0] = should_connect_to_open_ap;
+  hci_link.policy[1] = should_use_fast_connect;
+  hci_link.policy[2] = use_profiles;
+
   hci_begin_command(HCI_CMND_WLAN_IOCTL_SET_CONNECTION_POLICY, 12);
   hci_write_u32_le(should_connect_to_open_ap);
   hci_write_u32_le(should_use_fast_connect);
@@ -804,6 +1748,14 @@ int32_t wlan_connect(unsigned long sec_type, const char *ssid, long ssid_len, un
 
   static unsigned char bssid_zero[6] = {0, 0, 0, 0, 0, 0};
 
+  hci_link.flags |= HCI_INTENT_CONNECT;
+  hci_link.sec_type = sec_type;
+  hci_link.ssid = ssid;
+  hci_link.ssid_len = ssid_len;
+  hci_link.bssid = bssid;
+  hci_link.key = key;
+  hci_link.key_len = key_len;
+
   hci_begin_command(HCI_CMND_WLAN_CONNECT, 28 + ssid_len + key_len);
   hci_write_u32_le(0x1c);
   hci_write_u32_le(ssid_len);
@@ -841,7 +1793,25 @@ int setsockopt(long sd, long level, long optname, const void *optval, unsigned l
   hci_write_u32_le(optlen);
   hci_write_array(optval, optlen);
 
-  return hci_end_command_receive_u32_result(HCI_CMND_SETSOCKOPT, 1000);
+  int result = hci_end_command_receive_u32_result(HCI_CMND_SETSOCKOPT, 1000);
+
+  if (result >= 0 && sd >= 0 && sd < 8 && level == SOL_SOCKET && optlen > 0)
+  {
+    uint8_t flag = 0;
+    if (optname == SOCKOPT_ACCEPT_NONBLOCK)
+      flag = HCI_INTENT_ACCEPT_NONBLOCK;
+    else if (optname == SOCKOPT_RECV_NONBLOCK)
+      flag = HCI_INTENT_RECV_NONBLOCK;
+
+    if (optname == SOCKOPT_RECV_TIMEOUT && optlen >= 4)
+      hci_sockets[sd].recv_timeout = *(const uint32_t*)optval;
+    else if (*(const uint8_t*)optval == SOCK_ON)
+      hci_sockets[sd].flags |= flag;
+    else
+      hci_sockets[sd].flags &= ~flag;
+  }
+
+  return result;
 }
 
 int socket(long domain, long type, long protocol)
@@ -858,7 +1828,16 @@ int socket(long domain, long type, long protocol)
   hci_write_u32_le(type);
   hci_write_u32_le(protocol);
 
-  return hci_end_command_receive_u32_result(HCI_CMND_SOCKET, 1000);
+  int sd = hci_end_command_receive_u32_result(HCI_CMND_SOCKET, 1000);
+  if (sd >= 0 && sd < 8)
+  {
+    memset(&hci_sockets[sd], 0, sizeof(hci_sockets[sd]));
+    hci_sockets[sd].state = HCI_SOCKET_OPEN;
+    hci_sockets[sd].type = type;
+    hci_sockets[sd].protocol = protocol;
+  }
+
+  return sd;
 }
 
 int listen(int sd, int backlog)
@@ -873,7 +1852,14 @@ int listen(int sd, int backlog)
   hci_write_u32_le(sd);
   hci_write_u32_le(backlog);
 
-  return hci_end_command_receive_u32_result(HCI_CMND_LISTEN, 1000);
+  int result = hci_end_command_receive_u32_result(HCI_CMND_LISTEN, 1000);
+  if (result >= 0 && sd >= 0 && sd < 8)
+  {
+    hci_sockets[sd].flags |= HCI_INTENT_LISTENING;
+    hci_profile_mark(HCI_PROFILE_LISTEN);
+  }
+
+  return result;
 }
 
 int bind(int sd, struct _sockaddr_t *addr, int addrlen)
@@ -893,7 +1879,14 @@ int bind(int sd, struct _sockaddr_t *addr, int addrlen)
   hci_write_u32_le(addrlen);
   hci_write_array(addr, 8);
 
-  return hci_end_command_receive_u32_result(HCI_CMND_BIND, 1000);
+  int result = hci_end_command_receive_u32_result(HCI_CMND_BIND, 1000);
+  if (result >= 0 && sd >= 0 && sd < 8)
+  {
+    hci_sockets[sd].flags |= HCI_INTENT_BOUND;
+    hci_sockets[sd].port = ((_sockaddr_in_t*)addr)->sin_port;
+  }
+
+  return result;
 }
 
 int accept(int sd, struct sockaddr_t *addr, unsigned long *addrlen)
@@ -906,7 +1899,8 @@ int accept(int sd, struct sockaddr_t *addr, unsigned long *addrlen)
   hci_begin_command(HCI_CMND_ACCEPT, 4);
   hci_write_u32_le(sd);
 
-  hci_end_command_begin_receive(HCI_CMND_ACCEPT, 1000);
+  if (!hci_end_command_begin_receive(HCI_CMND_ACCEPT, hci_socket_timeout(sd, HCI_INTENT_ACCEPT_NONBLOCK)))
+    return EFAIL;
 
   hci_read_status();
 
@@ -923,28 +1917,54 @@ int accept(int sd, struct sockaddr_t *addr, unsigned long *addrlen)
 
   hci_end_receive();
 
-  // Return status is actually the socket descriptor.
+  // Return status is actually the socket descriptor, or ESOCKINPROGRESS if a non-blocking
+  // accept has no client yet.
+  if (return_status == ESOCKINPROGRESS)
+    return ESOCKINPROGRESS;
   if (return_status < 0 || return_status >= 8)
-    return -1;
+    return EFAIL;
+
+  memset(&hci_sockets[return_status], 0, sizeof(hci_sockets[return_status]));
+  hci_sockets[return_status].state = HCI_SOCKET_OPEN | HCI_SOCKET_CONNECTED;
+  hci_profile_mark(HCI_PROFILE_ACCEPT);
 
   return return_status;
 }
 
-int recv(int sd, void *buffer, int size, int flags)
+//
+// hci_recv
+//
+// Shared implementation of recv and recvfrom.  from may be NULL.
+//
+static int hci_recv(uint16_t opcode, int sd, void *buffer, int size, int flags, sockaddr *from, socklen_t *fromlen)
 {
-  DEBUG_LV2(
-    SERIAL_PRINTFUNCTION();
-    SERIAL_PRINTVAR(sd);
-    SERIAL_PRINTVAR(size);
-    SERIAL_PRINTVAR(flags);
-    )
+  uint32_t timeout = hci_socket_timeout(sd, HCI_INTENT_RECV_NONBLOCK);
+
+  if (hci_peer_closed(sd))
+  {
+    // Only receive whatever the CC3000 still has buffered from before the peer closed.
+    fd_set readsds;
+    FD_ZERO(&readsds);
+    FD_SET(sd, &readsds);
+    timeval poll = {0, 5000};
+    if (hci_select(sd + 1, &readsds, NULL, NULL, &poll) <= 0 || !FD_ISSET(sd, &readsds))
+      return ESOCKCLOSED;
+    timeout = HCI_TIMEOUT_COMMAND;
+  }
+  else
+  {
+    hci_wait_sd = sd;
+  }
 
-  hci_begin_command(HCI_CMND_RECV, 12);
+  hci_begin_command(opcode, 12);
   hci_write_u32_le(sd);
   hci_write_u32_le(size);
   hci_write_u32_le(flags);
 
-  hci_end_command_begin_receive(HCI_CMND_RECV, 5000);
+  uint8_t received = hci_end_command_begin_receive(opcode, timeout);
+  hci_wait_sd = -1;
+  if (!received)
+    return hci_peer_closed(sd) ? ESOCKCLOSED : EFAIL;
 
   hci_read_status();
 
@@ -957,17 +1977,17 @@ int recv(int sd, void *buffer, int size, int flags)
   long return_flags = hci_read_u32_le();
   DEBUG_LV2(SERIAL_PRINTVAR_HEX(return_flags));
 
+  // The data message may follow as soon as the event is finished.
+  hci_data_expected = return_length > 0;
+
   hci_end_receive();
 
   if (return_length > 0)
   {
-    // TODO: while waiting for data, we need to handle unsolicited client drops
-    //  and stop waiting.
-    // Also for safety, the interrupt handler should be able to ignore
-    //  unsolicited data when we're not waiting.
-    // Thus, the intention to wait for data must be indicated to hci_end_receive,
-    //  e.g. hci_end_receive_with_data.
-    hci_wait_data();
+    uint8_t ready = hci_wait_data();
+    hci_data_expected = 0;
+    if (!ready)
+      return EFAIL;
 
     if (return_length > size)
       return_length = size;
@@ -976,12 +1996,66 @@ int recv(int sd, void *buffer, int size, int flags)
       ((uint8_t*)buffer)[i] = hci_read_u8();
 
     hci_end_receive();
+
+    if (from && fromlen)
+    {
+      if (*fromlen > hci_data_fromlen)
+        *fromlen = hci_data_fromlen;
+      memcpy(from, hci_data_from, *fromlen);
+    }
   }
 
   return return_length;
 }
 
-int send(int sd, const void *buffer, int size, int flags)
+int recv(int sd, void *buffer, int size, int flags)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(sd);
+    SERIAL_PRINTVAR(size);
+    SERIAL_PRINTVAR(flags);
+    )
+
+  return hci_recv(HCI_CMND_RECV, sd, buffer, size, flags, NULL, NULL);
+}
+
+int recvfrom(int sd, void *buffer, int size, int flags, sockaddr *from, socklen_t *fromlen)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(sd);
+    SERIAL_PRINTVAR(size);
+    SERIAL_PRINTVAR(flags);
+    )
+
+  return hci_recv(HCI_CMND_RECVFROM, sd, buffer, size, flags, from, fromlen);
+}
+
+//
+// Streamed send
+//
+// send_begin starts a send of exactly size bytes, which are then supplied by any number of
+// send_data and send_data_P calls and finished by send_end.  This lets callers assemble a
+// packet from several buffers, or from flash, without staging a copy in RAM.  size must not
+// exceed send_mtu.  If fewer than size bytes are supplied the remainder is sent as zeros.
+//
+static uint16_t hci_send_size;
+
+// Bytes of the send still to be supplied.  The payload size also counts the four header bytes
+// and the padding byte, which are transferred without hci_write_u8.
+static int hci_send_remaining(void)
+{
+  int remaining = (int)hci_payload_size - 4 - hci_pad;
+  return remaining > 0 ? remaining : 0;
+}
+
+int send_mtu(void)
+{
+  return hci_buffer_size - 21;
+}
+
+int send_begin(int sd, int size, int flags)
 {
   DEBUG_LV2(
     SERIAL_PRINTFUNCTION();
@@ -990,49 +2064,129 @@ int send(int sd, const void *buffer, int size, int flags)
     SERIAL_PRINTVAR(flags);
     )
 
+  if (hci_peer_closed(sd))
+    return ESOCKCLOSED;
+  if (size < 0 || size > send_mtu())
+    return EFAIL;
+
   DEBUG_LV3(SERIAL_PRINTVAR(hci_available_buffer_count));
-  wdt_reset();
-  while (hci_available_buffer_count == 0)
-    ; // intentionally no wdt_reset()
+  if (!hci_wait_buffers(1))
+    return EFAIL;
   hci_available_buffer_count--;
+  if (sd >= 0 && sd < 8)
+    hci_sockets[sd].credits++;
 
   hci_begin_data(HCI_CMND_SEND, 16, size);
   hci_write_u32_le(sd);
   hci_write_u32_le(12);
   hci_write_u32_le(size);
   hci_write_u32_le(flags);
-  hci_write_array(buffer, size);
+  if (hci_failed)
+    return EFAIL;
 
-  hci_end_data_begin_receive(HCI_EVNT_SEND, 5000);
-  hci_end_receive();
+  hci_send_size = size;
+  return ESUCCESS;
+}
 
-  return size;
+void send_data(const void *buffer, int size)
+{
+  int remaining = hci_send_remaining();
+  hci_write_array(buffer, size < remaining ? size : remaining);
 }
 
-int closesocket(int sd)
+void send_data_P(const void PROGMEM *buffer, int size)
 {
-  DEBUG_LV2(
-    SERIAL_PRINTFUNCTION();
-    SERIAL_PRINTVAR(sd);
-    )
+  const uint8_t PROGMEM *pos = (const uint8_t PROGMEM *)buffer;
+  int remaining = hci_send_remaining();
+  if (size > remaining)
+    size = remaining;
+  while (size-- > 0)
+    hci_write_u8(pgm_read_byte(pos++));
+}
 
-  wdt_reset();
-  while (hci_available_buffer_count != hci_buffer_count)
-    ; // intentionally no wdt_reset()
+int send_end(void)
+{
+  for (int remaining = hci_send_remaining(); remaining > 0; remaining--)
+    hci_write_u8(0);
 
-  hci_begin_command(HCI_CMND_CLOSE_SOCKET, 4);
-  hci_write_u32_le(sd);
+  if (!hci_end_data_begin_receive(HCI_EVNT_SEND, 5000))
+    return EFAIL;
+  hci_end_receive();
 
-  return hci_end_command_receive_u32_result(HCI_CMND_CLOSE_SOCKET, 1000);
+  return hci_send_size;
 }
 
-int select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, timeval *timeout)
+int send(int sd, const void *buffer, int size, int flags)
+{
+  int result = send_begin(sd, size, flags);
+  if (result < 0)
+    return result;
+
+  send_data(buffer, size);
+
+  return send_end();
+}
+
+int sendto(int sd, const void *buffer, int size, int flags, const sockaddr *to, socklen_t tolen)
 {
   DEBUG_LV2(
     SERIAL_PRINTFUNCTION();
-    SERIAL_PRINTVAR(nfds);
+    SERIAL_PRINTVAR(sd);
+    SERIAL_PRINTVAR(size);
+    SERIAL_PRINTVAR(flags);
     )
 
+  DEBUG_LV3(SERIAL_PRINTVAR(hci_available_buffer_count));
+  if (!hci_wait_buffers(1))
+    return EFAIL;
+  hci_available_buffer_count--;
+  if (sd >= 0 && sd < 8)
+    hci_sockets[sd].credits++;
+
+  // The address follows the data; its offset is relative to the fourth argument.
+  hci_begin_data(HCI_CMND_SENDTO, 24, size + tolen);
+  hci_write_u32_le(sd);
+  hci_write_u32_le(20);
+  hci_write_u32_le(size);
+  hci_write_u32_le(flags);
+  hci_write_u32_le(size + 8);
+  hci_write_u32_le(8);
+  hci_write_array(buffer, size);
+  hci_write_array(to, tolen);
+
+  if (!hci_end_data_begin_receive(HCI_EVNT_SENDTO, 5000))
+    return EFAIL;
+  hci_end_receive();
+
+  return size;
+}
+
+int closesocket(int sd)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(sd);
+    )
+
+  if (!hci_wait_drained(sd))
+    return EFAIL;
+
+  if (sd >= 0 && sd < 8)
+    memset(&hci_sockets[sd], 0, sizeof(hci_sockets[sd]));
+
+  hci_begin_command(HCI_CMND_CLOSE_SOCKET, 4);
+  hci_write_u32_le(sd);
+
+  return hci_end_command_receive_u32_result(HCI_CMND_CLOSE_SOCKET, 1000);
+}
+
+//
+// hci_select
+//
+// Sends select to the CC3000, see select.
+//
+static int hci_select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, timeval *timeout)
+{
   hci_begin_command(HCI_CMND_SELECT, 44);
   hci_write_u32_le(nfds);
   hci_write_u32_le(0x14);
@@ -1056,7 +2210,9 @@ int select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, time
     hci_write_u32_le(0);
   }
 
-  hci_end_command_begin_receive(HCI_CMND_SELECT, 10000);
+  uint32_t deadline = timeout ? timeout->tv_sec * 1000 + timeout->tv_usec / 1000 + HCI_TIMEOUT_COMMAND : HCI_TIMEOUT_NONE;
+  if (!hci_end_command_begin_receive(HCI_CMND_SELECT, deadline))
+    return EFAIL;
 
   hci_read_status();
 
@@ -1080,6 +2236,45 @@ int select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, time
   return return_status;
 }
 
+//
+// select
+//
+// Sockets whose peer has closed are readable, as recv returns straight away on them.  If any
+// are among readsds, select returns them immediately without asking the CC3000.
+//
+int select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, timeval *timeout)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(nfds);
+    )
+
+  if (readsds)
+  {
+    fd_set closed;
+    FD_ZERO(&closed);
+    int count = 0;
+    for (int sd = 0; sd < nfds && sd < 8; sd++)
+    {
+      if (FD_ISSET(sd, readsds) && hci_peer_closed(sd))
+      {
+        FD_SET(sd, &closed);
+        count++;
+      }
+    }
+
+    if (count)
+    {
+      *readsds = closed;
+      if (writesds) FD_ZERO(writesds);
+      if (exceptsds) FD_ZERO(exceptsds);
+      return count;
+    }
+  }
+
+  return hci_select(nfds, readsds, writesds, exceptsds, timeout);
+}
+
 int connect(int sd, const sockaddr *addr, long addrlen)
 {
   DEBUG_LV2(
@@ -1102,7 +2297,11 @@ int connect(int sd, const sockaddr *addr, long addrlen)
   hci_write_u32_le(addrlen);
   hci_write_array(addr, addrlen);
 
-  return hci_end_command_receive_u32_result(HCI_CMND_CONNECT, 10000);
+  int result = hci_end_command_receive_u32_result(HCI_CMND_CONNECT, 10000);
+  if (result >= 0 && sd >= 0 && sd < 8)
+    hci_sockets[sd].state |= HCI_SOCKET_CONNECTED;
+
+  return result;
 }
 
 int gethostbyname(char *hostname, unsigned short hnLength, uint32_t *ip)
@@ -1123,7 +2322,8 @@ int gethostbyname(char *hostname, unsigned short hnLength, uint32_t *ip)
   hci_write_u32_le(0x08);
   hci_write_u32_le(hnLength);
   hci_write_array(hostname, hnLength);
-  hci_end_command_begin_receive(HCI_CMND_GETHOSTNAME, 10000);
+  if (!hci_end_command_begin_receive(HCI_CMND_GETHOSTNAME, 10000))
+    return EFAIL;
 
   // Get result
   hci_read_status();
@@ -1135,11 +2335,11 @@ int gethostbyname(char *hostname, unsigned short hnLength, uint32_t *ip)
 }
 
 //
-// From CC3000 fw version 1.32 and up the module does not longer
-// support the mdnsAdvertise command. Instead this has to be
-// implemented in software. This is why we check here for the fw
-// version.
-#if CC3000_FW_VERSION < 132
+// mdnsAdvertiser
+//
+// Only firmware with WLAN_CAP_MDNS_ADVERTISE supports the command; with later firmware this
+// fails and the application has to advertise itself.
+//
 int mdnsAdvertiser(unsigned short mdnsEnabled, char *deviceServiceName, unsigned short deviceServiceNameLength)
 {
   DEBUG_LV2(
@@ -1149,6 +2349,8 @@ int mdnsAdvertiser(unsigned short mdnsEnabled, char *deviceServiceName, unsigned
     SERIAL_PRINTVAR(deviceServiceNameLength);
     )
 
+  if (!(hci_capabilities & WLAN_CAP_MDNS_ADVERTISE))
+    return EFAIL;
   if (deviceServiceNameLength > MDNS_DEVICE_SERVICE_MAX_LENGTH)
     return -1;
 
@@ -1159,4 +2361,640 @@ int mdnsAdvertiser(unsigned short mdnsEnabled, char *deviceServiceName, unsigned
   hci_write_array(deviceServiceName, deviceServiceNameLength);
   return hci_end_command_receive_u32_result(HCI_CMND_MDNS_ADVERTISE, 5000);
 }
+
+//
+// NVMEM
+//
+// Files in the CC3000's serial flash are read and written in data messages, which are streamed
+// straight between the SPI bus and the caller's buffer, or flash, as with send_begin.  Longer
+// transfers are split into NVMEM_PORTION_SIZE pieces, the most the TI host driver sends at once.
+//
+static int hci_nvmem_portion(void)
+{
+  return send_mtu() < NVMEM_PORTION_SIZE ? send_mtu() : NVMEM_PORTION_SIZE;
+}
+
+//
+// hci_nvmem_read_begin
+//
+// Reads size bytes of a file, at most one portion, and waits for the data message.  Returns 1
+// with the data ready to be read, up to hci_end_receive; or 0 if the read failed.
+//
+static uint8_t hci_nvmem_read_begin(uint8_t file_id, uint32_t size, uint32_t offset)
+{
+  hci_begin_command(HCI_CMND_NVMEM_READ, 12);
+  hci_write_u32_le(file_id);
+  hci_write_u32_le(size);
+  hci_write_u32_le(offset);
+  if (!hci_end_command_begin_receive(HCI_CMND_NVMEM_READ, HCI_TIMEOUT_NVMEM))
+    return 0;
+
+  uint8_t status = hci_read_u8();
+  DEBUG_LV2(SERIAL_PRINTVAR(status));
+
+  // The data message follows even if the read failed.
+  hci_data_expected = 1;
+  hci_end_receive();
+
+  uint8_t ready = hci_wait_data();
+  hci_data_expected = 0;
+  if (!ready)
+    return 0;
+
+  if (status || hci_payload_size < size)
+  {
+    hci_end_receive();
+    return 0;
+  }
+  return 1;
+}
+
+int nvmem_read(uint8_t file_id, uint32_t length, uint32_t offset, void *buffer)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(file_id);
+    SERIAL_PRINTVAR(length);
+    SERIAL_PRINTVAR(offset);
+    )
+
+  uint8_t *pos = (uint8_t*)buffer;
+  uint32_t total = 0;
+
+  while (total < length)
+  {
+    uint32_t size = length - total;
+    if (size > (uint32_t)hci_nvmem_portion())
+      size = hci_nvmem_portion();
+
+    if (!hci_nvmem_read_begin(file_id, size, offset + total))
+      return EFAIL;
+
+    // Whatever the CC3000 sends beyond size is discarded by hci_end_receive.
+    hci_read_array(pos, size);
+    hci_end_receive();
+
+    pos += size;
+    total += size;
+  }
+
+  return total;
+}
+
+int nvmem_write_begin(uint8_t file_id, int size, uint32_t offset)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(file_id);
+    SERIAL_PRINTVAR(size);
+    SERIAL_PRINTVAR(offset);
+    )
+
+  if (size < 0 || size > hci_nvmem_portion())
+    return EFAIL;
+
+  hci_begin_data(HCI_DATA_NVMEM_WRITE, 16, size);
+  hci_write_u32_le(file_id);
+  hci_write_u32_le(12);
+  hci_write_u32_le(size);
+  hci_write_u32_le(offset);
+  if (hci_failed)
+    return EFAIL;
+
+  return ESUCCESS;
+}
+
+int nvmem_write_end(void)
+{
+  for (int remaining = hci_send_remaining(); remaining > 0; remaining--)
+    hci_write_u8(0);
+
+  if (hci_end_command_receive_u32_result(HCI_EVNT_NVMEM_WRITE, HCI_TIMEOUT_NVMEM) != 0)
+    return EFAIL;
+  return ESUCCESS;
+}
+
+//
+// hci_nvmem_write
+//
+// Shared implementation of nvmem_write and nvmem_write_P.
+//
+static int hci_nvmem_write(uint8_t file_id, uint32_t length, uint32_t offset, const uint8_t *data, uint8_t flash)
+{
+  uint32_t total = 0;
+
+  while (total < length)
+  {
+    int size = hci_nvmem_portion();
+    if ((uint32_t)size > length - total)
+      size = length - total;
+
+    if (nvmem_write_begin(file_id, size, offset + total) < 0)
+      return EFAIL;
+    if (flash)
+      send_data_P(data + total, size);
+    else
+      send_data(data + total, size);
+    if (nvmem_write_end() < 0)
+      return EFAIL;
+
+    total += size;
+  }
+
+  return total;
+}
+
+int nvmem_write(uint8_t file_id, uint32_t length, uint32_t offset, const void *buffer)
+{
+  return hci_nvmem_write(file_id, length, offset, (const uint8_t*)buffer, 0);
+}
+
+int nvmem_write_P(uint8_t file_id, uint32_t length, uint32_t offset, const void PROGMEM *buffer)
+{
+  return hci_nvmem_write(file_id, length, offset, (const uint8_t*)buffer, 1);
+}
+
+int nvmem_create_entry(uint8_t file_id, uint32_t length)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(file_id);
+    SERIAL_PRINTVAR(length);
+    )
+
+  hci_begin_command(HCI_CMND_NVMEM_CREATE_ENTRY, 8);
+  hci_write_u32_le(file_id);
+  hci_write_u32_le(length);
+  if (!hci_end_command_begin_receive(HCI_CMND_NVMEM_CREATE_ENTRY, HCI_TIMEOUT_NVMEM))
+    return EFAIL;
+
+  uint8_t status = hci_read_u8();
+  DEBUG_LV2(SERIAL_PRINTVAR(status));
+  hci_end_receive();
+
+  return status ? EFAIL : ESUCCESS;
+}
+
+//
+// MAC address
+//
+// Read from NVMEM once and kept, so that names and headers derived from it cost no HCI traffic.
+//
+static uint8_t hci_mac[MAC_ADDR_LEN];
+static uint8_t hci_mac_valid;
+
+int nvmem_get_mac_address(uint8_t *mac)
+{
+  if (!hci_mac_valid)
+  {
+    if (nvmem_read(NVMEM_MAC_FILEID, MAC_ADDR_LEN, 0, hci_mac) != MAC_ADDR_LEN)
+      return EFAIL;
+    hci_mac_valid = 1;
+  }
+
+  memcpy(mac, hci_mac, MAC_ADDR_LEN);
+  return ESUCCESS;
+}
+
+int nvmem_set_mac_address(const uint8_t *mac)
+{
+  hci_mac_valid = 0;
+  if (nvmem_write(NVMEM_MAC_FILEID, MAC_ADDR_LEN, 0, mac) != MAC_ADDR_LEN)
+    return EFAIL;
+
+  memcpy(hci_mac, mac, MAC_ADDR_LEN);
+  hci_mac_valid = 1;
+  return ESUCCESS;
+}
+
+//
+// Service pack programming
+//
+// A patch is written a portion at a time, each in one NVMEM write message, and every portion is
+// read back in one NVMEM read message and compared before the next is written.  Patches in flash
+// go straight from flash to SPI.  Those supplied by a callback are passed through a buffer of
+// NVMEM_PIECE_SIZE bytes, which the callback fills repeatedly while the message is open.
+//
+#define NVMEM_PIECE_SIZE 32
+
+//
+// hci_nvmem_patch_piece
+//
+// Fetches a piece of the patch into buffer.  Exactly one of data and source is set.
+//
+static uint8_t hci_nvmem_patch_piece(const uint8_t PROGMEM *data, nvmem_patch_source source, void *context, uint32_t offset, uint8_t *buffer, int size)
+{
+  if (data)
+  {
+    memcpy_P(buffer, data + offset, size);
+    return 1;
+  }
+  return source(context, offset, buffer, size) == size;
+}
+
+//
+// hci_nvmem_write_patch
+//
+// Shared implementation of nvmem_write_patch and nvmem_write_patch_P.
+//
+static int hci_nvmem_write_patch(uint8_t file_id, uint32_t length, const uint8_t PROGMEM *data, nvmem_patch_source source, void *context)
+{
+  uint8_t buffer[NVMEM_PIECE_SIZE];
+  uint8_t written[NVMEM_PIECE_SIZE];
+
+  for (uint32_t offset = 0; offset < length; )
+  {
+    int size = hci_nvmem_portion();
+    if ((uint32_t)size > length - offset)
+      size = length - offset;
+
+    // Write the portion.  If the source fails, the rest is sent as zeros and the patch fails.
+    if (nvmem_write_begin(file_id, size, offset) < 0)
+      return EFAIL;
+    uint8_t fetched = 1;
+    for (int i = 0; i < size && fetched; i += NVMEM_PIECE_SIZE)
+    {
+      int n = size - i < NVMEM_PIECE_SIZE ? size - i : NVMEM_PIECE_SIZE;
+      if (data)
+        send_data_P(data + offset + i, n);
+      else if ((fetched = hci_nvmem_patch_piece(NULL, source, context, offset + i, buffer, n)))
+        send_data(buffer, n);
+    }
+    if (nvmem_write_end() < 0 || !fetched)
+      return EFAIL;
+
+    // Read it back and compare.
+    if (!hci_nvmem_read_begin(file_id, size, offset))
+      return EFAIL;
+    uint8_t matched = 1;
+    for (int i = 0; i < size && matched; i += NVMEM_PIECE_SIZE)
+    {
+      int n = size - i < NVMEM_PIECE_SIZE ? size - i : NVMEM_PIECE_SIZE;
+      hci_read_array(written, n);
+      matched = hci_nvmem_patch_piece(data, source, context, offset + i, buffer, n) && !memcmp(written, buffer, n);
+    }
+    hci_end_receive();
+    if (!matched)
+    {
+      DEBUG_LV2(SERIAL_PRINTVAR(offset));
+      return EFAIL;
+    }
+
+    offset += size;
+  }
+
+  return ESUCCESS;
+}
+
+int nvmem_write_patch_P(uint8_t file_id, uint32_t length, const void PROGMEM *data)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(file_id);
+    SERIAL_PRINTVAR(length);
+    )
+
+  return hci_nvmem_write_patch(file_id, length, (const uint8_t PROGMEM *)data, NULL, NULL);
+}
+
+int nvmem_write_patch(uint8_t file_id, uint32_t length, nvmem_patch_source source, void *context)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR(file_id);
+    SERIAL_PRINTVAR(length);
+    )
+
+  return hci_nvmem_write_patch(file_id, length, NULL, source, context);
+}
+
+//
+// hci_restore_sockets
+//
+// Recreates the bound sockets recorded in the intent log, with their original descriptors.
+// The CC3000 hands out the lowest free descriptor, so gaps are filled with placeholder sockets
+// which are closed again afterwards.
+//
+// The restore is part of the recovery: a command missing its deadline here only flags the
+// CC3000 as locked, and the restore stops.  The intents of the sockets not yet recreated are
+// then put back in the log, so the next recovery restores them again.  Only sockets the CC3000
+// refuses are reported lost.
+//
+static void hci_restore_sockets(void)
+{
+  DEBUG_LV2(SERIAL_PRINTFUNCTION());
+
+  hci_socket intents[8];
+  memcpy(intents, hci_sockets, sizeof(intents));
+  memset(hci_sockets, 0, sizeof(hci_sockets));
+
+  uint8_t placeholders = 0;
+  uint8_t lost_sockets = 0;
+  uint8_t restored = 0;
+
+  hci_recovering = 1;
+
+  for (uint8_t sd = 0; sd < 8 && !hci_locked; sd++)
+  {
+    hci_socket *intent = &intents[sd];
+    if (!(intent->flags & HCI_INTENT_BOUND))
+      continue;
+
+    int new_sd;
+    while ((new_sd = socket(AF_INET, intent->type, intent->protocol)) >= 0 && new_sd < sd)
+      placeholders |= 1 << new_sd;
+
+    if (hci_locked)
+      break;
+
+    if (new_sd != sd)
+    {
+      if (new_sd >= 0)
+        closesocket(new_sd);
+      lost_sockets |= 1 << sd;
+      continue;
+    }
+
+    char arg = SOCK_ON;
+    if (intent->flags & HCI_INTENT_ACCEPT_NONBLOCK)
+      setsockopt(sd, SOL_SOCKET, SOCKOPT_ACCEPT_NONBLOCK, &arg, sizeof(arg));
+    if (intent->flags & HCI_INTENT_RECV_NONBLOCK)
+      setsockopt(sd, SOL_SOCKET, SOCKOPT_RECV_NONBLOCK, &arg, sizeof(arg));
+    if (intent->recv_timeout)
+      setsockopt(sd, SOL_SOCKET, SOCKOPT_RECV_TIMEOUT, &intent->recv_timeout, sizeof(intent->recv_timeout));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = intent->port;
+    int result = bind(sd, (sockaddr*)&address, sizeof(address));
+    if (result >= 0 && (intent->flags & HCI_INTENT_LISTENING))
+      result = listen(sd, 0);
+
+    if (hci_locked)
+      break;
+    if (result < 0)
+      lost_sockets |= 1 << sd;
+    else
+      restored |= 1 << sd;
+  }
+
+  for (uint8_t sd = 0; sd < 8 && !hci_locked; sd++)
+    if (placeholders & (1 << sd))
+      closesocket(sd);
+
+  hci_recovering = 0;
+
+  if (hci_locked)
+  {
+    // The CC3000 is power cycled by the next recovery, which drops everything created here.
+    for (uint8_t sd = 0; sd < 8; sd++)
+    {
+      if (restored & (1 << sd))
+        continue;
+      if (lost_sockets & (1 << sd))
+        intents[sd].flags = 0;
+      hci_sockets[sd] = intents[sd];
+      hci_sockets[sd].state = 0;
+      hci_sockets[sd].credits = 0;
+    }
+    hci_restore_pending = 1;
+  }
+
+  if (lost_sockets)
+    hci_notify(HCI_EVNT_CC3000_LOCKED, lost_sockets);
+}
+
+//
+// Health monitor
+//
+// wlan_health_poll should be called regularly from the main loop.  Lockups are detected either
+// by a command missing its deadline (which recovers immediately, see hci_fail), by the interrupt
+// handler flagging a stuck IRQ line, or by the CC3000 going silent for longer than
+// HCI_HEALTH_PROBE_INTERVAL, in which case it is probed with a status request.
+//
+// After a recovery, the bound sockets are recreated here once DHCP has completed.
+//
+void wlan_health_poll(void)
+{
+  if (!hci_can_recover())
+    return;
+
+  if (hci_locked)
+  {
+    hci_recover();
+  }
+  else if ((uint32_t)(millis() - hci_last_event) >= HCI_HEALTH_PROBE_INTERVAL)
+  {
+    DEBUG_LV3(SERIAL_PRINTLN("Probing CC3000"));
+    hci_begin_command(HCI_CMND_WLAN_IOCTL_STATUSGET, 0);
+    hci_end_command_receive_u32_result(HCI_CMND_WLAN_IOCTL_STATUSGET, 1000);
+  }
+
+  if (hci_restore_pending && wifi_dhcp)
+  {
+    hci_restore_pending = 0;
+    hci_restore_sockets();
+    hci_recovery_time = millis() - hci_recovery_start;
+  }
+}
+
+uint16_t wlan_health_recoveries(void)
+{
+  return hci_recovery_count;
+}
+
+uint32_t wlan_health_recovery_time(void)
+{
+  return hci_recovery_time;
+}
+
+//
+// Event subscriptions
+//
+// Subscribes a handler to one unsolicited event, e.g. HCI_EVNT_WLAN_ASYNC_PING_REPORT, replacing
+// any handler already subscribed to it.  Handlers are called from the interrupt handler.
+//
+// Maskable events are only sent by the CC3000 while they have a subscriber, apart from
+// connect, disconnect and DHCP which the driver always needs; so subscribing updates the event
+// mask on the CC3000 if it is running, or when it is next started.
+//
+// Returns EFAIL if all HCI_MAX_SUBSCRIPTIONS entries are in use, or for HCI_EVNT_WLAN_TX_COMPLETE,
+// which this driver never delivers.
+//
+static void hci_update_event_mask(void)
+{
+  if (hci_init_state != HCI_INIT_READY)
+    return;
+
+  hci_begin_event_mask();
+  if (hci_end_command_begin_receive(HCI_CMND_EVENT_MASK, 1000))
+    hci_end_receive();
+}
+
+int wifi_subscribe(uint16_t event, wifi_event_handler handler)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR_HEX(event);
+    )
+
+  if (event == HCI_EVNT_WLAN_TX_COMPLETE)
+    return EFAIL;
+
+  hci_subscription *entry = NULL;
+  for (uint8_t i = 0; i < HCI_MAX_SUBSCRIPTIONS; i++)
+  {
+    if (hci_subscriptions[i].event == event)
+    {
+      entry = &hci_subscriptions[i];
+      break;
+    }
+    if (!entry && !hci_subscriptions[i].event)
+      entry = &hci_subscriptions[i];
+  }
+
+  if (!entry)
+    return EFAIL;
+
+  uint8_t subscribed = entry->event == event;
+
+  noInterrupts();
+  entry->handler = handler;
+  entry->event = event;
+  interrupts();
+
+  if (!subscribed)
+    hci_update_event_mask();
+
+  return ESUCCESS;
+}
+
+int wifi_unsubscribe(uint16_t event)
+{
+  DEBUG_LV2(
+    SERIAL_PRINTFUNCTION();
+    SERIAL_PRINTVAR_HEX(event);
+    )
+
+  for (uint8_t i = 0; i < HCI_MAX_SUBSCRIPTIONS; i++)
+  {
+    if (hci_subscriptions[i].event == event)
+    {
+      hci_subscriptions[i].event = 0;
+      hci_update_event_mask();
+      return ESUCCESS;
+    }
+  }
+
+  return EFAIL;
+}
+
+//
+// Startup profile
+//
+// Records the time since power on, in milliseconds, at which each startup phase first completed.
+// The driver marks all phases up to the first accept; the application marks
+// HCI_PROFILE_RESPONSE once it has served its first response.
+//
+void hci_profile_mark(uint8_t phase)
+{
+  if (phase < HCI_PROFILE_PHASES && !hci_profile[phase])
+    hci_profile[phase] = millis();
+}
+
+uint32_t hci_profile_time(uint8_t phase)
+{
+  return phase < HCI_PROFILE_PHASES ? hci_profile[phase] : 0;
+}
+
+void hci_profile_report(void)
+{
+  static const char *const names[HCI_PROFILE_PHASES] =
+  {
+    "wlan_init", "association", "DHCP", "netapp_timeout_values", "socket/bind/listen",
+    "first accept", "first response"
+  };
+
+  uint32_t previous = 0;
+  for (uint8_t phase = 0; phase < HCI_PROFILE_PHASES; phase++)
+  {
+    SERIAL_PORT.print(names[phase]);
+    SERIAL_PORT.print(": ");
+    if (hci_profile[phase])
+    {
+      SERIAL_PORT.print(hci_profile[phase]);
+      SERIAL_PORT.print(" ms (+");
+      SERIAL_PORT.print(hci_profile[phase] - previous);
+      SERIAL_PORT.println(")");
+      previous = hci_profile[phase];
+    }
+    else
+    {
+      SERIAL_PORT.println("-");
+    }
+  }
+  SERIAL_PORT.flush();
+}
+
+#if USE_LATENCY_STATS
+//
+// Latency statistics
+//
+// Every command round trip is timed from hci_begin_command to its response event (or its
+// recovery, if it timed out), and counted in a histogram of power-of-two microsecond buckets.
+// Bucket b counts round trips of 2^b to 2^(b+1) microseconds, and the last bucket all longer
+// ones.  Percentiles are reported as the upper bound of the bucket they fall in.
+//
+void hci_latency_reset(void)
+{
+  for (uint8_t i = 0; i < HCI_LATENCY_BUCKETS; i++)
+    hci_latency_histogram[i] = 0;
+}
+
+uint32_t hci_latency_percentile(uint16_t permille)
+{
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < HCI_LATENCY_BUCKETS; i++)
+    total += hci_latency_histogram[i];
+
+  uint32_t rank = (total * permille + 999) / 1000;
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < HCI_LATENCY_BUCKETS; i++)
+  {
+    count += hci_latency_histogram[i];
+    if (count >= rank && count > 0)
+      return i < HCI_LATENCY_BUCKETS - 1 ? (uint32_t)1 << (i + 1) : HCI_LATENCY_UNBOUNDED;
+  }
+  return 0;
+}
+
+static void hci_latency_print(const char *label, uint16_t permille)
+{
+  SERIAL_PORT.print(label);
+  uint32_t latency = hci_latency_percentile(permille);
+  if (latency == HCI_LATENCY_UNBOUNDED)
+  {
+    SERIAL_PORT.print(">= ");
+    SERIAL_PORT.println((uint32_t)1 << (HCI_LATENCY_BUCKETS - 1));
+  }
+  else
+  {
+    SERIAL_PORT.println(latency);
+  }
+}
+
+void hci_latency_report(void)
+{
+  hci_latency_print("p50 us: ", 500);
+  hci_latency_print("p99 us: ", 990);
+  hci_latency_print("p999 us: ", 999);
+  SERIAL_PORT.flush();
+}
+
+void hci_inject_faults(uint16_t interval)
+{
+  hci_fault_interval = interval;
+  hci_fault_countdown = interval;
+}
 #endif
@@ -62,7 +62,21 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #define HCI_EVNT_ASYNC_ARP_DONE                 0x8400
 #define HCI_EVNT_WLAN_UNSOL_TCP_CLOSE_WAIT      0x8800
 #define HCI_EVNT_ASYNC_ARP_WAITING              0x8900
-#define HCI_EVNT_CC3000_LOCKED                  0x8A00
+#define HCI_EVNT_CC3000_LOCKED                  0x8A00  // arg is a bitmask of the sockets lost to recovery
+
+//
+// Handler for an unsolicited event, see wifi_subscribe.
+//
+typedef void (*wifi_event_handler)(uint16_t event, uint32_t arg);
+
+//
+// Timers, safe across millis() wrap-around.
+//
+typedef struct _hci_timer_t
+{
+    uint32_t         start;
+    uint32_t         timeout;
+} hci_timer;
 
 typedef struct _in_addr_t
 {
@@ -116,7 +130,7 @@ typedef long int __fd_mask;
 // fd_set for select and pselect.
 typedef struct
 {
-    __fd_mask fds_bits[__FD_SETSIZE / __NFDBITS];
+    __fd_mask fds_bits[(__FD_SETSIZE + __NFDBITS - 1) / __NFDBITS];
 #define __FDS_BITS(set)        ((set)->fds_bits)
 } fd_set;
 
@@ -203,8 +217,37 @@ extern volatile int16_t client_socket;
 #define ESUCCESS        0
 #define EFAIL          -1
 #define EERROR          EFAIL
+#define ESOCKINPROGRESS -2      // a non-blocking accept has no client pending
+#define ESOCKCLOSED    -57      // the peer has closed the socket, as reported by the CC3000
+
+//
+// wlan_init_step results
+//
+#define WLAN_INIT_BUSY      0
+#define WLAN_INIT_READY     1
+#define WLAN_INIT_FAILED   -1
+
+//
+// Service packs the CC3000 runs after wlan_init.  Patches are programmed with the CC3000 started
+// with SL_PATCHES_REQUEST_FORCE_NONE, see nvmem_write_patch.
+//
+#define SL_PATCHES_REQUEST_DEFAULT      0   // those stored in NVMEM
+#define SL_PATCHES_REQUEST_FORCE_HOST   1   // supplied by the host at startup; not supported
+#define SL_PATCHES_REQUEST_FORCE_NONE   2   // none, as when reprogramming them
 
-void wlan_init(void);
+void wlan_init(uint8_t patches = SL_PATCHES_REQUEST_DEFAULT);
+uint8_t wlan_init_warm(void);
+void wlan_init_begin(uint8_t patches = SL_PATCHES_REQUEST_DEFAULT);
+int8_t wlan_init_step(void);
+uint32_t wlan_init_time(void);
+
+//
+// Firmware capabilities, known once wlan_init is done.
+//
+#define WLAN_CAP_MDNS_ADVERTISE     0x01    // mdnsAdvertiser is supported; before 1.32
+
+uint16_t wlan_sp_version(void);
+uint8_t wlan_capabilities(void);
 long netapp_timeout_values(unsigned long *aucDHCP, unsigned long *aucARP, unsigned long *aucKeepalive, unsigned long *aucInactivity);
 int32_t wlan_ioctl_set_connection_policy(bool should_connect_to_open_ap, bool should_use_fast_connect, bool use_profiles);
 int32_t wlan_connect(unsigned long sec_type, const char *ssid, long ssid_len, unsigned char *bssid, unsigned char *key, long key_len);
@@ -215,10 +258,140 @@ int listen(int sd, int backlog);
 int bind(int sd, struct _sockaddr_t *addr, int addrlen);
 int accept(int sd, struct sockaddr_t *addr, unsigned long *addrlen);
 int recv(int sd, void *buffer, int size, int flags);
+int recvfrom(int sd, void *buffer, int size, int flags, sockaddr *from, socklen_t *fromlen);
 int send(int sd, const void *buffer, int size, int flags);
+int send_mtu(void);
+int send_begin(int sd, int size, int flags);
+void send_data(const void *buffer, int size);
+void send_data_P(const void PROGMEM *buffer, int size);
+int send_end(void);
+int sendto(int sd, const void *buffer, int size, int flags, const sockaddr *to, socklen_t tolen);
 int select(long nfds, fd_set *readsds, fd_set *writesds, fd_set *exceptsds, timeval *timeout);
 int closesocket(int sd);
 int mdnsAdvertiser(unsigned short mdnsEnabled, char *deviceServiceName, unsigned short deviceServiceNameLength);
 int gethostbyname(char *url, unsigned short len, unsigned long *ip);
 
+//
+// NVMEM files in the CC3000's serial flash.
+//
+// nvmem_read and nvmem_write return the number of bytes transferred, or EFAIL.  Data moves
+// directly between the buffer and SPI without a staging copy.  A write can also be streamed
+// from several buffers: nvmem_write_begin starts a write of up to NVMEM_PORTION_SIZE bytes,
+// which are supplied by send_data and send_data_P as for send_begin, then nvmem_write_end
+// waits for the CC3000 to store them.
+//
+// Files 12 to 15 belong to the application and are created, or resized, with nvmem_create_entry.
+// By TI's convention 12 holds an AES key and 13 shared data.
+//
+#define NVMEM_NVS_FILEID                0
+#define NVMEM_NVS_SHADOW_FILEID         1
+#define NVMEM_WLAN_CONFIG_FILEID        2
+#define NVMEM_WLAN_CONFIG_SHADOW_FILEID 3
+#define NVMEM_WLAN_DRIVER_SP_FILEID     4
+#define NVMEM_WLAN_FW_SP_FILEID         5
+#define NVMEM_MAC_FILEID                6
+#define NVMEM_FRONTEND_VARS_FILEID      7
+#define NVMEM_IP_CONFIG_FILEID          8
+#define NVMEM_IP_CONFIG_SHADOW_FILEID   9
+#define NVMEM_BOOTLOADER_SP_FILEID      10
+#define NVMEM_RM_FILEID                 11
+#define NVMEM_AES128_KEY_FILEID         12
+#define NVMEM_SHARED_MEM_FILEID         13
+
+#define NVMEM_PORTION_SIZE              512
+
+int nvmem_read(uint8_t file_id, uint32_t length, uint32_t offset, void *buffer);
+int nvmem_write(uint8_t file_id, uint32_t length, uint32_t offset, const void *buffer);
+int nvmem_write_P(uint8_t file_id, uint32_t length, uint32_t offset, const void PROGMEM *buffer);
+int nvmem_write_begin(uint8_t file_id, int size, uint32_t offset);
+int nvmem_write_end(void);
+int nvmem_create_entry(uint8_t file_id, uint32_t length);
+
+//
+// MAC address, read from NVMEM_MAC_FILEID on first use and cached.  A new address takes effect
+// when the CC3000 is next started.
+//
+#define MAC_ADDR_LEN                    6
+
+int nvmem_get_mac_address(uint8_t *mac);
+int nvmem_set_mac_address(const uint8_t *mac);
+
+//
+// Service pack programming.
+//
+// Writes a driver (NVMEM_WLAN_DRIVER_SP_FILEID) or firmware (NVMEM_WLAN_FW_SP_FILEID) patch and
+// reads it back to verify it.  Returns ESUCCESS, or EFAIL if the write failed or the file does
+// not match.  Start the CC3000 with wlan_init(SL_PATCHES_REQUEST_FORCE_NONE) first, and with
+// wlan_init() afterwards to run the new patches.
+//
+// A patch that is not in flash is fetched through a source callback, which copies size bytes
+// starting at offset into data and returns the number copied.  It is called twice for each
+// piece, once to write it and once to verify it.  It is called in the middle of a transfer with
+// the CC3000, so it must not use the SPI bus.
+//
+typedef int (*nvmem_patch_source)(void *context, uint32_t offset, uint8_t *data, int size);
+
+int nvmem_write_patch_P(uint8_t file_id, uint32_t length, const void PROGMEM *data);
+int nvmem_write_patch(uint8_t file_id, uint32_t length, nvmem_patch_source source, void *context);
+
+//
+// Event subscriptions, see tinyhci.cpp.  Events are also passed to wifi_callback(event, arg),
+// if the user program defines it; but maskable events other than connect, disconnect and DHCP
+// are only sent by the CC3000 while they have a subscriber.
+//
+int wifi_subscribe(uint16_t event, wifi_event_handler handler);
+int wifi_unsubscribe(uint16_t event);
+
+//
+// Health monitor, see tinyhci.cpp.  Call wlan_health_poll from loop() to detect CC3000 lockups and
+// restore the link and listening sockets afterwards.  The recovery time is in milliseconds,
+// measured from the detection of the lockup until the sockets are listening again.
+//
+void wlan_health_poll(void);
+uint16_t wlan_health_recoveries(void);
+uint32_t wlan_health_recovery_time(void);
+uint8_t hci_peer_closed(int sd);
+
+//
+// Startup profile phases, in the order they normally complete.
+//
+#define HCI_PROFILE_INIT            0       // wlan_init ready
+#define HCI_PROFILE_ASSOCIATED      1       // connected to the access point
+#define HCI_PROFILE_DHCP            2       // IP address assigned
+#define HCI_PROFILE_TIMEOUTS        3       // netapp_timeout_values done
+#define HCI_PROFILE_LISTEN          4       // first listen done
+#define HCI_PROFILE_ACCEPT          5       // first client accepted
+#define HCI_PROFILE_RESPONSE        6       // marked by the application
+#define HCI_PROFILE_PHASES          7
+
+void hci_profile_mark(uint8_t phase);
+uint32_t hci_profile_time(uint8_t phase);
+void hci_profile_report(void);
+
+void hci_timer_start(hci_timer *timer, uint32_t timeout);
+bool hci_timer_expired(const hci_timer *timer);
+
+//
+// Latency statistics and fault injection.
+//
+// Define USE_LATENCY_STATS as 1 in the build flags to collect a histogram of every command round
+// trip, and to allow timeouts to be injected for testing the recovery path.
+//
+// hci_inject_faults makes every interval'th command time out (0 disables), which exercises
+// the recovery path.  Percentiles are given in permille, e.g. 990 for p99, and returned in
+// microseconds; or HCI_LATENCY_UNBOUNDED if they fall beyond the last bucket of the histogram.
+//
+#ifndef USE_LATENCY_STATS
+#define USE_LATENCY_STATS 0
+#endif
+
+#if USE_LATENCY_STATS
+#define HCI_LATENCY_UNBOUNDED       0xffffffffUL
+
+void hci_latency_reset(void);
+uint32_t hci_latency_percentile(uint16_t permille);
+void hci_latency_report(void);
+void hci_inject_faults(uint16_t interval);
+#endif
+
 #endif
@@ -0,0 +1,237 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci_aes.h"
+
+//
+// Round table
+//
+// Each entry is the column that MixColumns makes of one S-box output s: {2s, s, s, 3s}, most
+// significant byte first.  The other three tables of the usual T-table implementation are
+// rotations of this one, and the S-box itself is its second byte, so only 1 KB of flash is used.
+//
+static const uint32_t aes_te[256] PROGMEM =
+{
+  0xc66363a5UL, 0xf87c7c84UL, 0xee777799UL, 0xf67b7b8dUL, 0xfff2f20dUL, 0xd66b6bbdUL,
+  0xde6f6fb1UL, 0x91c5c554UL, 0x60303050UL, 0x02010103UL, 0xce6767a9UL, 0x562b2b7dUL,
+  0xe7fefe19UL, 0xb5d7d762UL, 0x4dababe6UL, 0xec76769aUL, 0x8fcaca45UL, 0x1f82829dUL,
+  0x89c9c940UL, 0xfa7d7d87UL, 0xeffafa15UL, 0xb25959ebUL, 0x8e4747c9UL, 0xfbf0f00bUL,
+  0x41adadecUL, 0xb3d4d467UL, 0x5fa2a2fdUL, 0x45afafeaUL, 0x239c9cbfUL, 0x53a4a4f7UL,
+  0xe4727296UL, 0x9bc0c05bUL, 0x75b7b7c2UL, 0xe1fdfd1cUL, 0x3d9393aeUL, 0x4c26266aUL,
+  0x6c36365aUL, 0x7e3f3f41UL, 0xf5f7f702UL, 0x83cccc4fUL, 0x6834345cUL, 0x51a5a5f4UL,
+  0xd1e5e534UL, 0xf9f1f108UL, 0xe2717193UL, 0xabd8d873UL, 0x62313153UL, 0x2a15153fUL,
+  0x0804040cUL, 0x95c7c752UL, 0x46232365UL, 0x9dc3c35eUL, 0x30181828UL, 0x379696a1UL,
+  0x0a05050fUL, 0x2f9a9ab5UL, 0x0e070709UL, 0x24121236UL, 0x1b80809bUL, 0xdfe2e23dUL,
+  0xcdebeb26UL, 0x4e272769UL, 0x7fb2b2cdUL, 0xea75759fUL, 0x1209091bUL, 0x1d83839eUL,
+  0x582c2c74UL, 0x341a1a2eUL, 0x361b1b2dUL, 0xdc6e6eb2UL, 0xb45a5aeeUL, 0x5ba0a0fbUL,
+  0xa45252f6UL, 0x763b3b4dUL, 0xb7d6d661UL, 0x7db3b3ceUL, 0x5229297bUL, 0xdde3e33eUL,
+  0x5e2f2f71UL, 0x13848497UL, 0xa65353f5UL, 0xb9d1d168UL, 0x00000000UL, 0xc1eded2cUL,
+  0x40202060UL, 0xe3fcfc1fUL, 0x79b1b1c8UL, 0xb65b5bedUL, 0xd46a6abeUL, 0x8dcbcb46UL,
+  0x67bebed9UL, 0x7239394bUL, 0x944a4adeUL, 0x984c4cd4UL, 0xb05858e8UL, 0x85cfcf4aUL,
+  0xbbd0d06bUL, 0xc5efef2aUL, 0x4faaaae5UL, 0xedfbfb16UL, 0x864343c5UL, 0x9a4d4dd7UL,
+  0x66333355UL, 0x11858594UL, 0x8a4545cfUL, 0xe9f9f910UL, 0x04020206UL, 0xfe7f7f81UL,
+  0xa05050f0UL, 0x783c3c44UL, 0x259f9fbaUL, 0x4ba8a8e3UL, 0xa25151f3UL, 0x5da3a3feUL,
+  0x804040c0UL, 0x058f8f8aUL, 0x3f9292adUL, 0x219d9dbcUL, 0x70383848UL, 0xf1f5f504UL,
+  0x63bcbcdfUL, 0x77b6b6c1UL, 0xafdada75UL, 0x42212163UL, 0x20101030UL, 0xe5ffff1aUL,
+  0xfdf3f30eUL, 0xbfd2d26dUL, 0x81cdcd4cUL, 0x180c0c14UL, 0x26131335UL, 0xc3ecec2fUL,
+  0xbe5f5fe1UL, 0x359797a2UL, 0x884444ccUL, 0x2e171739UL, 0x93c4c457UL, 0x55a7a7f2UL,
+  0xfc7e7e82UL, 0x7a3d3d47UL, 0xc86464acUL, 0xba5d5de7UL, 0x3219192bUL, 0xe6737395UL,
+  0xc06060a0UL, 0x19818198UL, 0x9e4f4fd1UL, 0xa3dcdc7fUL, 0x44222266UL, 0x542a2a7eUL,
+  0x3b9090abUL, 0x0b888883UL, 0x8c4646caUL, 0xc7eeee29UL, 0x6bb8b8d3UL, 0x2814143cUL,
+  0xa7dede79UL, 0xbc5e5ee2UL, 0x160b0b1dUL, 0xaddbdb76UL, 0xdbe0e03bUL, 0x64323256UL,
+  0x743a3a4eUL, 0x140a0a1eUL, 0x924949dbUL, 0x0c06060aUL, 0x4824246cUL, 0xb85c5ce4UL,
+  0x9fc2c25dUL, 0xbdd3d36eUL, 0x43acacefUL, 0xc46262a6UL, 0x399191a8UL, 0x319595a4UL,
+  0xd3e4e437UL, 0xf279798bUL, 0xd5e7e732UL, 0x8bc8c843UL, 0x6e373759UL, 0xda6d6db7UL,
+  0x018d8d8cUL, 0xb1d5d564UL, 0x9c4e4ed2UL, 0x49a9a9e0UL, 0xd86c6cb4UL, 0xac5656faUL,
+  0xf3f4f407UL, 0xcfeaea25UL, 0xca6565afUL, 0xf47a7a8eUL, 0x47aeaee9UL, 0x10080818UL,
+  0x6fbabad5UL, 0xf0787888UL, 0x4a25256fUL, 0x5c2e2e72UL, 0x381c1c24UL, 0x57a6a6f1UL,
+  0x73b4b4c7UL, 0x97c6c651UL, 0xcbe8e823UL, 0xa1dddd7cUL, 0xe874749cUL, 0x3e1f1f21UL,
+  0x964b4bddUL, 0x61bdbddcUL, 0x0d8b8b86UL, 0x0f8a8a85UL, 0xe0707090UL, 0x7c3e3e42UL,
+  0x71b5b5c4UL, 0xcc6666aaUL, 0x904848d8UL, 0x06030305UL, 0xf7f6f601UL, 0x1c0e0e12UL,
+  0xc26161a3UL, 0x6a35355fUL, 0xae5757f9UL, 0x69b9b9d0UL, 0x17868691UL, 0x99c1c158UL,
+  0x3a1d1d27UL, 0x279e9eb9UL, 0xd9e1e138UL, 0xebf8f813UL, 0x2b9898b3UL, 0x22111133UL,
+  0xd26969bbUL, 0xa9d9d970UL, 0x078e8e89UL, 0x339494a7UL, 0x2d9b9bb6UL, 0x3c1e1e22UL,
+  0x15878792UL, 0xc9e9e920UL, 0x87cece49UL, 0xaa5555ffUL, 0x50282878UL, 0xa5dfdf7aUL,
+  0x038c8c8fUL, 0x59a1a1f8UL, 0x09898980UL, 0x1a0d0d17UL, 0x65bfbfdaUL, 0xd7e6e631UL,
+  0x844242c6UL, 0xd06868b8UL, 0x824141c3UL, 0x299999b0UL, 0x5a2d2d77UL, 0x1e0f0f11UL,
+  0x7bb0b0cbUL, 0xa85454fcUL, 0x6dbbbbd6UL, 0x2c16163aUL,
+};
+
+static inline uint32_t aes_t(uint8_t x)
+{
+  return pgm_read_dword(&aes_te[x]);
+}
+
+static inline uint32_t aes_ror8(uint32_t v)
+{
+  return (v >> 8) | (v << 24);
+}
+
+static inline uint8_t aes_sbox(uint8_t x)
+{
+  return (uint8_t)(aes_t(x) >> 8);
+}
+
+static inline uint32_t aes_sub_word(uint32_t v)
+{
+  return ((uint32_t)aes_sbox(v >> 24) << 24) | ((uint32_t)aes_sbox(v >> 16) << 16) |
+         ((uint32_t)aes_sbox(v >> 8) << 8) | aes_sbox(v);
+}
+
+static inline uint32_t aes_load(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void aes_store(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+void aes_expand_key(uint32_t *round_keys, const uint8_t *key)
+{
+  uint8_t rcon = 0x01;
+
+  for (uint8_t i = 0; i < 4; i++)
+    round_keys[i] = aes_load(key + 4 * i);
+
+  for (uint8_t i = 4; i < 44; i++)
+  {
+    uint32_t w = round_keys[i - 1];
+    if ((i & 3) == 0)
+    {
+      w = aes_sub_word((w << 8) | (w >> 24)) ^ ((uint32_t)rcon << 24);
+      rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0);
+    }
+    round_keys[i] = round_keys[i - 4] ^ w;
+  }
+}
+
+//
+// aes_encrypt_block
+//
+// Each of the nine full rounds computes a column with four table lookups, which together do
+// SubBytes, ShiftRows and MixColumns; the last round has no MixColumns and uses the S-box.
+//
+void aes_encrypt_block(const uint32_t *round_keys, uint8_t *block)
+{
+  const uint32_t *rk = round_keys;
+  uint32_t s0 = aes_load(block) ^ rk[0];
+  uint32_t s1 = aes_load(block + 4) ^ rk[1];
+  uint32_t s2 = aes_load(block + 8) ^ rk[2];
+  uint32_t s3 = aes_load(block + 12) ^ rk[3];
+
+  for (uint8_t round = 1; round < 10; round++)
+  {
+    rk += 4;
+    uint32_t t0 = aes_t(s0 >> 24) ^ aes_ror8(aes_t(s1 >> 16) ^ aes_ror8(aes_t(s2 >> 8) ^ aes_ror8(aes_t(s3)))) ^ rk[0];
+    uint32_t t1 = aes_t(s1 >> 24) ^ aes_ror8(aes_t(s2 >> 16) ^ aes_ror8(aes_t(s3 >> 8) ^ aes_ror8(aes_t(s0)))) ^ rk[1];
+    uint32_t t2 = aes_t(s2 >> 24) ^ aes_ror8(aes_t(s3 >> 16) ^ aes_ror8(aes_t(s0 >> 8) ^ aes_ror8(aes_t(s1)))) ^ rk[2];
+    uint32_t t3 = aes_t(s3 >> 24) ^ aes_ror8(aes_t(s0 >> 16) ^ aes_ror8(aes_t(s1 >> 8) ^ aes_ror8(aes_t(s2)))) ^ rk[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  rk += 4;
+  aes_store(block,      (((uint32_t)aes_sbox(s0 >> 24) << 24) | ((uint32_t)aes_sbox(s1 >> 16) << 16) |
+                         ((uint32_t)aes_sbox(s2 >> 8) << 8) | aes_sbox(s3)) ^ rk[0]);
+  aes_store(block + 4,  (((uint32_t)aes_sbox(s1 >> 24) << 24) | ((uint32_t)aes_sbox(s2 >> 16) << 16) |
+                         ((uint32_t)aes_sbox(s3 >> 8) << 8) | aes_sbox(s0)) ^ rk[1]);
+  aes_store(block + 8,  (((uint32_t)aes_sbox(s2 >> 24) << 24) | ((uint32_t)aes_sbox(s3 >> 16) << 16) |
+                         ((uint32_t)aes_sbox(s0 >> 8) << 8) | aes_sbox(s1)) ^ rk[2]);
+  aes_store(block + 12, (((uint32_t)aes_sbox(s3 >> 24) << 24) | ((uint32_t)aes_sbox(s0 >> 16) << 16) |
+                         ((uint32_t)aes_sbox(s1 >> 8) << 8) | aes_sbox(s2)) ^ rk[3]);
+}
+
+void AesCtr::begin(const uint8_t *key, const uint8_t *initial_counter)
+{
+  aes_expand_key(round_keys, key);
+  memcpy(counter, initial_counter, AES_BLOCK_SIZE);
+  used = AES_BLOCK_SIZE;
+}
+
+//
+// AesCtr::next_block
+//
+// Encrypts the counter into the next block of key stream and increments it, big-endian.
+//
+void AesCtr::next_block(void)
+{
+  memcpy(stream, counter, AES_BLOCK_SIZE);
+  aes_encrypt_block(round_keys, stream);
+  used = 0;
+
+  for (int8_t i = AES_BLOCK_SIZE - 1; i >= 0 && ++counter[i] == 0; i--)
+    ;
+}
+
+void AesCtr::crypt(uint8_t *data, size_t size)
+{
+  while (size)
+  {
+    if (used == AES_BLOCK_SIZE)
+      next_block();
+
+    uint8_t n = AES_BLOCK_SIZE - used;
+    if (n > size)
+      n = size;
+    size -= n;
+    while (n--)
+      *data++ ^= stream[used++];
+  }
+}
+
+void AesCtr::send_data(uint8_t *data, int size)
+{
+  crypt(data, size);
+  ::send_data(data, size);
+}
+
+void AesCtr::send_data_P(const void PROGMEM *data, int size)
+{
+  const uint8_t PROGMEM *pos = (const uint8_t PROGMEM *)data;
+  uint8_t block[AES_BLOCK_SIZE];
+
+  while (size > 0)
+  {
+    int n = size < AES_BLOCK_SIZE ? size : AES_BLOCK_SIZE;
+    memcpy_P(block, pos, n);
+    crypt(block, n);
+    ::send_data(block, n);
+    pos += n;
+    size -= n;
+  }
+}
+
+int aes_read_key(uint8_t *key)
+{
+  return nvmem_read(NVMEM_AES128_KEY_FILEID, AES_KEY_SIZE, 0, key) == AES_KEY_SIZE ? ESUCCESS : EFAIL;
+}
+
+int aes_write_key(const uint8_t *key)
+{
+  return nvmem_write(NVMEM_AES128_KEY_FILEID, AES_KEY_SIZE, 0, key) == AES_KEY_SIZE ? ESUCCESS : EFAIL;
+}
@@ -0,0 +1,86 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_AES_H__
+#define __TINYHCI_AES_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+
+//
+// AES-128-CTR
+//
+// Encrypts a stream with AES-128 in counter mode, as in NIST SP 800-38A.  The block cipher
+// works on 32-bit columns with a round table in flash, instead of multiplying in GF(2^8) byte
+// by byte, and the key is expanded once by begin.  Counter mode only ever encrypts, so
+// decrypting is the same operation with the same key and initial counter.
+//
+// Data is encrypted in place as it is handed to the send path, so there is no second buffer:
+//
+//   AesCtr aes;
+//   uint8_t key[AES_KEY_SIZE];
+//
+//   aes_read_key(key);
+//   aes.begin(key, counter);            // a counter never used before with this key
+//   send_begin(sd, size, 0);
+//   aes.send_data(buffer, size);        // buffer now holds the ciphertext
+//   send_end();
+//
+// Counter mode gives confidentiality only: the receiver cannot tell if the ciphertext was
+// changed, and reusing a counter value with the same key reveals the plaintexts.
+//
+#define AES_KEY_SIZE              16
+#define AES_BLOCK_SIZE            16
+
+class AesCtr
+{
+public:
+  AesCtr() : used(AES_BLOCK_SIZE) {}
+
+  // Expands the key and sets the initial counter block.
+  void begin(const uint8_t *key, const uint8_t *counter);
+
+  // Encrypts, or decrypts, data in place, continuing the stream.
+  void crypt(uint8_t *data, size_t size);
+
+  // Encrypts data in place and adds it to the send begun by send_begin.
+  void send_data(uint8_t *data, int size);
+
+  // Encrypts data from flash and adds it to the send, a block at a time.
+  void send_data_P(const void PROGMEM *data, int size);
+
+private:
+  void next_block(void);
+
+  uint32_t round_keys[44];
+  uint8_t counter[AES_BLOCK_SIZE];
+  uint8_t stream[AES_BLOCK_SIZE];
+  uint8_t used;                           // bytes of stream already used
+};
+
+// Encrypts one block in place with an expanded key; see AesCtr.
+void aes_expand_key(uint32_t *round_keys, const uint8_t *key);
+void aes_encrypt_block(const uint32_t *round_keys, uint8_t *block);
+
+// Reads or writes the AES key kept by the CC3000 in NVMEM_AES128_KEY_FILEID.
+int aes_read_key(uint8_t *key);
+int aes_write_key(const uint8_t *key);
+
+#endif
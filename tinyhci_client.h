@@ -0,0 +1,252 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_CLIENT_H__
+#define __TINYHCI_CLIENT_H__
+
+#include <Arduino.h>
+#include <Client.h>
+#include <IPAddress.h>
+#include "tinyhci.h"
+
+//
+// HciClient
+//
+// An Arduino Client over a tinyhci TCP socket, for libraries that take a Client&.
+//
+// Single-byte writes are collected in a transmit buffer, and bulk writes are sent with the
+// buffered bytes in front of them as one packet using the streamed send API, so each packet
+// carries up to send_mtu bytes however the library writes.  Reads are served from a receive
+// buffer, and bulk reads larger than it go straight to recv.
+//
+// available() polls the CC3000 with a short select when the receive buffer is empty, as
+// libraries call it in a loop while waiting for data.
+//
+#ifndef HCI_CLIENT_RX_BUFFER
+#define HCI_CLIENT_RX_BUFFER    64
+#endif
+#ifndef HCI_CLIENT_TX_BUFFER
+#define HCI_CLIENT_TX_BUFFER    64
+#endif
+
+#define HCI_CLIENT_POLL_US      5000
+
+class HciClient : public Client
+{
+public:
+  HciClient() : sd(-1), rx_idx(0), rx_len(0), tx_len(0) {}
+  explicit HciClient(int sd) : sd(sd), rx_idx(0), rx_len(0), tx_len(0) {}
+  virtual ~HciClient() { stop(); }
+
+  virtual int connect(IPAddress ip, uint16_t port)
+  {
+    stop();
+
+    sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sd < 0)
+      return 0;
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(((uint32_t)ip[0] << 24) | ((uint32_t)ip[1] << 16) | ((uint32_t)ip[2] << 8) | ip[3]);
+    address.sin_port = htons(port);
+    if (::connect(sd, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+      closesocket(sd);
+      sd = -1;
+      return 0;
+    }
+
+    return 1;
+  }
+
+  virtual int connect(const char *host, uint16_t port)
+  {
+    unsigned long ip = 0;
+    if (gethostbyname((char *)host, strlen(host), &ip) < 0 || !ip)
+      return 0;
+    return connect(IPAddress(ip >> 24, ip >> 16, ip >> 8, ip), port);
+  }
+
+  virtual size_t write(uint8_t c)
+  {
+    if (tx_len >= sizeof(tx_buf) && !send_buffered(NULL, 0))
+      return 0;
+    tx_buf[tx_len++] = c;
+    return 1;
+  }
+
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t written = 0;
+    while (size)
+    {
+      if (tx_len + size <= sizeof(tx_buf))
+      {
+        memcpy(tx_buf + tx_len, buffer, size);
+        tx_len += size;
+        return written + size;
+      }
+
+      // Send the buffered bytes together with as much of the new data as fits in a packet.
+      int space = send_mtu() - tx_len;
+      size_t chunk = space > 0 && (size_t)space < size ? space : size;
+      if (!send_buffered(buffer, chunk))
+        return written;
+
+      buffer += chunk;
+      size -= chunk;
+      written += chunk;
+    }
+    return written;
+  }
+
+  virtual int available()
+  {
+    if (rx_idx < rx_len)
+      return rx_len - rx_idx;
+    if (sd < 0 || !readable())
+      return 0;
+
+    fill();
+    return rx_len - rx_idx;
+  }
+
+  virtual int read()
+  {
+    if (!available())
+      return -1;
+    return rx_buf[rx_idx++];
+  }
+
+  virtual int read(uint8_t *buffer, size_t size)
+  {
+    if (rx_idx >= rx_len)
+    {
+      if (sd < 0 || !readable())
+        return -1;
+      if (size >= sizeof(rx_buf))
+        return check(recv(sd, buffer, size, 0));
+      fill();
+    }
+
+    size_t count = rx_len - rx_idx;
+    if (count > size)
+      count = size;
+    memcpy(buffer, rx_buf + rx_idx, count);
+    rx_idx += count;
+    return count;
+  }
+
+  virtual int peek()
+  {
+    if (!available())
+      return -1;
+    return rx_buf[rx_idx];
+  }
+
+  virtual void flush()
+  {
+    if (tx_len)
+      send_buffered(NULL, 0);
+  }
+
+  virtual void stop()
+  {
+    if (sd < 0)
+      return;
+    flush();
+    if (sd >= 0)
+      closesocket(sd);
+    sd = -1;
+    rx_idx = rx_len = tx_len = 0;
+  }
+
+  virtual uint8_t connected()
+  {
+    if (rx_idx < rx_len)
+      return 1;
+    return sd >= 0 && !hci_peer_closed(sd);
+  }
+
+  virtual operator bool() { return sd >= 0; }
+
+  using Print::write;
+
+private:
+  HciClient(const HciClient &);
+  HciClient &operator=(const HciClient &);
+
+  // Sends the transmit buffer followed by size bytes of buffer as one packet.
+  bool send_buffered(const uint8_t *buffer, size_t size)
+  {
+    int result = send_begin(sd, tx_len + size, 0);
+    if (result >= 0)
+    {
+      send_data(tx_buf, tx_len);
+      send_data(buffer, size);
+      result = send_end();
+    }
+    tx_len = 0;
+    return check(result) >= 0;
+  }
+
+  bool readable()
+  {
+    if (hci_peer_closed(sd))
+      return true;
+
+    fd_set readsds;
+    FD_ZERO(&readsds);
+    FD_SET(sd, &readsds);
+    timeval timeout = {0, HCI_CLIENT_POLL_US};
+    return select(sd + 1, &readsds, NULL, NULL, &timeout) > 0 && FD_ISSET(sd, &readsds);
+  }
+
+  void fill()
+  {
+    rx_idx = rx_len = 0;
+    int result = check(recv(sd, rx_buf, sizeof(rx_buf), 0));
+    if (result > 0)
+      rx_len = result;
+  }
+
+  // Closes the socket once the peer has gone or the CC3000 reports an error.
+  int check(int result)
+  {
+    if (result < 0 && sd >= 0)
+    {
+      closesocket(sd);
+      sd = -1;
+      tx_len = 0;
+    }
+    return result;
+  }
+
+  int sd;
+  uint8_t rx_idx;
+  uint8_t rx_len;
+  uint8_t tx_len;
+  uint8_t rx_buf[HCI_CLIENT_RX_BUFFER];
+  uint8_t tx_buf[HCI_CLIENT_TX_BUFFER];
+};
+
+#endif
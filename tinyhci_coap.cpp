@@ -0,0 +1,400 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_coap.h"
+
+//
+// Message types
+//
+#define COAP_CON                  0
+#define COAP_NON                  1
+#define COAP_ACK                  2
+#define COAP_RST                  3
+
+//
+// Options
+//
+#define COAP_OPTION_URI_PATH          11
+#define COAP_OPTION_CONTENT_FORMAT    12
+
+#define COAP_PAYLOAD_MARKER       0xff
+
+//
+// Response states
+//
+#define COAP_RESPONSE_IDLE        0
+#define COAP_RESPONSE_OPTIONS     1
+#define COAP_RESPONSE_PAYLOAD     2
+
+//
+// CoapResponse
+//
+void CoapResponse::reset(uint8_t *buffer, uint8_t length, uint8_t method)
+{
+  this->buffer = buffer;
+  this->length = length;
+  this->method = method;
+  state = COAP_RESPONSE_IDLE;
+}
+
+void CoapResponse::begin(uint8_t code, int16_t content_format)
+{
+  if (state != COAP_RESPONSE_IDLE)
+    return;
+  state = COAP_RESPONSE_OPTIONS;
+
+  buffer[1] = code;
+  if (content_format >= 0 && length + 3 <= COAP_TX_BUFFER)
+  {
+    // The only option, so its delta is its number.
+    if (content_format == 0)
+      buffer[length++] = COAP_OPTION_CONTENT_FORMAT << 4;
+    else if (content_format < 0x100)
+    {
+      buffer[length++] = (COAP_OPTION_CONTENT_FORMAT << 4) | 1;
+      buffer[length++] = content_format;
+    }
+    else
+    {
+      buffer[length++] = (COAP_OPTION_CONTENT_FORMAT << 4) | 2;
+      buffer[length++] = content_format >> 8;
+      buffer[length++] = content_format;
+    }
+  }
+}
+
+size_t CoapResponse::write(uint8_t c)
+{
+  return put(&c, 1, 0);
+}
+
+size_t CoapResponse::write(const uint8_t *buffer, size_t size)
+{
+  return put(buffer, size, 0);
+}
+
+size_t CoapResponse::write_P(const void PROGMEM *buffer, size_t size)
+{
+  return put((const uint8_t *)buffer, size, 1);
+}
+
+size_t CoapResponse::put(const uint8_t *data, size_t size, uint8_t flash)
+{
+  if (state == COAP_RESPONSE_IDLE)
+    begin(method == COAP_GET ? COAP_CONTENT : method == COAP_DELETE ? COAP_DELETED : COAP_CHANGED);
+  if (!size)
+    return 0;
+
+  if (state == COAP_RESPONSE_OPTIONS)
+  {
+    if (length >= COAP_TX_BUFFER - 1)
+      return 0;
+    buffer[length++] = COAP_PAYLOAD_MARKER;
+    state = COAP_RESPONSE_PAYLOAD;
+  }
+
+  size_t space = COAP_TX_BUFFER - length;
+  if (size > space)
+    size = space;
+  if (flash)
+    memcpy_P(buffer + length, data, size);
+  else
+    memcpy(buffer + length, data, size);
+  length += size;
+  return size;
+}
+
+//
+// CoapServer
+//
+CoapServer::CoapServer(const CoapResource PROGMEM *resources, uint8_t resource_count)
+  : resources(resources), resource_count(resource_count), sd(-1), message_id(0), recent_next(0),
+    last(0), tx_length(0)
+{
+  memset(recent, 0, sizeof(recent));
+}
+
+int CoapServer::begin(uint16_t port)
+{
+  end();
+
+  sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sd < 0)
+    return EFAIL;
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  if (bind(sd, (sockaddr *)&address, sizeof(address)) < 0)
+  {
+    end();
+    return EFAIL;
+  }
+
+  message_id = millis();
+  return ESUCCESS;
+}
+
+void CoapServer::end(void)
+{
+  if (sd >= 0)
+    closesocket(sd);
+  sd = -1;
+}
+
+void CoapServer::poll(void)
+{
+  if (sd < 0)
+    return;
+
+  fd_set readsds;
+  FD_ZERO(&readsds);
+  FD_SET(sd, &readsds);
+  timeval timeout = {0, COAP_POLL_US};
+  if (select(sd + 1, &readsds, NULL, NULL, &timeout) <= 0 || !FD_ISSET(sd, &readsds))
+    return;
+
+  sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  int count = recvfrom(sd, rx_buffer, sizeof(rx_buffer), 0, (sockaddr *)&from, &fromlen);
+  if (count > 0)
+    answer(&from, count);
+}
+
+void CoapServer::reply(const sockaddr_in *to, uint8_t length)
+{
+  sendto(sd, tx_buffer, length, 0, (const sockaddr *)to, sizeof(*to));
+}
+
+//
+// CoapServer::answer
+//
+// Answers a received datagram.
+//
+void CoapServer::answer(const sockaddr_in *from, uint8_t size)
+{
+  if (size < 4 || (rx_buffer[0] >> 6) != 1)
+    return;
+
+  uint8_t type = (rx_buffer[0] >> 4) & 3;
+  uint8_t token_length = rx_buffer[0] & 0x0f;
+  uint8_t code = rx_buffer[1];
+  uint16_t id = ((uint16_t)rx_buffer[2] << 8) | rx_buffer[3];
+  if (type == COAP_ACK || type == COAP_RST)
+    return;
+
+  // Empty messages (pings), malformed messages and responses are reset.
+  if (!code || (code >> 5) != 0 || token_length > 8 || 4 + token_length > size)
+  {
+    if (type == COAP_CON)
+    {
+      uint8_t message[4] = { 0x40 | (COAP_RST << 4), 0, rx_buffer[2], rx_buffer[3] };
+      sendto(sd, message, sizeof(message), 0, (const sockaddr *)from, sizeof(*from));
+    }
+    return;
+  }
+
+  uint8_t duplicate = 0xff;
+  for (uint8_t i = 0; i < COAP_DEDUP; i++)
+    if (recent[i].message_id == id && recent[i].port == from->sin_port && recent[i].ip == from->sin_addr.s_addr)
+      duplicate = i;
+
+  if (duplicate != 0xff && duplicate == last && tx_length)
+  {
+    reply(from, tx_length);
+    return;
+  }
+
+  // An older retransmission of a request other than GET gets its response code again,
+  // piggybacked without the payload, which is no longer kept.
+  if (duplicate != 0xff && code != COAP_GET)
+  {
+    if (type == COAP_CON)
+    {
+      uint8_t message[12] = { (uint8_t)(0x40 | (COAP_ACK << 4) | token_length), recent[duplicate].code,
+                              rx_buffer[2], rx_buffer[3] };
+      memcpy(message + 4, rx_buffer + 4, token_length);
+      sendto(sd, message, 4 + token_length, 0, (const sockaddr *)from, sizeof(*from));
+    }
+    return;
+  }
+
+  if (duplicate == 0xff)
+  {
+    duplicate = recent_next;
+    recent[duplicate].ip = from->sin_addr.s_addr;
+    recent[duplicate].port = from->sin_port;
+    recent[duplicate].message_id = id;
+    recent_next = (recent_next + 1) % COAP_DEDUP;
+  }
+  last = duplicate;
+
+  // Confirmable requests get a piggybacked ACK, others a new non-confirmable message.
+  if (type == COAP_CON)
+  {
+    tx_buffer[0] = 0x40 | (COAP_ACK << 4) | token_length;
+    tx_buffer[2] = rx_buffer[2];
+    tx_buffer[3] = rx_buffer[3];
+  }
+  else
+  {
+    message_id++;
+    tx_buffer[0] = 0x40 | (COAP_NON << 4) | token_length;
+    tx_buffer[2] = message_id >> 8;
+    tx_buffer[3] = message_id;
+  }
+  memcpy(tx_buffer + 4, rx_buffer + 4, token_length);
+  response.reset(tx_buffer, 4 + token_length, code);
+
+  CoapRequest request;
+  uint8_t error = parse(size, &request);
+  if (error)
+    response.begin(error);
+  else
+    dispatch(&request);
+
+  // A response without a payload, with the default code for the method.
+  if (!response.started())
+    response.put(NULL, 0, 0);
+
+  tx_length = response.length;
+  recent[last].code = tx_buffer[1];
+  reply(from, tx_length);
+}
+
+//
+// CoapServer::parse
+//
+// Reads the options and payload of a request; returns 0, or the response code for a request
+// that cannot be answered.
+//
+uint8_t CoapServer::parse(uint8_t size, CoapRequest *request)
+{
+  const uint8_t *p = rx_buffer + 4 + (rx_buffer[0] & 0x0f);
+  const uint8_t *end = rx_buffer + size;
+  uint16_t number = 0;
+  uint8_t path_length = 0;
+
+  request->method = rx_buffer[1];
+  request->content_format = COAP_FORMAT_NONE;
+  request->payload = NULL;
+  request->payload_length = 0;
+  request->path[0] = 0;
+
+  while (p < end && *p != COAP_PAYLOAD_MARKER)
+  {
+    uint16_t delta = *p >> 4;
+    uint16_t length = *p & 0x0f;
+    p++;
+
+    // Nibbles 13 and 14 are followed by one and two extension bytes; 15 is reserved.
+    for (uint8_t i = 0; i < 2; i++)
+    {
+      uint16_t *field = i ? &length : &delta;
+      if (*field == 13)
+      {
+        if (p + 1 > end)
+          return COAP_BAD_REQUEST;
+        *field = 13 + p[0];
+        p += 1;
+      }
+      else if (*field == 14)
+      {
+        if (p + 2 > end)
+          return COAP_BAD_REQUEST;
+        *field = 269 + (((uint16_t)p[0] << 8) | p[1]);
+        p += 2;
+      }
+      else if (*field == 15)
+        return COAP_BAD_REQUEST;
+    }
+    if (length > end - p)
+      return COAP_BAD_REQUEST;
+    number += delta;
+
+    switch (number)
+    {
+      case COAP_OPTION_URI_PATH:
+        if (path_length + (path_length ? 1 : 0) + length >= COAP_MAX_PATH)
+          return COAP_NOT_FOUND;
+        if (path_length)
+          request->path[path_length++] = '/';
+        memcpy(request->path + path_length, p, length);
+        path_length += length;
+        request->path[path_length] = 0;
+        break;
+
+      case COAP_OPTION_CONTENT_FORMAT:
+        request->content_format = 0;
+        for (uint8_t i = 0; i < length; i++)
+          request->content_format = (request->content_format << 8) | p[i];
+        break;
+
+      default:
+        // Unknown critical options, which have odd numbers, must not be ignored.
+        if (number & 1)
+          return COAP_BAD_OPTION;
+        break;
+    }
+    p += length;
+  }
+
+  if (p < end)
+  {
+    // A payload marker must be followed by a payload.
+    if (++p == end)
+      return COAP_BAD_REQUEST;
+    request->payload = p;
+    request->payload_length = end - p;
+  }
+  return 0;
+}
+
+//
+// CoapServer::dispatch
+//
+// Runs the handler of the requested resource or sends its static body.
+//
+void CoapServer::dispatch(CoapRequest *request)
+{
+  CoapResource resource;
+  uint8_t i;
+  for (i = 0; i < resource_count; i++)
+  {
+    memcpy_P(&resource, &resources[i], sizeof(resource));
+    if (!strcmp_P(request->path, resource.path))
+      break;
+  }
+
+  if (i == resource_count)
+    response.begin(COAP_NOT_FOUND);
+  else if (resource.handler)
+    resource.handler(*request, response);
+  else if (request->method == COAP_GET)
+  {
+    response.begin(COAP_CONTENT, resource.content_format);
+    response.write_P(resource.body, resource.length);
+  }
+  else
+    response.begin(COAP_METHOD_NOT_ALLOWED);
+}
@@ -0,0 +1,192 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_COAP_H__
+#define __TINYHCI_COAP_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+
+//
+// CoAP server (RFC 7252)
+//
+// Answers requests over UDP, each with a single datagram, so a request costs one recvfrom and
+// one sendto on a socket that stays open, instead of the connection setup and teardown of HTTP.
+// Confirmable requests are answered with a piggybacked ACK.
+//
+// Retransmitted requests are recognised by their message ID and sender.  A retransmission of
+// the last request is answered with the same response again, without running its handler.
+// Older retransmissions of GET requests are answered again.  Those of other requests get the
+// code of their original response in a piggybacked ACK, without its payload, so that handlers
+// with side effects run once; an empty ACK would promise a separate response that never comes.
+//
+// Resources live in flash.  A resource either has a handler, which writes its response through
+// CoapResponse, or a static body in flash.  Observe and block transfers are not supported.
+//
+// Example:
+//
+//   const char led_path[] PROGMEM = "led";
+//
+//   void led(const CoapRequest &request, CoapResponse &response)
+//   {
+//     if (request.method == COAP_PUT && request.payload_length)
+//       digitalWrite(LED_PIN, request.payload[0] == '1');
+//   }
+//
+//   const CoapResource resources[] PROGMEM =
+//   {
+//     { led_path, led },
+//   };
+//
+//   CoapServer coap(resources, 1);
+//   coap.begin(COAP_PORT);
+//   ...
+//   coap.poll();
+//
+#define COAP_PORT                 5683
+#define COAP_RX_BUFFER            64
+#define COAP_TX_BUFFER            64
+#define COAP_MAX_PATH             24
+#define COAP_DEDUP                4       // recent requests remembered
+#define COAP_POLL_US              5000    // select timeout per poll
+
+//
+// Methods
+//
+#define COAP_GET                  0x01
+#define COAP_POST                 0x02
+#define COAP_PUT                  0x03
+#define COAP_DELETE               0x04
+
+//
+// Response codes, class << 5 | detail
+//
+#define COAP_CREATED              0x41
+#define COAP_DELETED              0x42
+#define COAP_VALID                0x43
+#define COAP_CHANGED              0x44
+#define COAP_CONTENT              0x45
+#define COAP_BAD_REQUEST          0x80
+#define COAP_BAD_OPTION           0x82
+#define COAP_NOT_FOUND            0x84
+#define COAP_METHOD_NOT_ALLOWED   0x85
+#define COAP_INTERNAL_ERROR       0xa0
+
+//
+// Content formats
+//
+#define COAP_FORMAT_NONE          -1
+#define COAP_FORMAT_TEXT          0
+#define COAP_FORMAT_LINK          40
+#define COAP_FORMAT_OCTETS        42
+#define COAP_FORMAT_JSON          50
+
+typedef struct _coap_request_t
+{
+  uint8_t method;                         // COAP_GET etc.
+  int16_t content_format;                 // COAP_FORMAT_NONE if absent
+  const uint8_t *payload;
+  uint8_t payload_length;
+  char path[COAP_MAX_PATH];               // Uri-Path segments joined with '/'
+} CoapRequest;
+
+//
+// CoapResponse
+//
+// Writes a response payload into the datagram; what does not fit is dropped.
+//
+class CoapResponse : public Print
+{
+public:
+  // Sets the response code and content format; only valid before the payload is written.  If
+  // it is not called, the code follows from the method, e.g. 2.05 Content for GET.
+  void begin(uint8_t code, int16_t content_format = COAP_FORMAT_NONE);
+
+  virtual size_t write(uint8_t c);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write_P(const void PROGMEM *buffer, size_t size);
+  using Print::write;
+
+  bool started() const { return state != 0; }
+
+private:
+  friend class CoapServer;
+
+  void reset(uint8_t *buffer, uint8_t length, uint8_t method);
+  size_t put(const uint8_t *data, size_t size, uint8_t flash);
+
+  uint8_t *buffer;
+  uint8_t length;
+  uint8_t state;
+  uint8_t method;
+};
+
+typedef void (*CoapHandler)(const CoapRequest &request, CoapResponse &response);
+
+typedef struct _coap_resource_t
+{
+  const char PROGMEM *path;               // without a leading '/'
+  CoapHandler handler;                    // NULL for a static body
+  const char PROGMEM *body;
+  uint8_t length;
+  int16_t content_format;                 // of the static body
+} CoapResource;
+
+class CoapServer
+{
+public:
+  CoapServer(const CoapResource PROGMEM *resources, uint8_t resource_count);
+
+  int begin(uint16_t port = COAP_PORT);
+  void end(void);
+
+  // Answers a request if one has arrived.  Call from loop().
+  void poll(void);
+
+private:
+  typedef struct
+  {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t message_id;
+    uint8_t code;                         // of the response
+  } exchange;
+
+  void answer(const sockaddr_in *from, uint8_t size);
+  uint8_t parse(uint8_t size, CoapRequest *request);
+  void reply(const sockaddr_in *to, uint8_t length);
+  void dispatch(CoapRequest *request);
+
+  const CoapResource PROGMEM *resources;
+  uint8_t resource_count;
+  int sd;
+  uint16_t message_id;
+
+  exchange recent[COAP_DEDUP];
+  uint8_t recent_next;
+  uint8_t last;                           // index in recent of the request answered in tx_buffer
+  uint8_t tx_length;
+
+  CoapResponse response;
+  uint8_t rx_buffer[COAP_RX_BUFFER];
+  uint8_t tx_buffer[COAP_TX_BUFFER];
+};
+
+#endif
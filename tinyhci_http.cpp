@@ -0,0 +1,609 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_http.h"
+
+//
+// Response states
+//
+#define HTTP_RESPONSE_IDLE        0
+#define HTTP_RESPONSE_HEADERS     1
+#define HTTP_RESPONSE_BODY        2
+
+//
+// http_reason
+//
+// Returns the reason phrase for a status code.
+//
+static const char PROGMEM *http_reason(uint16_t status)
+{
+  switch (status)
+  {
+    case 101: return PSTR("Switching Protocols");
+    case 200: return PSTR("OK");
+    case 204: return PSTR("No Content");
+    case 304: return PSTR("Not Modified");
+    case 400: return PSTR("Bad Request");
+    case 404: return PSTR("Not Found");
+    case 405: return PSTR("Method Not Allowed");
+    case 406: return PSTR("Not Acceptable");
+    case 414: return PSTR("URI Too Long");
+    case 500: return PSTR("Internal Server Error");
+    case 503: return PSTR("Service Unavailable");
+  }
+  return PSTR("");
+}
+
+//
+// HttpResponse
+//
+void HttpResponse::reset(int sd, uint8_t *buffer, uint8_t keep_alive, uint8_t chunked, uint8_t head)
+{
+  this->sd = sd;
+  this->buffer = buffer;
+  this->keep_alive = keep_alive;
+  this->chunked = chunked;
+  this->head = head;
+  length = 0;
+  body_start = 0;
+  state = HTTP_RESPONSE_IDLE;
+  error = 0;
+}
+
+void HttpResponse::text_P(const char PROGMEM *text)
+{
+  put((const uint8_t *)text, strlen_P(text), 1);
+}
+
+void HttpResponse::begin(uint16_t status, const char PROGMEM *content_type, int32_t length)
+{
+  if (state != HTTP_RESPONSE_IDLE)
+    return;
+  state = HTTP_RESPONSE_HEADERS;
+
+  // 101, 204 and 304 responses never have a body, so they need no length to keep the
+  // connection.  Other bodies of unknown length are chunked if the client allows it.
+  uint8_t bodyless = status == 101 || status == 204 || status == 304;
+  if (length >= 0 || bodyless)
+    chunked = 0;
+  else if (!chunked)
+    keep_alive = 0;
+
+  char number[12];
+  text_P(PSTR("HTTP/1.1 "));
+  utoa(status, number, 10);
+  put((const uint8_t *)number, strlen(number), 0);
+  text_P(PSTR(" "));
+  text_P(http_reason(status));
+  text_P(PSTR("\r\n"));
+
+  if (content_type)
+    header_P(PSTR("Content-Type"), content_type);
+
+  if (length >= 0 && !bodyless)
+  {
+    text_P(PSTR("Content-Length: "));
+    ultoa(length, number, 10);
+    put((const uint8_t *)number, strlen(number), 0);
+    text_P(PSTR("\r\n"));
+  }
+
+  if (chunked)
+    text_P(PSTR("Transfer-Encoding: chunked\r\n"));
+
+  if (status == 101)
+    text_P(PSTR("Connection: Upgrade\r\n"));
+  else
+    text_P(keep_alive ? PSTR("Connection: keep-alive\r\n") : PSTR("Connection: close\r\n"));
+}
+
+void HttpResponse::header_P(const char PROGMEM *name, const char PROGMEM *value)
+{
+  if (state != HTTP_RESPONSE_HEADERS)
+    return;
+
+  text_P(name);
+  text_P(PSTR(": "));
+  text_P(value);
+  text_P(PSTR("\r\n"));
+}
+
+void HttpResponse::header(const char PROGMEM *name, const char *value)
+{
+  if (state != HTTP_RESPONSE_HEADERS)
+    return;
+
+  text_P(name);
+  text_P(PSTR(": "));
+  put((const uint8_t *)value, strlen(value), 0);
+  text_P(PSTR("\r\n"));
+}
+
+//
+// HttpResponse::body
+//
+// Ends the headers before the first byte of the body.
+//
+void HttpResponse::body(void)
+{
+  if (state == HTTP_RESPONSE_IDLE)
+    begin(200, NULL, -1);
+  if (state == HTTP_RESPONSE_HEADERS)
+  {
+    text_P(PSTR("\r\n"));
+    state = HTTP_RESPONSE_BODY;
+    body_start = length;
+  }
+}
+
+size_t HttpResponse::write(uint8_t c)
+{
+  body();
+  return put(&c, 1, 0);
+}
+
+size_t HttpResponse::write(const uint8_t *buffer, size_t size)
+{
+  body();
+  return put(buffer, size, 0);
+}
+
+size_t HttpResponse::write_P(const void PROGMEM *buffer, size_t size)
+{
+  body();
+  return put((const uint8_t *)buffer, size, 1);
+}
+
+//
+// HttpResponse::put
+//
+// Appends to the transmit buffer.  Data that does not fit is sent in packets of up to
+// send_mtu bytes, each led by whatever is buffered, straight from the caller's RAM or flash.
+//
+size_t HttpResponse::put(const uint8_t *data, size_t size, uint8_t flash)
+{
+  if (error)
+    return 0;
+  if (state == HTTP_RESPONSE_BODY && head)
+    return size;
+
+  size_t written = 0;
+  while (size)
+  {
+    if (length + size <= HTTP_TX_BUFFER)
+    {
+      if (flash)
+        memcpy_P(buffer + length, data, size);
+      else
+        memcpy(buffer + length, data, size);
+      length += size;
+      return written + size;
+    }
+
+    int chunk = packet(data, size, flash, 0);
+    if (chunk < 0)
+      return written;
+
+    data += chunk;
+    size -= chunk;
+    written += chunk;
+  }
+  return written;
+}
+
+//
+// HttpResponse::packet
+//
+// Sends the transmit buffer followed by as much of data as fits in one packet; returns the
+// number of bytes of data sent, or EFAIL.  In a chunked body, the body bytes are framed as one
+// chunk, and if last is set the final empty chunk is appended.
+//
+int HttpResponse::packet(const uint8_t *data, size_t size, uint8_t flash, uint8_t last)
+{
+  uint8_t framed = chunked && state == HTTP_RESPONSE_BODY && !head;
+  if (!framed)
+    body_start = length;
+  last = last && framed;
+
+  // The chunk length is written with as many hex digits as the largest chunk that fits needs,
+  // padded with zeros, so the prefix has the same size whatever the chunk's.
+  int space = send_mtu() - length;
+  char prefix[8];
+  uint8_t digits = 0;
+  if (framed)
+  {
+    space -= 2 + (last ? 5 : 0);
+    for (int n = space; n > 0; n >>= 4)
+      digits++;
+    space -= digits + 2;
+  }
+  size_t chunk = space > 0 && (size_t)space < size ? space : size;
+
+  uint16_t chunk_length = length - body_start + chunk;
+  if (!chunk_length)
+    digits = 0;   // an empty chunk would end the body
+  if (digits)
+  {
+    for (uint8_t i = digits, n = 0; i; i--, n += 4)
+      prefix[i - 1] = "0123456789abcdef"[(chunk_length >> n) & 0xf];
+    prefix[digits] = '\r';
+    prefix[digits + 1] = '\n';
+  }
+
+  uint16_t total = length + chunk + (digits ? digits + 4 : 0) + (last ? 5 : 0);
+  if (!total)
+    return 0;
+
+  int result = send_begin(sd, total, 0);
+  if (result >= 0)
+  {
+    send_data(buffer, body_start);
+    if (digits)
+      send_data(prefix, digits + 2);
+    send_data(buffer + body_start, length - body_start);
+    if (flash)
+      send_data_P(data, chunk);
+    else
+      send_data(data, chunk);
+    if (digits)
+      send_data_P(PSTR("\r\n"), 2);
+    if (last)
+      send_data_P(PSTR("0\r\n\r\n"), 5);
+    result = send_end();
+  }
+  length = 0;
+  body_start = 0;
+
+  if (result < 0)
+  {
+    error = 1;
+    return EFAIL;
+  }
+  return chunk;
+}
+
+void HttpResponse::flush()
+{
+  if (state == HTTP_RESPONSE_HEADERS)
+    body();
+
+  if (!error && length)
+    packet(NULL, 0, 0, 0);
+}
+
+//
+// HttpResponse::finish
+//
+// Sends the rest of the response, ending a chunked body.
+//
+void HttpResponse::finish(void)
+{
+  if (state == HTTP_RESPONSE_HEADERS)
+    body();
+
+  if (!error)
+    packet(NULL, 0, 0, 1);
+}
+
+int HttpResponse::detach(void)
+{
+  if (sd < 0)
+    return EFAIL;
+
+  finish();
+  int result = error ? EFAIL : sd;
+  if (!error)
+    sd = -1;
+  return result;
+}
+
+//
+// HttpServer
+//
+HttpServer::HttpServer(const HttpRoute PROGMEM *routes, uint8_t route_count,
+                       uint32_t hash_seed, const uint8_t PROGMEM *hash_slots, uint8_t hash_size)
+  : routes(routes), route_count(route_count), hash_seed(hash_seed), hash_slots(hash_slots),
+    hash_mask(hash_size - 1), port(0), listener(-1), served(0)
+{
+  if (!hash_size || (hash_size & hash_mask))
+    this->hash_slots = NULL;
+
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+    connections[i].sd = -1;
+}
+
+//
+// HttpServer::check_hash
+//
+// Falls back to a linear search if the perfect hash does not match the route table, e.g.
+// because routes were added without regenerating it.
+//
+void HttpServer::check_hash(void)
+{
+  for (uint8_t i = 0; i < route_count && hash_slots; i++)
+  {
+    HttpRoute route;
+    memcpy_P(&route, &routes[i], sizeof(route));
+
+    uint32_t hash = http_hash_begin(hash_seed);
+    for (const char PROGMEM *p = route.path; uint8_t b = pgm_read_byte(p); p++)
+      hash = http_hash_step(hash, b);
+
+    if (pgm_read_byte(hash_slots + http_hash_slot(hash, hash_mask)) != i)
+    {
+      DEBUG_LV1(SERIAL_PRINTLN("route hash does not match the routes"));
+      hash_slots = NULL;
+    }
+  }
+}
+
+int HttpServer::begin(uint16_t port)
+{
+  this->port = port;
+  check_hash();
+  listen();
+  return listener >= 0 ? ESUCCESS : EFAIL;
+}
+
+void HttpServer::end(void)
+{
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+    close(&connections[i]);
+
+  if (listener >= 0)
+    closesocket(listener);
+  listener = -1;
+}
+
+void HttpServer::listen(void)
+{
+  listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener < 0)
+    return;
+
+  char arg = SOCK_ON;
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  if (setsockopt(listener, SOL_SOCKET, SOCKOPT_ACCEPT_NONBLOCK, &arg, sizeof(arg)) < 0 ||
+      bind(listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+      ::listen(listener, 0) < 0)
+  {
+    closesocket(listener);
+    listener = -1;
+  }
+}
+
+void HttpServer::accept(void)
+{
+  connection *c = NULL;
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS && !c; i++)
+    if (connections[i].sd < 0)
+      c = &connections[i];
+  if (!c)
+    return;
+
+  int sd = ::accept(listener, NULL, NULL);
+  if (sd == ESOCKINPROGRESS)
+    return;
+  if (sd < 0)
+  {
+    // The listening socket has failed; rebuild it.
+    closesocket(listener);
+    listen();
+    return;
+  }
+
+  c->sd = sd;
+  c->parser.hash_seed = hash_seed;
+  c->parser.reset();
+  hci_timer_start(&c->idle, HTTP_KEEPALIVE_TIMEOUT);
+}
+
+void HttpServer::close(connection *c)
+{
+  if (c->sd >= 0)
+    closesocket(c->sd);
+  c->sd = -1;
+}
+
+void HttpServer::poll(void)
+{
+  if (listener < 0)
+  {
+    listen();
+    if (listener < 0)
+      return;
+  }
+
+  accept();
+
+  fd_set readsds;
+  FD_ZERO(&readsds);
+  int nfds = 0;
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+  {
+    connection *c = &connections[i];
+    if (c->sd < 0)
+      continue;
+
+    if (hci_timer_expired(&c->idle))
+    {
+      close(c);
+      continue;
+    }
+
+    FD_SET(c->sd, &readsds);
+    if (c->sd >= nfds)
+      nfds = c->sd + 1;
+  }
+  if (!nfds)
+    return;
+
+  timeval timeout = {0, HTTP_POLL_US};
+  if (select(nfds, &readsds, NULL, NULL, &timeout) <= 0)
+    return;
+
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+  {
+    connection *c = &connections[i];
+    if (c->sd >= 0 && FD_ISSET(c->sd, &readsds))
+      receive(c);
+  }
+}
+
+//
+// HttpServer::receive
+//
+// Reads what has arrived on a connection and serves every request completed by it.
+//
+void HttpServer::receive(connection *c)
+{
+  int count = recv(c->sd, rx_buffer, sizeof(rx_buffer), 0);
+  if (count <= 0)
+  {
+    close(c);
+    return;
+  }
+
+  hci_timer_start(&c->idle, HTTP_KEEPALIVE_TIMEOUT);
+
+  const uint8_t *data = rx_buffer;
+  while (count > 0)
+  {
+    size_t used = c->parser.parse(data, count);
+    data += used;
+    count -= used;
+
+    if (c->parser.ready())
+    {
+      if (!dispatch(c))
+        return;
+      c->parser.next();
+    }
+  }
+}
+
+//
+// HttpServer::find_route
+//
+// Copies the route matching the request's path from flash; returns 0 if there is none.
+//
+uint8_t HttpServer::find_route(const HttpRequest *request, HttpRoute *route)
+{
+  if (hash_slots)
+  {
+    uint8_t i = pgm_read_byte(hash_slots + http_hash_slot(request->path_hash, hash_mask));
+    if (i >= route_count)
+      return 0;
+    memcpy_P(route, &routes[i], sizeof(*route));
+    return !strcmp_P(request->path, route->path);
+  }
+
+  for (uint8_t i = 0; i < route_count; i++)
+  {
+    memcpy_P(route, &routes[i], sizeof(*route));
+    if (!strcmp_P(request->path, route->path))
+      return 1;
+  }
+  return 0;
+}
+
+//
+// HttpServer::dispatch
+//
+// Answers a parsed request; returns 0 if the connection was closed.
+//
+uint8_t HttpServer::dispatch(connection *c)
+{
+  HttpRequest *request = &c->parser.request;
+
+  served++;
+  response.reset(c->sd, tx_buffer, request->keep_alive, request->flags & HTTP_REQUEST_HTTP_1_1,
+                 request->method == HTTP_METHOD_HEAD);
+
+  HttpRoute route;
+  if (request->flags & (HTTP_REQUEST_MALFORMED | HTTP_REQUEST_CHUNKED))
+  {
+    response.keep_alive = 0;
+    response.begin(400, NULL, 0);
+  }
+  else if (request->flags & HTTP_REQUEST_PATH_TOO_LONG)
+  {
+    response.begin(414, NULL, 0);
+  }
+  else
+  {
+    if (!find_route(request, &route))
+      response.begin(404, NULL, 0);
+    else if (route.handler)
+      route.handler(*request, response);
+    else if (request->method == HTTP_METHOD_GET || request->method == HTTP_METHOD_HEAD)
+    {
+      // Compressed bodies are only stored compressed, so clients that cannot decode them are
+      // refused; caches are told that the answer depends on Accept-Encoding either way.
+      uint8_t gzip = route.flags & HTTP_ROUTE_GZIP;
+      uint16_t status = 200;
+      if (gzip && !(request->flags & HTTP_REQUEST_GZIP))
+        status = 406;
+      else if (route.etag && request->if_none_match[0] && !strcmp_P(request->if_none_match, route.etag))
+        status = 304;   // the client's cached copy is current
+
+      if (status == 200)
+        response.begin(200, route.content_type, route.length);
+      else
+        response.begin(status, NULL, 0);
+      if (gzip)
+        response.header_P(PSTR("Vary"), PSTR("Accept-Encoding"));
+      if (route.etag && status != 406)
+        response.header_P(PSTR("ETag"), route.etag);
+      if (status == 200)
+      {
+        if (gzip)
+          response.header_P(PSTR("Content-Encoding"), PSTR("gzip"));
+        response.write_P(route.body, route.length);
+      }
+    }
+    else
+      response.begin(405, NULL, 0);
+  }
+
+  if (response.sd < 0)
+  {
+    // A handler took over the connection, e.g. for a WebSocket.
+    c->sd = -1;
+    return 0;
+  }
+
+  if (!response.started())
+    response.begin(204, NULL, 0);
+
+  response.finish();
+  if (response.failed() || !response.keep_alive)
+  {
+    close(c);
+    return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,193 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_HTTP_H__
+#define __TINYHCI_HTTP_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_http_parser.h"
+
+//
+// HTTP/1.1 server
+//
+// Serves requests on persistent connections, so a page load with several resources costs one
+// accept instead of a listen socket rebuild per request.  Requests pipelined on a connection
+// are answered in order from the same receive buffer.  Request bodies are skipped.
+//
+// Routes live in flash.  A route either has a handler, which streams its response through
+// HttpResponse, or a static body in flash which is sent straight from flash.  Static bodies
+// may be gzip compressed and carry an ETag, so that browsers revalidate their cached copy with
+// a 304 instead of downloading it again; tools/gzip_assets.py generates such routes.  Clients
+// whose Accept-Encoding lacks gzip are answered 406 for compressed bodies.
+//
+// Routes are found with a linear search, or, given a perfect hash generated over their paths
+// by tools/route_hash.py, with one hash lookup and one compare however many there are.
+//
+// Example:
+//
+//   const char index_path[] PROGMEM = "/";
+//   const char index_body[] PROGMEM = "<html>...</html>";
+//   const char html_type[] PROGMEM = "text/html";
+//
+//   const HttpRoute routes[] PROGMEM =
+//   {
+//     { index_path, html_type, index_body, sizeof(index_body) - 1, NULL },
+//   };
+//
+//   HttpServer server(routes, 1);
+//   server.begin(80);
+//
+// or, with a perfect hash from "tools/route_hash.py route_hash.h /":
+//
+//   #include "route_hash.h"
+//
+//   HttpServer server(routes, 1, ROUTE_HASH_SEED, route_hash_slots, sizeof(route_hash_slots));
+//   ...
+//   server.poll();
+//
+#define HTTP_MAX_CONNECTIONS      2       // the CC3000 has 8 sockets in total
+#define HTTP_KEEPALIVE_TIMEOUT    5000    // ms a connection may stay idle
+#define HTTP_RX_BUFFER            64      // shared by all connections
+#define HTTP_TX_BUFFER            64
+#define HTTP_POLL_US              5000    // select timeout per poll
+
+//
+// HttpResponse
+//
+// Streams a response to a connection.  Writes are collected in the server's transmit buffer
+// and sent with the buffered bytes in front of them, so each data packet is as full as
+// possible.  Flash data is sent from flash without a copy in RAM.
+//
+// A body of unknown length is sent with chunked transfer encoding to HTTP/1.1 clients, so the
+// connection stays open for the next request.  Each chunk fills exactly one data packet: its
+// length prefix and trailing CRLF are sent around the data as part of the same packet, and
+// the final empty chunk rides in the packet carrying the last of the body.
+//
+class HttpResponse : public Print
+{
+public:
+  // Writes the status line and standard headers.  length is the body length, or -1 if unknown,
+  // in which case the body is chunked, or for HTTP/1.0 clients ended by closing the connection.
+  void begin(uint16_t status, const char PROGMEM *content_type, int32_t length);
+
+  // Adds a header; only valid between begin and the first write of the body.
+  void header_P(const char PROGMEM *name, const char PROGMEM *value);
+  void header(const char PROGMEM *name, const char *value);
+
+  virtual size_t write(uint8_t c);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write_P(const void PROGMEM *buffer, size_t size);
+  using Print::write;
+
+  // Sends any buffered data; in a chunked body, as a chunk.
+  virtual void flush();
+
+  bool failed() const { return error; }
+
+  bool started() const { return state != 0; }
+
+  // Sends the response and hands over its connection, which the server then no longer serves;
+  // the caller must close it.  Returns the socket, or EFAIL if the response failed.
+  int detach(void);
+
+private:
+  friend class HttpServer;
+
+  void reset(int sd, uint8_t *buffer, uint8_t keep_alive, uint8_t chunked, uint8_t head);
+  size_t put(const uint8_t *buffer, size_t size, uint8_t flash);
+  int packet(const uint8_t *data, size_t size, uint8_t flash, uint8_t last);
+  void text_P(const char PROGMEM *text);
+  void body(void);
+  void finish(void);
+
+  int sd;
+  uint8_t *buffer;
+  uint8_t length;
+  uint8_t body_start;                     // offset of the chunk body in buffer
+  uint8_t state;
+  uint8_t keep_alive;
+  uint8_t chunked;
+  uint8_t head;
+  uint8_t error;
+};
+
+typedef void (*HttpHandler)(const HttpRequest &request, HttpResponse &response);
+
+#define HTTP_ROUTE_GZIP           0x01    // the static body is gzip compressed
+
+typedef struct _http_route_t
+{
+  const char PROGMEM *path;
+  const char PROGMEM *content_type;       // for static bodies
+  const char PROGMEM *body;               // NULL if the route has a handler
+  uint16_t length;
+  HttpHandler handler;
+  const char PROGMEM *etag;               // quoted, or NULL
+  uint8_t flags;                          // HTTP_ROUTE_*
+} HttpRoute;
+
+class HttpServer
+{
+public:
+  // routes is an array in flash.  hash_slots, also in flash, maps a path hash masked to the
+  // table size, which must be a power of two, to a route index; see tools/route_hash.py.
+  HttpServer(const HttpRoute PROGMEM *routes, uint8_t route_count,
+             uint32_t hash_seed = 0, const uint8_t PROGMEM *hash_slots = NULL, uint8_t hash_size = 0);
+
+  int begin(uint16_t port);
+  void end(void);
+
+  // Accepts connections and serves any requests that have arrived.  Call from loop().
+  void poll(void);
+
+  uint32_t requests_served(void) const { return served; }
+
+private:
+  typedef struct
+  {
+    int8_t sd;
+    HttpParser parser;
+    hci_timer idle;
+  } connection;
+
+  void listen(void);
+  void accept(void);
+  void close(connection *c);
+  void receive(connection *c);
+  uint8_t dispatch(connection *c);
+  uint8_t find_route(const HttpRequest *request, HttpRoute *route);
+  void check_hash(void);
+
+  const HttpRoute PROGMEM *routes;
+  uint8_t route_count;
+  uint32_t hash_seed;
+  const uint8_t PROGMEM *hash_slots;      // NULL if routes are searched linearly
+  uint8_t hash_mask;
+  uint16_t port;
+  int listener;
+  uint32_t served;
+  connection connections[HTTP_MAX_CONNECTIONS];
+  HttpResponse response;
+  uint8_t rx_buffer[HTTP_RX_BUFFER];
+  uint8_t tx_buffer[HTTP_TX_BUFFER];
+};
+
+#endif
@@ -0,0 +1,535 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_http_client.h"
+
+//
+// Response parser states
+//
+#define HTTP_CLIENT_STATUS            0
+#define HTTP_CLIENT_HEADER_NAME       1
+#define HTTP_CLIENT_HEADER_VALUE      2
+#define HTTP_CLIENT_SKIP_LINE         3
+#define HTTP_CLIENT_BODY              4   // Content-Length body
+#define HTTP_CLIENT_BODY_CLOSE        5   // body ended by the server closing the connection
+#define HTTP_CLIENT_CHUNK_SIZE        6
+#define HTTP_CLIENT_CHUNK_EXTENSION   7
+#define HTTP_CLIENT_CHUNK_DATA        8
+#define HTTP_CLIENT_CHUNK_DATA_END    9
+#define HTTP_CLIENT_TRAILER           10
+#define HTTP_CLIENT_DONE              11
+
+//
+// Headers the parser acts on
+//
+#define HTTP_CLIENT_HEADER_OTHER              0
+#define HTTP_CLIENT_HEADER_CONNECTION         1
+#define HTTP_CLIENT_HEADER_CONTENT_LENGTH     2
+#define HTTP_CLIENT_HEADER_TRANSFER_ENCODING  3
+#define HTTP_CLIENT_HEADER_CONTENT_RANGE      4
+
+HttpClient::HttpClient(HttpBodyHandler handler, void *context)
+  : handler(handler), context(context), sd(-1), ip(0), port(0), range_offset(0), state(HTTP_CLIENT_DONE),
+    status(0)
+{
+}
+
+int HttpClient::open(uint32_t ip, uint16_t port)
+{
+  sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sd < 0)
+    return EFAIL;
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(ip);
+  address.sin_port = htons(port);
+  if (connect(sd, (sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close();
+    return EFAIL;
+  }
+
+  this->ip = ip;
+  this->port = port;
+  return ESUCCESS;
+}
+
+void HttpClient::close(void)
+{
+  if (sd >= 0)
+    closesocket(sd);
+  sd = -1;
+  state = HTTP_CLIENT_DONE;
+  status = 0;
+}
+
+int HttpClient::request(const char PROGMEM *method, uint32_t ip, uint16_t port, const char *host,
+                        const char *path, const char PROGMEM *headers,
+                        const void *body, size_t body_length)
+{
+  // Reuse the connection of the last response if it is to the same server and still open.
+  if (sd >= 0 && (ip != this->ip || port != this->port || state != HTTP_CLIENT_DONE || hci_peer_closed(sd)))
+    close();
+  uint8_t reused = sd >= 0;
+
+  char number[12];
+  number[0] = 0;
+  if (body)
+    ultoa(body_length, number, 10);
+
+  char range_from[12];
+  range_from[0] = 0;
+  if (range_offset)
+    ultoa(range_offset, range_from, 10);
+  range_offset = 0;
+
+  uint32_t total = strlen_P(method) + 1 + strlen(path) + strlen_P(PSTR(" HTTP/1.1\r\nHost: ")) +
+                   strlen(host) + 2 + (headers ? strlen_P(headers) : 0) + 2 + body_length;
+  if (body)
+    total += strlen_P(PSTR("Content-Length: ")) + strlen(number) + 2;
+  if (range_from[0])
+    total += strlen_P(PSTR("Range: bytes=")) + strlen(range_from) + 3;
+  if (total > 0xffff)
+    return EFAIL;
+
+  for (;;)
+  {
+    if (sd < 0 && open(ip, port) < 0)
+      return EFAIL;
+
+    request_remaining = total;
+    packet_remaining = 0;
+    error = 0;
+
+    put_P(method);
+    put_P(PSTR(" "));
+    put(path, strlen(path), 0);
+    put_P(PSTR(" HTTP/1.1\r\nHost: "));
+    put(host, strlen(host), 0);
+    put_P(PSTR("\r\n"));
+    if (headers)
+      put_P(headers);
+    if (range_from[0])
+    {
+      put_P(PSTR("Range: bytes="));
+      put(range_from, strlen(range_from), 0);
+      put_P(PSTR("-\r\n"));
+    }
+    if (body)
+    {
+      put_P(PSTR("Content-Length: "));
+      put(number, strlen(number), 0);
+      put_P(PSTR("\r\n"));
+    }
+    put_P(PSTR("\r\n"));
+    if (body)
+      put(body, body_length, 0);
+
+    if (!error)
+      break;
+
+    // A kept connection may have been dropped by the server while idle; retry once on a new one.
+    close();
+    if (!reused)
+      return EFAIL;
+    reused = 0;
+  }
+
+  state = HTTP_CLIENT_STATUS;
+  field = 0;
+  head = !strcmp_P("HEAD", method);
+  status = 0;
+  length = -1;
+  range_start = -1;
+  chunked = 0;
+  keep_alive = 0;
+  token_length = 0;
+  hci_timer_start(&idle, HTTP_CLIENT_TIMEOUT);
+  return ESUCCESS;
+}
+
+//
+// HttpClient::put
+//
+// Adds to the request, starting a new data packet of up to send_mtu bytes whenever the last
+// one is full.
+//
+void HttpClient::put(const void *data, size_t size, uint8_t flash)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (size && !error)
+  {
+    if (!packet_remaining)
+    {
+      int mtu = send_mtu();
+      packet_remaining = request_remaining < mtu ? request_remaining : mtu;
+      if (send_begin(sd, packet_remaining, 0) < 0)
+      {
+        error = 1;
+        return;
+      }
+    }
+
+    size_t count = size < packet_remaining ? size : packet_remaining;
+    if (flash)
+      send_data_P(p, count);
+    else
+      send_data(p, count);
+    p += count;
+    size -= count;
+    packet_remaining -= count;
+    request_remaining -= count;
+
+    if (!packet_remaining && send_end() < 0)
+      error = 1;
+  }
+}
+
+uint16_t HttpClient::status_code(void) const
+{
+  return state == HTTP_CLIENT_STATUS ? 0 : status;
+}
+
+int HttpClient::poll(void)
+{
+  if (state == HTTP_CLIENT_DONE)
+    return status ? status : EFAIL;
+  if (sd < 0)
+    return EFAIL;
+
+  fd_set readsds;
+  FD_ZERO(&readsds);
+  FD_SET(sd, &readsds);
+  timeval timeout = {0, HTTP_CLIENT_POLL_US};
+  int result = select(sd + 1, &readsds, NULL, NULL, &timeout);
+  if (result < 0)
+  {
+    close();
+    return EFAIL;
+  }
+  if (!result || !FD_ISSET(sd, &readsds))
+  {
+    if (!hci_timer_expired(&idle))
+      return 0;
+
+    // A stalled server or a peer that vanished without closing.
+    close();
+    return EFAIL;
+  }
+
+  int count = recv(sd, rx_buffer, sizeof(rx_buffer), 0);
+  if (count <= 0)
+  {
+    // The end of the connection ends a body without a length.
+    result = state == HTTP_CLIENT_BODY_CLOSE ? status : EFAIL;
+    close();
+    return result;
+  }
+  hci_timer_start(&idle, HTTP_CLIENT_TIMEOUT);
+
+  if (parse(rx_buffer, count) < 0)
+  {
+    close();
+    return EFAIL;
+  }
+  if (state != HTTP_CLIENT_DONE)
+    return 0;
+
+  result = status;
+  if (!keep_alive)
+    close();
+  return result;
+}
+
+int HttpClient::response(void)
+{
+  for (;;)
+  {
+    int result = poll();
+    if (result)
+      return result;
+  }
+}
+
+//
+// HttpClient::parse
+//
+// Consumes received bytes, passing body bytes to the handler where they lie.  Bytes after the
+// end of the response are dropped.
+//
+int HttpClient::parse(const uint8_t *data, size_t size)
+{
+  while (size && state != HTTP_CLIENT_DONE)
+  {
+    if (state == HTTP_CLIENT_BODY || state == HTTP_CLIENT_CHUNK_DATA || state == HTTP_CLIENT_BODY_CLOSE)
+    {
+      size_t count = size;
+      if (state != HTTP_CLIENT_BODY_CLOSE)
+      {
+        if (count > remaining)
+          count = remaining;
+        remaining -= count;
+      }
+
+      if (handler)
+        handler(context, data, count);
+      data += count;
+      size -= count;
+
+      if (state == HTTP_CLIENT_BODY && !remaining)
+        state = HTTP_CLIENT_DONE;
+      else if (state == HTTP_CLIENT_CHUNK_DATA && !remaining)
+        state = HTTP_CLIENT_CHUNK_DATA_END;
+      continue;
+    }
+
+    if (step(*data++))
+      return EFAIL;
+    size--;
+  }
+  return ESUCCESS;
+}
+
+uint8_t HttpClient::token_is(const char PROGMEM *text)
+{
+  token[token_length] = 0;
+  return !strcmp_P(token, text);
+}
+
+//
+// HttpClient::end_headers
+//
+// Works out how the body is delimited once the headers are complete.
+//
+void HttpClient::end_headers(void)
+{
+  token_length = 0;
+
+  if (status < 200)
+  {
+    // An interim response such as 100 Continue; the real one follows.
+    state = HTTP_CLIENT_STATUS;
+    field = 0;
+    status = 0;
+    length = -1;
+    range_start = -1;
+    chunked = 0;
+  }
+  else if (head || status == 204 || status == 304)
+    state = HTTP_CLIENT_DONE;
+  else if (chunked)
+  {
+    state = HTTP_CLIENT_CHUNK_SIZE;
+    remaining = 0;
+  }
+  else if (length >= 0)
+  {
+    remaining = length;
+    state = remaining ? HTTP_CLIENT_BODY : HTTP_CLIENT_DONE;
+  }
+  else
+  {
+    state = HTTP_CLIENT_BODY_CLOSE;
+    keep_alive = 0;
+  }
+}
+
+//
+// HttpClient::step
+//
+// Consumes one byte of the status line, headers or chunk framing; returns 1 if the response is
+// malformed.
+//
+uint8_t HttpClient::step(uint8_t b)
+{
+  if (b == '\r')
+    return 0;
+
+  switch (state)
+  {
+    case HTTP_CLIENT_STATUS:
+      if (b == '\n')
+      {
+        if (field == 0 || status < 100 || status > 999)
+          return 1;
+        state = HTTP_CLIENT_HEADER_NAME;
+        token_length = 0;
+        return 0;
+      }
+      if (field == 0)
+      {
+        if (b == ' ')
+        {
+          keep_alive = token_is(PSTR("HTTP/1.1"));
+          field = 1;
+          token_length = 0;
+          return 0;
+        }
+        break;
+      }
+      if (field == 1)
+      {
+        if (b >= '0' && b <= '9')
+          status = status * 10 + (b - '0');
+        else if (b == ' ')
+          field = 2;
+        else
+          return 1;
+      }
+      return 0;   // the reason phrase is skipped
+
+    case HTTP_CLIENT_HEADER_NAME:
+      if (b == '\n')
+      {
+        if (!token_length)
+          end_headers();
+        token_length = 0;
+        return 0;
+      }
+      if (b == ':')
+      {
+        if (token_is(PSTR("connection")))
+          header = HTTP_CLIENT_HEADER_CONNECTION;
+        else if (token_is(PSTR("content-length")))
+          header = HTTP_CLIENT_HEADER_CONTENT_LENGTH;
+        else if (token_is(PSTR("transfer-encoding")))
+          header = HTTP_CLIENT_HEADER_TRANSFER_ENCODING;
+        else if (token_is(PSTR("content-range")))
+          header = HTTP_CLIENT_HEADER_CONTENT_RANGE;
+        else
+          header = HTTP_CLIENT_HEADER_OTHER;
+        state = header == HTTP_CLIENT_HEADER_OTHER ? HTTP_CLIENT_SKIP_LINE : HTTP_CLIENT_HEADER_VALUE;
+        token_length = 0;
+        return 0;
+      }
+      if (b >= 'A' && b <= 'Z')
+        b += 'a' - 'A';
+      break;
+
+    case HTTP_CLIENT_HEADER_VALUE:
+      if (b == '\n')
+      {
+        if (header == HTTP_CLIENT_HEADER_CONNECTION)
+        {
+          if (token_is(PSTR("close")))
+            keep_alive = 0;
+          else if (token_is(PSTR("keep-alive")))
+            keep_alive = 1;
+        }
+        else if (header == HTTP_CLIENT_HEADER_TRANSFER_ENCODING)
+          chunked = token_is(PSTR("chunked"));
+        state = HTTP_CLIENT_HEADER_NAME;
+        token_length = 0;
+        return 0;
+      }
+      if (b == ' ' && token_length == 0)
+        return 0;
+      if (header == HTTP_CLIENT_HEADER_CONTENT_LENGTH)
+      {
+        if (b >= '0' && b <= '9')
+          length = (length < 0 ? 0 : length * 10) + (b - '0');
+        else if (b != ' ')
+          return 1;
+        token_length = 1;
+        return 0;
+      }
+      if (header == HTTP_CLIENT_HEADER_CONTENT_RANGE)
+      {
+        // "bytes first-last/size"; only first is kept.  token_length is 1 within it, 2 after.
+        if (b >= '0' && b <= '9' && token_length < 2)
+        {
+          if (range_start >= 0x0ccccccc)
+            return 1;
+          range_start = (range_start < 0 ? 0 : range_start * 10) + (b - '0');
+          token_length = 1;
+        }
+        else if (token_length)
+          token_length = 2;
+        return 0;
+      }
+      if (b >= 'A' && b <= 'Z')
+        b += 'a' - 'A';
+      break;
+
+    case HTTP_CLIENT_SKIP_LINE:
+      if (b == '\n')
+      {
+        state = HTTP_CLIENT_HEADER_NAME;
+        token_length = 0;
+      }
+      return 0;
+
+    case HTTP_CLIENT_CHUNK_SIZE:
+    case HTTP_CLIENT_CHUNK_EXTENSION:
+      if (b == '\n')
+      {
+        if (!token_length)
+          return 1;
+        token_length = 0;
+        state = remaining ? HTTP_CLIENT_CHUNK_DATA : HTTP_CLIENT_TRAILER;
+        return 0;
+      }
+      if (state == HTTP_CLIENT_CHUNK_EXTENSION)
+        return 0;
+      if (b == ';' || b == ' ' || b == '\t')
+      {
+        state = HTTP_CLIENT_CHUNK_EXTENSION;
+        return 0;
+      }
+      if (remaining >> 28)
+        return 1;
+      if (b >= '0' && b <= '9')
+        remaining = (remaining << 4) | (b - '0');
+      else if ((b | 0x20) >= 'a' && (b | 0x20) <= 'f')
+        remaining = (remaining << 4) | ((b | 0x20) - 'a' + 10);
+      else
+        return 1;
+      token_length = 1;
+      return 0;
+
+    case HTTP_CLIENT_CHUNK_DATA_END:
+      if (b != '\n')
+        return 1;
+      state = HTTP_CLIENT_CHUNK_SIZE;
+      remaining = 0;
+      token_length = 0;
+      return 0;
+
+    case HTTP_CLIENT_TRAILER:
+      // Trailer fields are skipped up to the blank line that ends the response.
+      if (b == '\n')
+      {
+        if (!token_length)
+          state = HTTP_CLIENT_DONE;
+        token_length = 0;
+      }
+      else
+        token_length = 1;
+      return 0;
+  }
+
+  if (token_length < HTTP_CLIENT_MAX_TOKEN)
+    token[token_length++] = b;
+  return 0;
+}
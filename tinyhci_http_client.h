@@ -0,0 +1,137 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_HTTP_CLIENT_H__
+#define __TINYHCI_HTTP_CLIENT_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+
+//
+// HTTP/1.1 client
+//
+// Sends a request in as few data packets as it fits in.  The request line, headers and body are
+// gathered straight from RAM and flash into each packet, with no request buffer.  The response
+// is parsed as it is received, and its body is passed to a handler in the pieces that recv
+// returns.  Chunked and Content-Length bodies are decoded without buffering, so a download of
+// any size needs only the receive buffer.
+//
+// The connection is kept open after a response if the server allows it, and is reused by the
+// next request to the same address.
+//
+// Example:
+//
+//   void on_body(void *context, const uint8_t *data, size_t size)
+//   {
+//     ...
+//   }
+//
+//   HttpClient client(on_body, NULL);
+//
+//   if (client.request(PSTR("GET"), ip, 80, "example.com", "/firmware.bin") == ESUCCESS)
+//     status = client.response();
+//
+#define HTTP_CLIENT_RX_BUFFER     64
+#define HTTP_CLIENT_TIMEOUT       10000   // ms without data before a response is abandoned
+#define HTTP_CLIENT_POLL_US       5000    // select timeout per poll
+#define HTTP_CLIENT_MAX_TOKEN     20      // longest header name or value that is compared
+
+// Receives a piece of the response body.
+typedef void (*HttpBodyHandler)(void *context, const uint8_t *data, size_t size);
+
+class HttpClient
+{
+public:
+  HttpClient(HttpBodyHandler handler, void *context);
+  ~HttpClient() { close(); }
+
+  // Sends a request to ip, in host order.  headers are further header lines in flash, each
+  // ending with CRLF, or NULL.  body is sent after the headers with a Content-Length.
+  int request(const char PROGMEM *method, uint32_t ip, uint16_t port, const char *host,
+              const char *path, const char PROGMEM *headers = NULL,
+              const void *body = NULL, size_t body_length = 0);
+
+  // Receives what has arrived of the response.  Returns 0 while it is incomplete, the status
+  // code once it is complete, or EFAIL if the connection failed, the response is malformed or
+  // nothing arrived for HTTP_CLIENT_TIMEOUT.
+  int poll(void);
+
+  // Waits for the whole response; returns its status code or EFAIL.
+  int response(void);
+
+  // Asks for the body from offset on in the next request, e.g. to resume a download.  The
+  // server answers 206 if it honours the range, or 200 with the whole body if it does not.
+  void range(uint32_t offset) { range_offset = offset; }
+
+  // Status code of the response being received, 0 until its status line is complete.
+  uint16_t status_code(void) const;
+
+  // Length of the body from Content-Length, or -1 if the server did not send one.
+  int32_t content_length(void) const { return length; }
+
+  // Offset of the first body byte from Content-Range, or -1 if the server did not send one.
+  int32_t content_range_start(void) const { return range_start; }
+
+  void close(void);
+
+private:
+  HttpClient(const HttpClient &);
+  HttpClient &operator=(const HttpClient &);
+
+  int open(uint32_t ip, uint16_t port);
+  void put(const void *data, size_t size, uint8_t flash);
+  void put_P(const char PROGMEM *text) { put(text, strlen_P(text), 1); }
+  int parse(const uint8_t *data, size_t size);
+  uint8_t step(uint8_t b);
+  uint8_t token_is(const char PROGMEM *text);
+  void end_headers(void);
+
+  HttpBodyHandler handler;
+  void *context;
+
+  int sd;
+  uint32_t ip;
+  uint16_t port;
+  uint32_t range_offset;
+
+  // Request gathering
+  uint16_t request_remaining;
+  uint16_t packet_remaining;
+  uint8_t error;
+
+  // Response parser
+  uint8_t state;
+  uint8_t field;
+  uint8_t header;
+  uint8_t head;
+  uint8_t chunked;
+  uint8_t keep_alive;
+  uint16_t status;
+  int32_t length;
+  int32_t range_start;
+  uint32_t remaining;
+  uint8_t token_length;
+  char token[HTTP_CLIENT_MAX_TOKEN + 1];
+  hci_timer idle;
+
+  uint8_t rx_buffer[HTTP_CLIENT_RX_BUFFER];
+};
+
+#endif
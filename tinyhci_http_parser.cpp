@@ -0,0 +1,315 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci_http_parser.h"
+
+//
+// Headers the parser acts on
+//
+#define HTTP_HEADER_OTHER             0
+#define HTTP_HEADER_CONNECTION        1
+#define HTTP_HEADER_CONTENT_LENGTH    2
+#define HTTP_HEADER_TRANSFER_ENCODING 3
+#define HTTP_HEADER_IF_NONE_MATCH     4
+#define HTTP_HEADER_UPGRADE           5
+#define HTTP_HEADER_WEBSOCKET_KEY     6
+#define HTTP_HEADER_ACCEPT_ENCODING   7
+
+void HttpParser::reset(void)
+{
+  memset(&request, 0, sizeof(request));
+  state = HTTP_PARSER_METHOD;
+  header = HTTP_HEADER_OTHER;
+  path_length = 0;
+  token_length = 0;
+  body_remaining = 0;
+}
+
+void HttpParser::next(void)
+{
+  uint32_t remaining = request.content_length;
+  reset();
+  if (remaining)
+  {
+    body_remaining = remaining;
+    state = HTTP_PARSER_BODY;
+  }
+}
+
+size_t HttpParser::parse(const uint8_t *data, size_t size)
+{
+  size_t used = 0;
+
+  if (state == HTTP_PARSER_BODY)
+  {
+    // Request bodies are not stored; skip them in one step.
+    used = size < body_remaining ? size : body_remaining;
+    body_remaining -= used;
+    if (!body_remaining)
+      state = HTTP_PARSER_METHOD;
+    return used;
+  }
+
+  while (used < size && state != HTTP_PARSER_READY)
+  {
+    if (step(data[used++]))
+      state = HTTP_PARSER_READY;
+  }
+  return used;
+}
+
+//
+// HttpParser::token_is
+//
+// Compares the collected token with a string in flash.
+//
+uint8_t HttpParser::token_is(const char PROGMEM *text)
+{
+  token[token_length] = 0;
+  return !strcmp_P(token, text);
+}
+
+//
+// HttpParser::end_header
+//
+// Applies the value of a header once its line is complete.
+//
+void HttpParser::end_header(void)
+{
+  switch (header)
+  {
+    case HTTP_HEADER_CONNECTION:
+      if (token_is(PSTR("close")))
+        request.keep_alive = 0;
+      else if (token_is(PSTR("keep-alive")))
+        request.keep_alive = 1;
+      break;
+
+    case HTTP_HEADER_TRANSFER_ENCODING:
+      if (!token_is(PSTR("identity")))
+        request.flags |= HTTP_REQUEST_CHUNKED;
+      break;
+
+    case HTTP_HEADER_IF_NONE_MATCH:
+      if (token_length <= HTTP_MAX_ETAG)
+      {
+        memcpy(request.if_none_match, token, token_length);
+        request.if_none_match[token_length] = 0;
+      }
+      break;
+
+    case HTTP_HEADER_UPGRADE:
+      if (token_is(PSTR("websocket")))
+        request.flags |= HTTP_REQUEST_UPGRADE;
+      break;
+
+    case HTTP_HEADER_WEBSOCKET_KEY:
+      // The key was collected straight into the request.
+      if (token_length != HTTP_KEY_LENGTH)
+        request.websocket_key[0] = 0;
+      break;
+  }
+}
+
+//
+// HttpParser::step
+//
+// Consumes one byte; returns 1 once the blank line ending the headers has been read.
+//
+uint8_t HttpParser::step(uint8_t b)
+{
+  if (b == '\r')
+    return 0;
+
+  switch (state)
+  {
+    case HTTP_PARSER_METHOD:
+      if (b == '\n' && token_length == 0)
+        return 0;   // blank lines between pipelined requests
+      if (b == ' ')
+      {
+        if (token_is(PSTR("GET")))
+          request.method = HTTP_METHOD_GET;
+        else if (token_is(PSTR("HEAD")))
+          request.method = HTTP_METHOD_HEAD;
+        else if (token_is(PSTR("POST")))
+          request.method = HTTP_METHOD_POST;
+        else if (token_is(PSTR("PUT")))
+          request.method = HTTP_METHOD_PUT;
+        else if (token_is(PSTR("DELETE")))
+          request.method = HTTP_METHOD_DELETE;
+        else
+          request.method = HTTP_METHOD_UNKNOWN;
+        request.path_hash = http_hash_begin(hash_seed);
+        state = HTTP_PARSER_PATH;
+        token_length = 0;
+        return 0;
+      }
+      if (b == '\n')
+      {
+        request.flags |= HTTP_REQUEST_MALFORMED;
+        return 1;
+      }
+      break;
+
+    case HTTP_PARSER_PATH:
+    case HTTP_PARSER_QUERY:
+      if (b == ' ' || b == '\n')
+      {
+        request.path[path_length] = 0;
+        state = HTTP_PARSER_VERSION;
+        if (b == '\n')
+        {
+          // HTTP/0.9 style request line without a version.
+          request.flags |= HTTP_REQUEST_MALFORMED;
+          return 1;
+        }
+        return 0;
+      }
+      if (path_length >= HTTP_MAX_PATH - 1)
+      {
+        if (state == HTTP_PARSER_PATH)
+          request.flags |= HTTP_REQUEST_PATH_TOO_LONG;
+        return 0;
+      }
+      if (b == '?' && state == HTTP_PARSER_PATH)
+      {
+        request.path[path_length++] = 0;
+        request.query = path_length;
+        state = HTTP_PARSER_QUERY;
+        return 0;
+      }
+      if (state == HTTP_PARSER_PATH)
+        request.path_hash = http_hash_step(request.path_hash, b);
+      request.path[path_length++] = b;
+      return 0;
+
+    case HTTP_PARSER_VERSION:
+      if (b == '\n')
+      {
+        if (token_is(PSTR("HTTP/1.1")))
+        {
+          request.keep_alive = 1;
+          request.flags |= HTTP_REQUEST_HTTP_1_1;
+        }
+        state = HTTP_PARSER_HEADER_NAME;
+        token_length = 0;
+        return 0;
+      }
+      break;
+
+    case HTTP_PARSER_HEADER_NAME:
+      if (b == '\n')
+      {
+        // A blank line ends the headers; a name without a value is ignored.
+        uint8_t complete = token_length == 0;
+        token_length = 0;
+        return complete;
+      }
+      if (b == ':')
+      {
+        if (token_is(PSTR("connection")))
+          header = HTTP_HEADER_CONNECTION;
+        else if (token_is(PSTR("content-length")))
+          header = HTTP_HEADER_CONTENT_LENGTH;
+        else if (token_is(PSTR("transfer-encoding")))
+          header = HTTP_HEADER_TRANSFER_ENCODING;
+        else if (token_is(PSTR("if-none-match")))
+          header = HTTP_HEADER_IF_NONE_MATCH;
+        else if (token_is(PSTR("upgrade")))
+          header = HTTP_HEADER_UPGRADE;
+        else if (token_is(PSTR("sec-websocket-key")))
+          header = HTTP_HEADER_WEBSOCKET_KEY;
+        else if (token_is(PSTR("accept-encoding")))
+          header = HTTP_HEADER_ACCEPT_ENCODING;
+        else
+          header = HTTP_HEADER_OTHER;
+        state = header == HTTP_HEADER_OTHER ? HTTP_PARSER_SKIP_LINE : HTTP_PARSER_HEADER_VALUE;
+        token_length = 0;
+        return 0;
+      }
+      if (b >= 'A' && b <= 'Z')
+        b += 'a' - 'A';
+      break;
+
+    case HTTP_PARSER_HEADER_VALUE:
+      if (b == '\n')
+      {
+        end_header();
+        state = HTTP_PARSER_HEADER_NAME;
+        token_length = 0;
+        return 0;
+      }
+      if (b == ' ' && token_length == 0)
+        return 0;
+      if (header == HTTP_HEADER_CONTENT_LENGTH)
+      {
+        if (b >= '0' && b <= '9')
+          request.content_length = request.content_length * 10 + (b - '0');
+        else if (b != ' ')
+          request.flags |= HTTP_REQUEST_MALFORMED;
+        token_length = 1;
+        return 0;
+      }
+      if (header == HTTP_HEADER_ACCEPT_ENCODING)
+      {
+        // The list can be longer than the token buffer, so "gzip" is matched as it streams
+        // past, with token_length counting the characters matched so far.  q-values are not
+        // considered.
+        static const char gzip[] PROGMEM = "gzip";
+        if (b >= 'A' && b <= 'Z')
+          b += 'a' - 'A';
+        if (b != pgm_read_byte(&gzip[token_length]))
+          token_length = 0;
+        if (b == pgm_read_byte(&gzip[token_length]) && ++token_length == sizeof(gzip) - 1)
+        {
+          request.flags |= HTTP_REQUEST_GZIP;
+          token_length = 0;
+        }
+        return 0;
+      }
+      if (header == HTTP_HEADER_WEBSOCKET_KEY)
+      {
+        // Longer than the token buffer, and kept as is.
+        if (token_length < HTTP_KEY_LENGTH)
+          request.websocket_key[token_length] = b;
+        if (token_length < 0xff && b != ' ')
+          token_length++;
+        return 0;
+      }
+      if (b >= 'A' && b <= 'Z' && header != HTTP_HEADER_IF_NONE_MATCH)
+        b += 'a' - 'A';
+      break;
+
+    case HTTP_PARSER_SKIP_LINE:
+      if (b == '\n')
+      {
+        state = HTTP_PARSER_HEADER_NAME;
+        token_length = 0;
+      }
+      return 0;
+  }
+
+  // Collect the byte into the token; longer tokens are truncated and match nothing we test.
+  if (token_length < HTTP_MAX_TOKEN)
+    token[token_length++] = b;
+  return 0;
+}
@@ -0,0 +1,156 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_HTTP_PARSER_H__
+#define __TINYHCI_HTTP_PARSER_H__
+
+#include <Arduino.h>
+
+//
+// Incremental HTTP request parser
+//
+// Consumes a request in whatever chunks recv returns, keeping its place between calls, and does
+// a constant amount of work per byte.  Only the path and the values of the headers it knows
+// are stored; everything else is skipped as it streams past, so requests of any length parse
+// in a fixed amount of RAM.
+//
+// The parser does not depend on the socket layer and can be built on the host.
+//
+// Usage:
+//
+//   while (size)
+//   {
+//     size_t used = parser.parse(data, size);
+//     data += used;
+//     size -= used;
+//     if (parser.ready())
+//     {
+//       ... answer parser.request ...
+//       parser.next();
+//     }
+//   }
+//
+#define HTTP_MAX_PATH             48
+#define HTTP_MAX_TOKEN            20      // longest header name or value that is compared
+#define HTTP_MAX_ETAG             12      // longest If-None-Match value that is kept
+#define HTTP_KEY_LENGTH           24      // length of a Sec-WebSocket-Key value
+
+#define HTTP_METHOD_UNKNOWN       0
+#define HTTP_METHOD_GET           1
+#define HTTP_METHOD_HEAD          2
+#define HTTP_METHOD_POST          3
+#define HTTP_METHOD_PUT           4
+#define HTTP_METHOD_DELETE        5
+
+//
+// HttpRequest flags
+//
+#define HTTP_REQUEST_PATH_TOO_LONG    0x01  // answer with 414
+#define HTTP_REQUEST_MALFORMED        0x02  // answer with 400 and close
+#define HTTP_REQUEST_CHUNKED          0x04  // chunked request bodies are not supported
+#define HTTP_REQUEST_HTTP_1_1         0x08  // the client accepts chunked responses
+#define HTTP_REQUEST_UPGRADE          0x10  // the client asked to upgrade to a WebSocket
+#define HTTP_REQUEST_GZIP             0x20  // the client accepts gzip content encoding
+
+//
+// HttpParser states
+//
+#define HTTP_PARSER_METHOD            0
+#define HTTP_PARSER_PATH              1
+#define HTTP_PARSER_QUERY             2
+#define HTTP_PARSER_VERSION           3
+#define HTTP_PARSER_HEADER_NAME       4
+#define HTTP_PARSER_HEADER_VALUE      5
+#define HTTP_PARSER_SKIP_LINE         6
+#define HTTP_PARSER_READY             7
+#define HTTP_PARSER_BODY              8
+
+//
+// Path hash
+//
+// FNV-1a seeded by the route table's perfect hash, computed as the path arrives so that routing
+// costs no extra pass over it.  tools/route_hash.py implements the same function.
+//
+inline uint32_t http_hash_begin(uint32_t seed)
+{
+  return 2166136261UL ^ seed;
+}
+
+inline uint32_t http_hash_step(uint32_t hash, uint8_t b)
+{
+  return (hash ^ b) * 16777619UL;
+}
+
+// The low bits of FNV-1a are poorly mixed, so slots are taken from the top byte.
+inline uint8_t http_hash_slot(uint32_t hash, uint8_t mask)
+{
+  return (uint8_t)(hash >> 24) & mask;
+}
+
+typedef struct _http_request_t
+{
+  uint8_t method;                         // HTTP_METHOD_*
+  uint8_t keep_alive;
+  uint8_t flags;                          // HTTP_REQUEST_*
+  uint8_t query;                          // offset of the query string in path, 0 if none
+  uint32_t content_length;
+  uint32_t path_hash;                     // see http_hash_begin
+  char if_none_match[HTTP_MAX_ETAG + 1];  // empty if absent or too long
+  char websocket_key[HTTP_KEY_LENGTH + 1];  // empty if absent or malformed
+  char path[HTTP_MAX_PATH];               // without the query string
+} HttpRequest;
+
+class HttpParser
+{
+public:
+  HttpParser() : hash_seed(0) { reset(); }
+
+  // Starts parsing a new request, discarding any state.
+  void reset(void);
+
+  // Consumes bytes up to the end of a request's headers, or of its body once next has been
+  // called.  Returns the number of bytes consumed.
+  size_t parse(const uint8_t *data, size_t size);
+
+  // Whether the request's headers are complete and it can be answered.
+  bool ready(void) const { return state == HTTP_PARSER_READY; }
+
+  // Moves past an answered request.  Its body, if any, is skipped by the following parse calls.
+  void next(void);
+
+  HttpRequest request;
+
+  // Seed for request.path_hash; kept across reset.
+  uint32_t hash_seed;
+
+private:
+  uint8_t step(uint8_t b);
+  uint8_t token_is(const char PROGMEM *text);
+  void end_header(void);
+
+  uint8_t state;
+  uint8_t header;
+  uint8_t path_length;
+  uint8_t token_length;
+  char token[HTTP_MAX_TOKEN + 1];
+  uint32_t body_remaining;
+};
+
+#endif
@@ -0,0 +1,518 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_mqtt.h"
+
+//
+// Packet types, with the flags MQTT requires
+//
+#define MQTT_CONNECT              0x10
+#define MQTT_CONNACK              0x20
+#define MQTT_PUBLISH              0x30
+#define MQTT_SUBSCRIBE            0x82
+#define MQTT_SUBACK               0x90
+#define MQTT_PINGREQ              0xc0
+#define MQTT_PINGRESP             0xd0
+#define MQTT_DISCONNECT           0xe0
+
+#define MQTT_PUBLISH_RETAIN       0x01
+#define MQTT_PUBLISH_QOS          0x06
+
+//
+// CONNECT flags
+//
+#define MQTT_CONNECT_CLEAN        0x02
+#define MQTT_CONNECT_PASSWORD     0x40
+#define MQTT_CONNECT_USER         0x80
+
+//
+// Decoder states
+//
+#define MQTT_STATE_TYPE           0
+#define MQTT_STATE_LENGTH         1
+#define MQTT_STATE_TOPIC_LENGTH   2
+#define MQTT_STATE_TOPIC          3
+#define MQTT_STATE_PACKET_ID      4
+#define MQTT_STATE_PAYLOAD        5
+#define MQTT_STATE_BODY           6     // body of a packet other than PUBLISH
+
+//
+// mqtt_length
+//
+// Encodes a remaining length; returns the number of bytes written, at most 4.
+//
+static uint8_t mqtt_length(uint8_t *out, uint32_t length)
+{
+  uint8_t count = 0;
+  do
+  {
+    uint8_t b = length & 0x7f;
+    length >>= 7;
+    if (length)
+      b |= 0x80;
+    out[count++] = b;
+  } while (length);
+  return count;
+}
+
+MqttClient::MqttClient(MqttHandler handler, void *context)
+  : handler(handler), context(context), sd(-1), queue_length(0)
+{
+}
+
+int MqttClient::connect(uint32_t ip, uint16_t port, const char *client_id, uint16_t keep_alive,
+                        const char *user, const char *password)
+{
+  close();
+
+  sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sd < 0)
+    return EFAIL;
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(ip);
+  address.sin_port = htons(port);
+  if (::connect(sd, (sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close();
+    return EFAIL;
+  }
+
+  this->keep_alive = (uint32_t)keep_alive * 1000;
+  ping_pending = 0;
+  packet_id = 0;
+  state = MQTT_STATE_TYPE;
+  connack = 0xff;
+
+  static const uint8_t PROGMEM protocol[] = { 0, 4, 'M', 'Q', 'T', 'T', 4 };
+  uint8_t flags = MQTT_CONNECT_CLEAN;
+  uint32_t length = sizeof(protocol) + 3 + 2 + strlen(client_id);
+  if (user)
+  {
+    flags |= MQTT_CONNECT_USER;
+    length += 2 + strlen(user);
+  }
+  if (password)
+  {
+    flags |= MQTT_CONNECT_PASSWORD;
+    length += 2 + strlen(password);
+  }
+
+  uint8_t header[5];
+  header[0] = MQTT_CONNECT;
+  uint8_t header_length = 1 + mqtt_length(header + 1, length);
+  uint8_t variable[3] = { flags, (uint8_t)(keep_alive >> 8), (uint8_t)keep_alive };
+
+  write_begin(header_length + length);
+  put(header, header_length, 0);
+  put(protocol, sizeof(protocol), 1);
+  put(variable, sizeof(variable), 0);
+  put_string(client_id);
+  if (user)
+    put_string(user);
+  if (password)
+    put_string(password);
+  if (write_end() < 0)
+    return EFAIL;
+
+  hci_timer timeout;
+  hci_timer_start(&timeout, MQTT_TIMEOUT);
+  while (sd >= 0 && connack == 0xff && !hci_timer_expired(&timeout))
+    receive();
+
+  if (connack != 0)
+  {
+    DEBUG_LV1(SERIAL_PRINT("CONNACK "); SERIAL_PRINTLN(connack));
+    close();
+    return EFAIL;
+  }
+  return ESUCCESS;
+}
+
+void MqttClient::close(void)
+{
+  if (sd >= 0)
+    closesocket(sd);
+  sd = -1;
+  queue_length = 0;
+}
+
+void MqttClient::disconnect(void)
+{
+  if (sd < 0)
+    return;
+
+  static const uint8_t PROGMEM packet[] = { MQTT_DISCONNECT, 0 };
+  write_begin(sizeof(packet));
+  put(packet, sizeof(packet), 1);
+  write_end();
+  close();
+}
+
+//
+// MqttClient::write_begin
+//
+// Starts sending a packet of size bytes, behind whatever is queued.
+//
+void MqttClient::write_begin(uint16_t size)
+{
+  write_remaining = queue_length + size;
+  packet_remaining = 0;
+  error = 0;
+
+  uint8_t length = queue_length;
+  queue_length = 0;
+  put(queue, length, 0);
+}
+
+//
+// MqttClient::put
+//
+// Adds to the packets being sent, starting a new data packet of up to send_mtu bytes whenever
+// the last one is full.
+//
+void MqttClient::put(const void *data, size_t size, uint8_t flash)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  while (size && !error)
+  {
+    if (!packet_remaining)
+    {
+      int mtu = send_mtu();
+      packet_remaining = write_remaining < mtu ? write_remaining : mtu;
+      if (send_begin(sd, packet_remaining, 0) < 0)
+      {
+        error = 1;
+        return;
+      }
+    }
+
+    size_t count = size < packet_remaining ? size : packet_remaining;
+    if (flash)
+      send_data_P(p, count);
+    else
+      send_data(p, count);
+    p += count;
+    size -= count;
+    packet_remaining -= count;
+    write_remaining -= count;
+
+    if (!packet_remaining && send_end() < 0)
+      error = 1;
+  }
+}
+
+void MqttClient::put_string(const char *text)
+{
+  uint16_t length = strlen(text);
+  uint8_t prefix[2] = { (uint8_t)(length >> 8), (uint8_t)length };
+  put(prefix, sizeof(prefix), 0);
+  put(text, length, 0);
+}
+
+int MqttClient::write_end(void)
+{
+  if (error || write_remaining)
+  {
+    close();
+    return EFAIL;
+  }
+
+  if (keep_alive)
+    hci_timer_start(&ping_timer, keep_alive);
+  return ESUCCESS;
+}
+
+int MqttClient::flush(void)
+{
+  if (sd < 0)
+    return EFAIL;
+  if (!queue_length)
+    return ESUCCESS;
+
+  write_begin(0);
+  return write_end();
+}
+
+int MqttClient::publish(const char *topic, const void *payload, size_t size, uint8_t retain)
+{
+  return message(topic, (const uint8_t *)payload, size, retain, 0);
+}
+
+int MqttClient::publish_P(const char *topic, const void PROGMEM *payload, size_t size, uint8_t retain)
+{
+  return message(topic, (const uint8_t *)payload, size, retain, 1);
+}
+
+//
+// MqttClient::message
+//
+// Queues a PUBLISH if it fits; otherwise sends it with the queue in front of it, its payload
+// straight from the caller.
+//
+int MqttClient::message(const char *topic, const uint8_t *payload, size_t size, uint8_t retain, uint8_t flash)
+{
+  if (sd < 0)
+    return EFAIL;
+
+  uint16_t topic_size = strlen(topic);
+  uint32_t length = 2 + topic_size + size;
+
+  uint8_t header[7];
+  header[0] = MQTT_PUBLISH | (retain ? MQTT_PUBLISH_RETAIN : 0);
+  uint8_t header_length = 1 + mqtt_length(header + 1, length);
+  header[header_length++] = topic_size >> 8;
+  header[header_length++] = topic_size;
+
+  uint32_t total = header_length + topic_size + size;
+  if (total > 0xffff)
+    return EFAIL;
+
+  if (queue_length + total <= MQTT_TX_BUFFER)
+  {
+    if (!queue_length)
+      hci_timer_start(&batch_timer, MQTT_BATCH_MS);
+
+    uint8_t *p = queue + queue_length;
+    memcpy(p, header, header_length);
+    p += header_length;
+    memcpy(p, topic, topic_size);
+    p += topic_size;
+    if (flash)
+      memcpy_P(p, payload, size);
+    else
+      memcpy(p, payload, size);
+    queue_length += total;
+    return ESUCCESS;
+  }
+
+  write_begin(total);
+  put(header, header_length, 0);
+  put(topic, topic_size, 0);
+  put(payload, size, flash);
+  return write_end();
+}
+
+int MqttClient::subscribe(const char *topic)
+{
+  if (sd < 0)
+    return EFAIL;
+
+  uint16_t topic_size = strlen(topic);
+  uint32_t length = 2 + 2 + topic_size + 1;
+
+  if (!++packet_id)
+    packet_id = 1;
+
+  uint8_t header[7];
+  header[0] = MQTT_SUBSCRIBE;
+  uint8_t header_length = 1 + mqtt_length(header + 1, length);
+  header[header_length++] = packet_id >> 8;
+  header[header_length++] = packet_id;
+  uint8_t qos = 0;
+
+  write_begin(header_length + length - 2);
+  put(header, header_length, 0);
+  put_string(topic);
+  put(&qos, 1, 0);
+  return write_end();
+}
+
+void MqttClient::poll(void)
+{
+  if (sd < 0)
+    return;
+
+  if (queue_length && hci_timer_expired(&batch_timer) && flush() < 0)
+    return;
+
+  if (keep_alive && hci_timer_expired(&ping_timer))
+  {
+    if (ping_pending)
+    {
+      DEBUG_LV1(SERIAL_PRINTLN("MQTT ping timed out"));
+      close();
+      return;
+    }
+
+    static const uint8_t PROGMEM packet[] = { MQTT_PINGREQ, 0 };
+    write_begin(sizeof(packet));
+    put(packet, sizeof(packet), 1);
+    if (write_end() < 0)
+      return;
+    ping_pending = 1;
+  }
+
+  receive();
+}
+
+void MqttClient::receive(void)
+{
+  fd_set readsds;
+  FD_ZERO(&readsds);
+  FD_SET(sd, &readsds);
+  timeval timeout = {0, MQTT_POLL_US};
+  if (select(sd + 1, &readsds, NULL, NULL, &timeout) <= 0 || !FD_ISSET(sd, &readsds))
+    return;
+
+  int count = recv(sd, rx_buffer, sizeof(rx_buffer), 0);
+  if (count <= 0)
+  {
+    close();
+    return;
+  }
+
+  decode(rx_buffer, count);
+}
+
+//
+// MqttClient::decode
+//
+// Consumes received bytes.  Payloads of PUBLISH packets are passed to the handler where they
+// lie in the receive buffer.
+//
+void MqttClient::decode(const uint8_t *data, size_t size)
+{
+  while (size && sd >= 0)
+  {
+    if (state == MQTT_STATE_PAYLOAD || state == MQTT_STATE_BODY)
+    {
+      size_t n = size < remaining ? size : remaining;
+      remaining -= n;
+
+      if (state == MQTT_STATE_PAYLOAD)
+      {
+        uint8_t flags = message_flags | (remaining ? 0 : MQTT_FINAL);
+        message_flags = 0;
+        if (handler)
+          handler(context, topic, data, n, flags);
+      }
+      else
+      {
+        // The second byte of CONNACK is its return code.
+        for (size_t i = 0; i < n && count < 2; i++, count++)
+          if (count == 1 && type == MQTT_CONNACK)
+            connack = data[i];
+      }
+
+      data += n;
+      size -= n;
+      if (!remaining)
+        end_packet();
+      continue;
+    }
+
+    uint8_t b = *data++;
+    size--;
+
+    switch (state)
+    {
+      case MQTT_STATE_TYPE:
+        type = b;
+        remaining = 0;
+        shift = 0;
+        state = MQTT_STATE_LENGTH;
+        break;
+
+      case MQTT_STATE_LENGTH:
+        remaining |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+        if (b & 0x80)
+        {
+          if (shift > 21)
+            close();
+          break;
+        }
+
+        count = 0;
+        if ((type & 0xf0) == MQTT_PUBLISH)
+        {
+          topic_remaining = 0;
+          state = MQTT_STATE_TOPIC_LENGTH;
+        }
+        else
+          state = MQTT_STATE_BODY;
+        if (!remaining)
+          end_packet();
+        break;
+
+      case MQTT_STATE_TOPIC_LENGTH:
+        remaining--;
+        topic_remaining = (topic_remaining << 8) | b;
+        if (++count < 2)
+          break;
+        topic_length = 0;
+        state = MQTT_STATE_TOPIC;
+        if (topic_remaining)
+          break;
+        // fall through - empty topic
+
+      case MQTT_STATE_TOPIC:
+        if (topic_remaining)
+        {
+          remaining--;
+          if (topic_length < MQTT_MAX_TOPIC)
+            topic[topic_length++] = b;
+          if (--topic_remaining)
+            break;
+        }
+        topic[topic_length] = 0;
+        count = 0;
+        message_flags = MQTT_FIRST;
+        state = type & MQTT_PUBLISH_QOS ? MQTT_STATE_PACKET_ID : MQTT_STATE_PAYLOAD;
+        if (state == MQTT_STATE_PAYLOAD && !remaining)
+          end_packet();
+        break;
+
+      case MQTT_STATE_PACKET_ID:
+        // Only QoS 0 is subscribed to, so the identifier of a QoS 1 or 2 message is unused.
+        remaining--;
+        if (++count < 2)
+          break;
+        state = MQTT_STATE_PAYLOAD;
+        if (!remaining)
+          end_packet();
+        break;
+    }
+  }
+}
+
+//
+// MqttClient::end_packet
+//
+// Acts on a complete packet.
+//
+void MqttClient::end_packet(void)
+{
+  if (state == MQTT_STATE_PAYLOAD && message_flags)
+  {
+    // An empty message.
+    if (handler)
+      handler(context, topic, NULL, 0, MQTT_FIRST | MQTT_FINAL);
+  }
+  else if (type == MQTT_PINGRESP)
+    ping_pending = 0;
+
+  state = MQTT_STATE_TYPE;
+}
@@ -0,0 +1,147 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_MQTT_H__
+#define __TINYHCI_MQTT_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+
+//
+// MQTT 3.1.1 client
+//
+// Publishes and subscribes at QoS 0.  Packets are built in the send path: the fixed header and
+// topic go into the data packet followed by the payload straight from the caller's RAM or flash.
+//
+// Small messages are queued and sent together, so a burst of readings costs one data packet
+// rather than one per message.  The queue is sent once it would overflow, MQTT_BATCH_MS after
+// its first message, or ahead of any other packet, so messages always leave in order.
+//
+// PINGREQ is only sent when nothing else has been sent for the keep alive interval.  If the
+// broker has not answered by the next interval, the connection is closed.
+//
+// Example:
+//
+//   void on_message(void *context, const char *topic, const uint8_t *data, size_t size, uint8_t flags)
+//   {
+//     ...
+//   }
+//
+//   MqttClient mqtt(on_message, NULL);
+//
+//   mqtt.connect(broker_ip, 1883, "sensor-1", 60);
+//   mqtt.subscribe("sensor-1/config");
+//   ...
+//   mqtt.publish("sensor-1/temperature", text, strlen(text));
+//   mqtt.poll();
+//
+#define MQTT_TX_BUFFER            128     // queue of unsent messages
+#define MQTT_RX_BUFFER            32
+#define MQTT_MAX_TOPIC            32      // longer received topics are truncated
+#define MQTT_BATCH_MS             20      // longest a queued message waits
+#define MQTT_TIMEOUT              5000    // ms to wait for CONNACK
+#define MQTT_POLL_US              5000    // select timeout per poll
+
+//
+// Handler flags
+//
+#define MQTT_FIRST                0x01    // the data starts a message
+#define MQTT_FINAL                0x02    // the data ends a message
+
+// Receives a piece of a message published to a subscribed topic.
+typedef void (*MqttHandler)(void *context, const char *topic, const uint8_t *data, size_t size, uint8_t flags);
+
+class MqttClient
+{
+public:
+  MqttClient(MqttHandler handler, void *context);
+  ~MqttClient() { close(); }
+
+  // Connects to a broker, at ip in host order, with a clean session.  keep_alive is in seconds,
+  // or 0 to disable pings.  Waits for the broker to accept the connection.
+  int connect(uint32_t ip, uint16_t port, const char *client_id, uint16_t keep_alive,
+              const char *user = NULL, const char *password = NULL);
+
+  bool connected(void) const { return sd >= 0; }
+
+  // Publishes a message at QoS 0.  It may be queued; see flush.
+  int publish(const char *topic, const void *payload, size_t size, uint8_t retain = 0);
+  int publish_P(const char *topic, const void PROGMEM *payload, size_t size, uint8_t retain = 0);
+
+  // Subscribes to a topic filter at QoS 0.
+  int subscribe(const char *topic);
+
+  // Sends any queued messages.
+  int flush(void);
+
+  // Sends queued messages and pings when they are due, and receives messages.  Call from loop().
+  void poll(void);
+
+  // Sends queued messages and DISCONNECT, and closes the connection.
+  void disconnect(void);
+
+  void close(void);
+
+private:
+  MqttClient(const MqttClient &);
+  MqttClient &operator=(const MqttClient &);
+
+  int message(const char *topic, const uint8_t *payload, size_t size, uint8_t retain, uint8_t flash);
+  void write_begin(uint16_t size);
+  void put(const void *data, size_t size, uint8_t flash);
+  void put_string(const char *text);
+  int write_end(void);
+  void receive(void);
+  void decode(const uint8_t *data, size_t size);
+  void end_packet(void);
+
+  MqttHandler handler;
+  void *context;
+  int sd;
+
+  uint32_t keep_alive;                    // ms
+  hci_timer ping_timer;                   // restarted by every packet sent
+  uint8_t ping_pending;
+  hci_timer batch_timer;
+  uint16_t packet_id;
+
+  // Queue and packet gathering
+  uint8_t queue[MQTT_TX_BUFFER];
+  uint8_t queue_length;
+  uint16_t write_remaining;
+  uint16_t packet_remaining;
+  uint8_t error;
+
+  // Packet decoder
+  uint8_t state;
+  uint8_t type;
+  uint8_t shift;
+  uint8_t count;
+  uint8_t message_flags;
+  uint8_t connack;                        // CONNACK return code, 0xff until received
+  uint32_t remaining;
+  uint16_t topic_remaining;
+  uint8_t topic_length;
+  char topic[MQTT_MAX_TOPIC + 1];
+
+  uint8_t rx_buffer[MQTT_RX_BUFFER];
+};
+
+#endif
@@ -0,0 +1,210 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_ota.h"
+
+//
+// ota_crc32
+//
+// Processes a nibble at a time, trading a 64 byte table for the 1K of the byte-wise version.
+//
+static const uint32_t PROGMEM crc32_table[16] =
+{
+  0x00000000UL, 0x1db71064UL, 0x3b6e20c8UL, 0x26d930acUL,
+  0x76dc4190UL, 0x6b6b51f4UL, 0x4db26158UL, 0x5005713cUL,
+  0xedb88320UL, 0xf00f9344UL, 0xd6d6a3e8UL, 0xcb61b38cUL,
+  0x9b64c2b0UL, 0x86d3d2d4UL, 0xa00ae278UL, 0xbdbdf21cUL,
+};
+
+uint32_t ota_crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+  while (size--)
+  {
+    uint8_t b = *data++;
+    crc = pgm_read_dword(&crc32_table[(crc ^ b) & 0x0f]) ^ (crc >> 4);
+    crc = pgm_read_dword(&crc32_table[(crc ^ (b >> 4)) & 0x0f]) ^ (crc >> 4);
+  }
+  return crc;
+}
+
+//
+// OtaDownload
+//
+OtaDownload::OtaDownload(OtaStorage &storage)
+  : storage(storage), client(body, this), host(NULL), path(NULL), error(0), current(0)
+{
+}
+
+int OtaDownload::begin(uint32_t ip, uint16_t port, const char *host, const char *path, uint32_t expected_crc)
+{
+  this->ip = ip;
+  this->port = port;
+  this->host = host;
+  this->path = path;
+  this->expected_crc = expected_crc;
+
+  offset = 0;
+  total = 0;
+  running_crc = 0xffffffffUL;
+  return request();
+}
+
+int OtaDownload::resume(void)
+{
+  if (!host)
+    return EFAIL;
+  return request();
+}
+
+//
+// OtaDownload::request
+//
+// Asks for the image from the page being filled on; bytes of that page already received are
+// dropped and received again.
+//
+int OtaDownload::request(void)
+{
+  started = 0;
+  error = 0;
+  fill = 0;
+
+  client.range(offset);
+  return client.request(PSTR("GET"), ip, port, host, path);
+}
+
+int OtaDownload::poll(void)
+{
+  int result = client.poll();
+  if (result == 0 && !error)
+    return OTA_IN_PROGRESS;
+
+  if (error || (result != 200 && result != 206))
+  {
+    client.close();
+    return EFAIL;
+  }
+
+  // The last, partial page.
+  if (fill && !write_page())
+    return EFAIL;
+  while (storage.busy())
+    ;
+
+  if (total && offset != total)
+    return EFAIL;
+  if (expected_crc && crc() != expected_crc)
+    return EFAIL;
+  if (storage.commit(offset, crc()) < 0)
+    return EFAIL;
+
+  host = NULL;
+  return OTA_COMPLETE;
+}
+
+void OtaDownload::body(void *context, const uint8_t *data, size_t size)
+{
+  ((OtaDownload *)context)->receive(data, size);
+}
+
+//
+// OtaDownload::start
+//
+// Checks the response before its first body bytes are stored; returns 0 if it is unusable.
+//
+uint8_t OtaDownload::start(void)
+{
+  started = 1;
+
+  uint16_t status = client.status_code();
+  int32_t length = client.content_length();
+  if (status == 200 && offset)
+  {
+    // The server ignored the range and is sending the whole image again.
+    offset = 0;
+    running_crc = 0xffffffffUL;
+  }
+  else if (status == 206)
+  {
+    // Anything but the rest of the image from offset would be stored in the wrong place.
+    if (client.content_range_start() != (int32_t)offset)
+      return 0;
+  }
+  else if (status != 200)
+    return 0;
+
+  total = length >= 0 ? offset + length : 0;
+  return 1;
+}
+
+//
+// OtaDownload::receive
+//
+// Copies body bytes into the page being filled, and hands each full page to storage.
+//
+void OtaDownload::receive(const uint8_t *data, size_t size)
+{
+  if (error)
+    return;
+  if (!started && !start())
+  {
+    error = 1;
+    return;
+  }
+
+  while (size)
+  {
+    size_t count = OTA_PAGE_SIZE - fill;
+    if (count > size)
+      count = size;
+    memcpy(pages[current] + fill, data, count);
+    fill += count;
+    data += count;
+    size -= count;
+
+    if (fill == OTA_PAGE_SIZE && !write_page())
+    {
+      error = 1;
+      return;
+    }
+  }
+}
+
+//
+// OtaDownload::write_page
+//
+// Starts writing the page being filled and switches to the other buffer, once storage has
+// finished with it.  Returns 0 if the write failed.
+//
+uint8_t OtaDownload::write_page(void)
+{
+  while (storage.busy())
+    ;
+
+  running_crc = ota_crc32(running_crc, pages[current], fill);
+  if (storage.write(offset, pages[current], fill) < 0)
+    return 0;
+
+  offset += fill;
+  fill = 0;
+  current ^= 1;
+  return 1;
+}
@@ -0,0 +1,148 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_OTA_H__
+#define __TINYHCI_OTA_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_http_client.h"
+
+//
+// Firmware download
+//
+// Streams an HTTP download into storage a page at a time, through two page buffers: while one
+// page is being programmed the next fills from the network, so the download runs at the rate
+// of the link rather than stalling for every page write.  RAM use is bounded by the two pages
+// whatever the size of the image.
+//
+// A CRC-32 of everything written is kept as it goes.  If the connection drops, resume asks the
+// server for the rest of the image with a Range request, starting from the last page handed to
+// storage.  A 206 answer must say in Content-Range that it starts there; a 200 answer restarts
+// the image from the beginning.
+//
+// Storage is supplied by the application, e.g. a writer for external SPI flash or for the
+// bootloader's self-programming interface:
+//
+//   class SpiFlashStorage : public OtaStorage
+//   {
+//   public:
+//     virtual int write(uint32_t offset, const uint8_t *page, uint16_t size) { ... start a page program ... }
+//     virtual bool busy(void) { ... read the status register ... }
+//     virtual int commit(uint32_t size, uint32_t crc) { ... mark the image valid ... }
+//   };
+//
+//   SpiFlashStorage storage;
+//   OtaDownload download(storage);
+//
+//   download.begin(ip, 80, "updates.example.com", "/firmware.bin");
+//   while ((result = download.poll()) == OTA_IN_PROGRESS)
+//     ;
+//   if (result == EFAIL && download.resume() == ESUCCESS)
+//     ...
+//
+#ifndef OTA_PAGE_SIZE
+#define OTA_PAGE_SIZE             128     // SPM page of the ATmega328P and ATmega32U4
+#endif
+
+//
+// OtaDownload::poll results
+//
+#define OTA_IN_PROGRESS           0
+#define OTA_COMPLETE              1
+
+//
+// OtaStorage
+//
+class OtaStorage
+{
+public:
+  // Starts writing a page at offset, a multiple of OTA_PAGE_SIZE.  size is OTA_PAGE_SIZE except
+  // for the last page of the image.  page is left unchanged until busy returns false.
+  virtual int write(uint32_t offset, const uint8_t *page, uint16_t size) = 0;
+
+  // Whether the last write is still in progress.
+  virtual bool busy(void) { return false; }
+
+  // Called once the whole image has been written, with its size and CRC-32.
+  virtual int commit(uint32_t /* size */, uint32_t /* crc */) { return ESUCCESS; }
+};
+
+//
+// ota_crc32
+//
+// Continues a CRC-32 (IEEE 802.3) over size bytes.  Start with 0xffffffff and invert the
+// result.
+//
+uint32_t ota_crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+class OtaDownload
+{
+public:
+  OtaDownload(OtaStorage &storage);
+
+  // Starts downloading an image.  host and path must stay valid until the download ends.
+  // expected_crc is checked before the image is committed, unless 0.
+  int begin(uint32_t ip, uint16_t port, const char *host, const char *path, uint32_t expected_crc = 0);
+
+  // Continues the download.  Returns OTA_IN_PROGRESS, OTA_COMPLETE once the image is committed,
+  // or EFAIL if the download failed.
+  int poll(void);
+
+  // Requests the rest of the image after a failure.
+  int resume(void);
+
+  // Bytes handed to storage so far, and the image size once known, or 0.
+  uint32_t written(void) const { return offset; }
+  uint32_t size(void) const { return total; }
+
+  // CRC-32 of the bytes handed to storage so far.
+  uint32_t crc(void) const { return ~running_crc; }
+
+private:
+  OtaDownload(const OtaDownload &);
+  OtaDownload &operator=(const OtaDownload &);
+
+  static void body(void *context, const uint8_t *data, size_t size);
+  void receive(const uint8_t *data, size_t size);
+  uint8_t start(void);
+  uint8_t write_page(void);
+  int request(void);
+
+  OtaStorage &storage;
+  HttpClient client;
+
+  uint32_t ip;
+  uint16_t port;
+  const char *host;
+  const char *path;
+  uint32_t expected_crc;
+
+  uint32_t offset;                        // of the page being filled
+  uint32_t total;
+  uint32_t running_crc;
+  uint8_t started;                        // the response's status has been checked
+  uint8_t error;
+  uint8_t current;                        // page being filled
+  uint16_t fill;
+  uint8_t pages[2][OTA_PAGE_SIZE];
+};
+
+#endif
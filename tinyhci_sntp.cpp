@@ -0,0 +1,292 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_sntp.h"
+
+#define SNTP_PACKET_SIZE          48
+#define SNTP_UNIX_EPOCH           2208988800UL  // 1970 in NTP seconds
+#define SNTP_MAX_DRIFT            85899345L     // 2%, in units of 2^-32
+
+//
+// NTP packet offsets
+//
+#define SNTP_MODE                 0
+#define SNTP_STRATUM              1
+#define SNTP_ORIGINATE            24
+#define SNTP_RECEIVE              32
+#define SNTP_TRANSMIT             40
+
+#define SNTP_CLIENT               0x23    // leap indicator 0, version 4, mode 3 (client)
+
+static uint32_t sntp_read_u32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+//
+// sntp_to_ms
+//
+// Converts the fraction of an NTP timestamp to milliseconds.
+//
+static uint16_t sntp_to_ms(uint32_t fraction)
+{
+  return ((fraction >> 16) * 1000UL) >> 16;
+}
+
+SntpClock::SntpClock()
+  : server(NULL), ip(0), sd(-1), waiting(0), failures(0), set(0), drift(0)
+{
+}
+
+int SntpClock::begin(const char *server)
+{
+  this->server = server;
+  ip = 0;
+  if (open() < 0)
+    return EFAIL;
+  return resolve();
+}
+
+int SntpClock::begin(uint32_t ip)
+{
+  server = NULL;
+  this->ip = ip;
+  return open();
+}
+
+int SntpClock::open(void)
+{
+  end();
+
+  sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sd < 0)
+    return EFAIL;
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(SNTP_LOCAL_PORT);
+  if (bind(sd, (sockaddr *)&address, sizeof(address)) < 0)
+  {
+    end();
+    return EFAIL;
+  }
+
+  waiting = 0;
+  failures = 0;
+  hci_timer_start(&timer, 0);
+  return ESUCCESS;
+}
+
+void SntpClock::end(void)
+{
+  if (sd >= 0)
+    closesocket(sd);
+  sd = -1;
+}
+
+int SntpClock::resolve(void)
+{
+  if (!server)
+    return EFAIL;
+
+  unsigned long address = 0;
+  if (gethostbyname((char *)server, strlen(server), &address) < 0 || !address)
+    return EFAIL;
+
+  // A new address is synced with straight away.
+  if (address != ip)
+  {
+    waiting = 0;
+    hci_timer_start(&timer, 0);
+  }
+  ip = address;
+  failures = 0;
+  return ESUCCESS;
+}
+
+void SntpClock::poll(void)
+{
+  if (sd < 0)
+    return;
+
+  if (waiting)
+    receive();
+
+  if (!hci_timer_expired(&timer))
+    return;
+
+  if (waiting)
+  {
+    // No reply in time.
+    waiting = 0;
+    if (failures < 0xff)
+      failures++;
+  }
+  request();
+}
+
+//
+// SntpClock::request
+//
+// Sends a request, if the server's address is known.
+//
+void SntpClock::request(void)
+{
+  hci_timer_start(&timer, SNTP_RETRY);
+  if (!ip)
+    return;
+
+  // The transmit timestamp is only echoed back by the server, so it carries the local send
+  // time, which identifies the reply.
+  uint8_t packet[SNTP_PACKET_SIZE];
+  memset(packet, 0, sizeof(packet));
+  packet[SNTP_MODE] = SNTP_CLIENT;
+  sent_at = millis();
+  memcpy(packet + SNTP_TRANSMIT + 4, &sent_at, 4);
+
+  sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = htonl(ip);
+  to.sin_port = htons(SNTP_PORT);
+  if (sendto(sd, packet, sizeof(packet), 0, (const sockaddr *)&to, sizeof(to)) < 0)
+    return;
+
+  waiting = 1;
+  hci_timer_start(&timer, SNTP_TIMEOUT);
+}
+
+void SntpClock::receive(void)
+{
+  fd_set readsds;
+  FD_ZERO(&readsds);
+  FD_SET(sd, &readsds);
+  timeval timeout = {0, 0};
+  if (select(sd + 1, &readsds, NULL, NULL, &timeout) <= 0 || !FD_ISSET(sd, &readsds))
+    return;
+
+  uint8_t packet[SNTP_PACKET_SIZE];
+  sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  int count = recvfrom(sd, packet, sizeof(packet), 0, (sockaddr *)&from, &fromlen);
+  uint32_t received_at = millis();
+
+  // Ignore stale replies, replies from other hosts, and kiss-o'-death packets (stratum 0).
+  if (count < SNTP_PACKET_SIZE || from.sin_addr.s_addr != htonl(ip) ||
+      memcmp(packet + SNTP_ORIGINATE + 4, &sent_at, 4) || !packet[SNTP_STRATUM] ||
+      (packet[SNTP_MODE] & 0x07) != 4)
+    return;
+
+  uint32_t receive_seconds = sntp_read_u32(packet + SNTP_RECEIVE);
+  uint16_t receive_ms = sntp_to_ms(sntp_read_u32(packet + SNTP_RECEIVE + 4));
+  uint32_t transmit_seconds = sntp_read_u32(packet + SNTP_TRANSMIT);
+  uint16_t transmit_ms = sntp_to_ms(sntp_read_u32(packet + SNTP_TRANSMIT + 4));
+
+  // The network delay is the round trip less the time the server held the request; the reply
+  // took half of it.
+  int32_t held = (int32_t)(transmit_seconds - receive_seconds) * 1000 + transmit_ms - receive_ms;
+  int32_t delay = (int32_t)(received_at - sent_at) - held;
+  if (delay < 0)
+    delay = 0;
+
+  uint32_t ms = transmit_ms + delay / 2;
+  adjust(transmit_seconds - SNTP_UNIX_EPOCH + ms / 1000, ms % 1000, received_at);
+
+  waiting = 0;
+  failures = 0;
+  hci_timer_start(&timer, SNTP_INTERVAL);
+}
+
+//
+// SntpClock::local
+//
+// The local clock's time at millis() == at.
+//
+uint32_t SntpClock::local(uint32_t at, uint16_t *ms) const
+{
+  uint32_t elapsed = at - base_millis;
+  elapsed += (int32_t)(((int64_t)elapsed * drift) >> 32);
+
+  uint32_t total = base_ms + elapsed;
+  if (ms)
+    *ms = total % 1000;
+  return base_seconds + total / 1000;
+}
+
+//
+// SntpClock::adjust
+//
+// Sets the clock to a time from the server.  The error the clock had accumulated since the
+// last sync refines the drift correction.
+//
+void SntpClock::adjust(uint32_t seconds, uint16_t ms, uint32_t at)
+{
+  if (set)
+  {
+    uint32_t elapsed = at - base_millis;
+    uint16_t local_ms;
+    uint32_t local_seconds = local(at, &local_ms);
+    int32_t seconds_error = seconds - local_seconds;
+    int64_t error = (int64_t)seconds_error * 1000 + ms - local_ms;
+
+    if (elapsed < SNTP_MIN_DRIFT_INTERVAL)
+    {
+      // Too soon after the last sync to measure drift; keep the longer baseline unless the
+      // clock is off by a second or more.
+      if (error > -1000 && error < 1000)
+        return;
+    }
+    else if ((error < 0 ? -error : error) <= (((int64_t)elapsed * SNTP_MAX_DRIFT) >> 32))
+    {
+      // Errors larger than SNTP_MAX_DRIFT can explain are steps of the server's clock, and
+      // leave the drift alone.
+      int64_t corrected = drift + error * 4294967296LL / elapsed;
+      if (corrected > SNTP_MAX_DRIFT)
+        corrected = SNTP_MAX_DRIFT;
+      if (corrected < -SNTP_MAX_DRIFT)
+        corrected = -SNTP_MAX_DRIFT;
+      drift = (int32_t)corrected;
+    }
+  }
+
+  base_seconds = seconds;
+  base_ms = ms;
+  base_millis = at;
+  set = 1;
+}
+
+uint32_t SntpClock::now(uint16_t *ms) const
+{
+  if (!set)
+  {
+    if (ms)
+      *ms = 0;
+    return 0;
+  }
+  return local(millis(), ms);
+}
+
+int32_t SntpClock::drift_ppm(void) const
+{
+  return ((int64_t)drift * 1000000) >> 32;
+}
@@ -0,0 +1,122 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_SNTP_H__
+#define __TINYHCI_SNTP_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+
+//
+// SNTP clock
+//
+// Keeps the time of day from an NTP server, for timestamping.  The server's name is resolved
+// once and its address cached; a sync is then a single request and reply datagram on a socket
+// that stays open.  Syncs run from poll without blocking: the request is sent and the reply
+// picked up on a later poll.
+//
+// Resolving a name blocks, so it is only done by begin and resolve, never by poll.  Once
+// SNTP_RESOLVE_FAILURES syncs in a row have failed, resolve_due tells the application to call
+// resolve again when it can afford to wait, in case the server has moved.
+//
+// Between syncs the time is extrapolated from millis().  The rate error of the local oscillator
+// is measured from successive syncs and corrected for, so the clock stays close to the server's
+// between syncs even on boards clocked by a ceramic resonator.
+//
+// Example:
+//
+//   SntpClock clock;
+//
+//   clock.begin("pool.ntp.org");
+//   ...
+//   clock.poll();
+//   if (clock.resolve_due())
+//     clock.resolve();
+//   if (clock.synced())
+//     timestamp = clock.now();
+//
+#define SNTP_PORT                 123
+#define SNTP_LOCAL_PORT           4123
+#define SNTP_INTERVAL             3600000UL   // ms between syncs
+#define SNTP_RETRY                10000       // ms before retrying a failed sync
+#define SNTP_TIMEOUT              2000        // ms to wait for a reply
+#define SNTP_RESOLVE_FAILURES     3           // failed syncs before resolve_due
+#define SNTP_MIN_DRIFT_INTERVAL   60000UL     // ms between syncs needed to measure drift
+
+class SntpClock
+{
+public:
+  SntpClock();
+  ~SntpClock() { end(); }
+
+  // Starts syncing with a server given by name, which must stay valid, or by address in host
+  // order.  Resolving the name blocks; if it fails, begin returns EFAIL with the socket open,
+  // and syncs start once resolve succeeds.
+  int begin(const char *server);
+  int begin(uint32_t ip);
+  void end(void);
+
+  // Resolves the server's name again, blocking until gethostbyname returns.  The address
+  // already known is kept if the name cannot be resolved.
+  int resolve(void);
+
+  // Whether the server's name should be resolved again: it has not been yet, or the last
+  // SNTP_RESOLVE_FAILURES syncs failed.
+  bool resolve_due(void) const { return server && (!ip || failures >= SNTP_RESOLVE_FAILURES); }
+
+  // Sends a request when a sync is due and receives the reply.  Never blocks.  Call from loop().
+  void poll(void);
+
+  // Whether the clock has been set.
+  bool synced(void) const { return set; }
+
+  // Seconds since 1970-01-01 UTC, and optionally the milliseconds within the second.
+  uint32_t now(uint16_t *ms = NULL) const;
+
+  // Measured rate error of millis(), in parts per million.
+  int32_t drift_ppm(void) const;
+
+private:
+  SntpClock(const SntpClock &);
+  SntpClock &operator=(const SntpClock &);
+
+  int open(void);
+  void request(void);
+  void receive(void);
+  void adjust(uint32_t seconds, uint16_t ms, uint32_t at);
+  uint32_t local(uint32_t at, uint16_t *ms) const;
+
+  const char *server;
+  uint32_t ip;
+  int sd;
+  uint8_t waiting;
+  uint8_t failures;
+  uint8_t set;
+  hci_timer timer;
+  uint32_t sent_at;                       // millis() when the request was sent
+
+  // The time at base_millis, and the rate correction since, in units of 2^-32.
+  uint32_t base_seconds;
+  uint16_t base_ms;
+  uint32_t base_millis;
+  int32_t drift;
+};
+
+#endif
@@ -0,0 +1,391 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_SOCKET_H__
+#define __TINYHCI_SOCKET_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+
+//
+// Socket classes
+//
+// Thin owning wrappers around tinyhci socket descriptors.  Each class is move-only and closes
+// its socket when destroyed, so early returns cannot leak sockets.  Everything is inline and
+// calls straight through to the socket API; there are no virtual functions.
+//
+// Example:
+//
+//   TcpListener listener = TcpListener::listen(80);
+//   ...
+//   TcpSocket client = listener.accept();
+//   if (client)
+//     client.write_P(F("HTTP/1.1 204 No Content\r\n\r\n"));
+//
+
+//
+// Buffer sizes for TcpSocket.  Define these before including this header to change them; they
+// must be the same everywhere the header is included.
+//
+#ifndef TCP_SOCKET_RX_BUFFER
+#define TCP_SOCKET_RX_BUFFER    32
+#endif
+#ifndef TCP_SOCKET_TX_BUFFER
+#define TCP_SOCKET_TX_BUFFER    32
+#endif
+
+//
+// HciSocket
+//
+// Owns a socket descriptor.  Base of the other classes, not used directly.
+//
+class HciSocket
+{
+public:
+  int fd() const { return sd; }
+  bool valid() const { return sd >= 0; }
+  explicit operator bool() const { return sd >= 0; }
+
+  // Gives up ownership of the descriptor without closing it.
+  int release() { int result = sd; sd = -1; return result; }
+
+  int close()
+  {
+    int result = ESUCCESS;
+    if (sd >= 0)
+      result = closesocket(sd);
+    sd = -1;
+    return result;
+  }
+
+  int set_option(long optname, const void *optval, unsigned long optlen)
+  {
+    return setsockopt(sd, SOL_SOCKET, optname, optval, optlen);
+  }
+
+protected:
+  explicit HciSocket(int sd = -1) : sd(sd) {}
+  ~HciSocket() { close(); }
+
+  HciSocket(HciSocket &&other) : sd(other.release()) {}
+  HciSocket &operator=(HciSocket &&other)
+  {
+    if (this != &other)
+    {
+      close();
+      sd = other.release();
+    }
+    return *this;
+  }
+
+  HciSocket(const HciSocket &) = delete;
+  HciSocket &operator=(const HciSocket &) = delete;
+
+  int sd;
+};
+
+//
+// TcpSocket
+//
+// A connected TCP socket with small receive and transmit buffers.  Writes are collected until
+// the buffer fills or flush is called, and the buffer is flushed before the socket is closed.
+//
+class TcpSocket : public HciSocket
+{
+public:
+  TcpSocket() : rx_idx(0), rx_len(0), tx_len(0) {}
+  explicit TcpSocket(int sd) : HciSocket(sd), rx_idx(0), rx_len(0), tx_len(0) {}
+  ~TcpSocket() { close(); }
+
+  TcpSocket(TcpSocket &&other) : HciSocket(static_cast<HciSocket &&>(other)) { take(other); }
+  TcpSocket &operator=(TcpSocket &&other)
+  {
+    if (this != &other)
+    {
+      close();
+      HciSocket::operator=(static_cast<HciSocket &&>(other));
+      take(other);
+    }
+    return *this;
+  }
+
+  // Opens a socket and connects it to a peer; the result is invalid on failure.
+  static TcpSocket open(uint32_t ip, uint16_t port)
+  {
+    TcpSocket socket(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    if (!socket)
+      return socket;
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(ip);
+    address.sin_port = htons(port);
+    if (::connect(socket.sd, (sockaddr *)&address, sizeof(address)) < 0)
+      socket.close();
+
+    return socket;
+  }
+
+  // Number of bytes that can be read without waiting on the CC3000.
+  int available() const { return rx_len - rx_idx; }
+
+  // Returns the next byte, or -1 once the peer has closed or the socket failed.
+  int read()
+  {
+    if (rx_idx >= rx_len && fill() <= 0)
+      return -1;
+    return rx_buf[rx_idx++];
+  }
+
+  // Reads up to size bytes, returning the number read or a negative error.  Large reads bypass
+  // the buffer.
+  int read(void *buffer, int size)
+  {
+    int count = available();
+    if (count > 0)
+    {
+      if (count > size)
+        count = size;
+      memcpy(buffer, rx_buf + rx_idx, count);
+      rx_idx += count;
+      return count;
+    }
+
+    if (size >= (int)sizeof(rx_buf))
+      return recv(sd, buffer, size, 0);
+
+    count = fill();
+    if (count <= 0)
+      return count;
+    return read(buffer, size);
+  }
+
+  int write(uint8_t c)
+  {
+    if (tx_len >= sizeof(tx_buf) && flush() < 0)
+      return EFAIL;
+    tx_buf[tx_len++] = c;
+    return 1;
+  }
+
+  // Writes size bytes, returning size or a negative error.  Writes that do not fit in the
+  // buffer are sent directly after flushing it, in packets of up to send_mtu bytes.
+  int write(const void *buffer, int size)
+  {
+    if (tx_len + size <= (int)sizeof(tx_buf))
+    {
+      memcpy(tx_buf + tx_len, buffer, size);
+      tx_len += size;
+      return size;
+    }
+
+    int result = flush();
+    if (result < 0)
+      return result;
+
+    const uint8_t *pos = (const uint8_t *)buffer;
+    int mtu = send_mtu();
+    for (int sent = 0; sent < size; )
+    {
+      int chunk = size - sent < mtu ? size - sent : mtu;
+      result = send(sd, pos + sent, chunk, 0);
+      if (result < 0)
+        return result;
+      sent += chunk;
+    }
+    return size;
+  }
+
+  int write(const char *text) { return write(text, strlen(text)); }
+
+  // Writes a string from flash.
+  int write_P(const __FlashStringHelper *text)
+  {
+    const char PROGMEM *p = (const char PROGMEM *)text;
+    int count = 0;
+    for (;;)
+    {
+      uint8_t c = pgm_read_byte(p++);
+      if (c == 0)
+        break;
+      if (write(c) < 0)
+        return EFAIL;
+      count++;
+    }
+    return count;
+  }
+
+  // Sends any buffered data.
+  int flush()
+  {
+    if (!tx_len)
+      return 0;
+    int result = send(sd, tx_buf, tx_len, 0);
+    tx_len = 0;
+    return result;
+  }
+
+  int close()
+  {
+    if (sd >= 0)
+      flush();
+    rx_idx = rx_len = 0;
+    return HciSocket::close();
+  }
+
+private:
+  int fill()
+  {
+    rx_idx = rx_len = 0;
+    int result = recv(sd, rx_buf, sizeof(rx_buf), 0);
+    if (result > 0)
+      rx_len = result;
+    return result;
+  }
+
+  void take(TcpSocket &other)
+  {
+    rx_idx = other.rx_idx;
+    rx_len = other.rx_len;
+    tx_len = other.tx_len;
+    memcpy(rx_buf, other.rx_buf, rx_len);
+    memcpy(tx_buf, other.tx_buf, tx_len);
+    other.rx_idx = other.rx_len = other.tx_len = 0;
+  }
+
+  uint8_t rx_idx;
+  uint8_t rx_len;
+  uint8_t tx_len;
+  uint8_t rx_buf[TCP_SOCKET_RX_BUFFER];
+  uint8_t tx_buf[TCP_SOCKET_TX_BUFFER];
+};
+
+//
+// TcpListener
+//
+// A listening TCP socket.  accept is non-blocking by default and returns an invalid TcpSocket
+// when no client is waiting.
+//
+class TcpListener : public HciSocket
+{
+public:
+  TcpListener() {}
+  explicit TcpListener(int sd) : HciSocket(sd) {}
+
+  TcpListener(TcpListener &&other) : HciSocket(static_cast<HciSocket &&>(other)) {}
+  TcpListener &operator=(TcpListener &&other)
+  {
+    HciSocket::operator=(static_cast<HciSocket &&>(other));
+    return *this;
+  }
+
+  // Opens a socket listening on the given port; the result is invalid on failure.
+  static TcpListener listen(uint16_t port, bool nonblocking = true)
+  {
+    TcpListener listener(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    if (!listener)
+      return listener;
+
+    char arg = SOCK_ON;
+    if (nonblocking && listener.set_option(SOCKOPT_ACCEPT_NONBLOCK, &arg, sizeof(arg)) < 0)
+    {
+      listener.close();
+      return listener;
+    }
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = 0;
+    address.sin_port = htons(port);
+    if (::bind(listener.sd, (sockaddr *)&address, sizeof(address)) < 0 || ::listen(listener.sd, 0) < 0)
+      listener.close();
+
+    return listener;
+  }
+
+  TcpSocket accept()
+  {
+    int client = ::accept(sd, NULL, NULL);
+    return TcpSocket(client >= 0 ? client : -1);
+  }
+};
+
+//
+// UdpSocket
+//
+// A UDP socket.  Datagrams are sent and received whole, so there is no buffering.
+//
+class UdpSocket : public HciSocket
+{
+public:
+  UdpSocket() {}
+  explicit UdpSocket(int sd) : HciSocket(sd) {}
+
+  UdpSocket(UdpSocket &&other) : HciSocket(static_cast<HciSocket &&>(other)) {}
+  UdpSocket &operator=(UdpSocket &&other)
+  {
+    HciSocket::operator=(static_cast<HciSocket &&>(other));
+    return *this;
+  }
+
+  // Opens a socket, bound to the given port unless it is 0; the result is invalid on failure.
+  static UdpSocket open(uint16_t port = 0)
+  {
+    UdpSocket socket(::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP));
+    if (!socket || !port)
+      return socket;
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = 0;
+    address.sin_port = htons(port);
+    if (::bind(socket.sd, (sockaddr *)&address, sizeof(address)) < 0)
+      socket.close();
+
+    return socket;
+  }
+
+  int send_to(const void *buffer, int size, const sockaddr_in &to)
+  {
+    return sendto(sd, buffer, size, 0, (const sockaddr *)&to, sizeof(to));
+  }
+
+  int send_to(const void *buffer, int size, uint32_t ip, uint16_t port)
+  {
+    sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(ip);
+    to.sin_port = htons(port);
+    return send_to(buffer, size, to);
+  }
+
+  // Receives one datagram, truncated to size.  from may be NULL.
+  int receive_from(void *buffer, int size, sockaddr_in *from = NULL)
+  {
+    socklen_t fromlen = sizeof(sockaddr_in);
+    return recvfrom(sd, buffer, size, 0, (sockaddr *)from, from ? &fromlen : NULL);
+  }
+};
+
+#endif
@@ -0,0 +1,459 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_websocket.h"
+
+//
+// Decoder states
+//
+#define WEBSOCKET_STATE_HEADER    0
+#define WEBSOCKET_STATE_PAYLOAD   1
+
+//
+// SHA-1, for the handshake
+//
+typedef struct _sha1_t
+{
+  uint32_t h[5];
+  uint8_t block[64];
+  uint8_t length;                         // bytes in block
+  uint32_t total;                         // bytes hashed
+} sha1;
+
+static uint32_t sha1_rol(uint32_t x, uint8_t n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_begin(sha1 *s)
+{
+  s->h[0] = 0x67452301UL;
+  s->h[1] = 0xefcdab89UL;
+  s->h[2] = 0x98badcfeUL;
+  s->h[3] = 0x10325476UL;
+  s->h[4] = 0xc3d2e1f0UL;
+  s->length = 0;
+  s->total = 0;
+}
+
+//
+// sha1_block
+//
+// Hashes a full block.  The message schedule is kept as a rolling window of 16 words rather than
+// 80 to save RAM.
+//
+static void sha1_block(sha1 *s)
+{
+  uint32_t w[16];
+  for (uint8_t i = 0; i < 16; i++)
+    w[i] = ((uint32_t)s->block[i * 4] << 24) | ((uint32_t)s->block[i * 4 + 1] << 16) |
+           ((uint32_t)s->block[i * 4 + 2] << 8) | s->block[i * 4 + 3];
+
+  uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+  for (uint8_t i = 0; i < 80; i++)
+  {
+    if (i >= 16)
+      w[i & 15] = sha1_rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+
+    uint32_t f, k;
+    if (i < 20)
+    {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999UL;
+    }
+    else if (i < 40)
+    {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1UL;
+    }
+    else if (i < 60)
+    {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdcUL;
+    }
+    else
+    {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6UL;
+    }
+
+    uint32_t t = sha1_rol(a, 5) + f + e + k + w[i & 15];
+    e = d;
+    d = c;
+    c = sha1_rol(b, 30);
+    b = a;
+    a = t;
+  }
+
+  s->h[0] += a;
+  s->h[1] += b;
+  s->h[2] += c;
+  s->h[3] += d;
+  s->h[4] += e;
+  s->length = 0;
+}
+
+static void sha1_byte(sha1 *s, uint8_t b)
+{
+  s->block[s->length++] = b;
+  s->total++;
+  if (s->length == 64)
+    sha1_block(s);
+}
+
+static void sha1_end(sha1 *s, uint8_t *digest)
+{
+  uint32_t bits = s->total * 8;
+
+  sha1_byte(s, 0x80);
+  while (s->length != 56)
+    sha1_byte(s, 0);
+  for (uint8_t i = 0; i < 4; i++)
+    sha1_byte(s, 0);
+  for (int8_t i = 24; i >= 0; i -= 8)
+    sha1_byte(s, bits >> i);
+
+  for (uint8_t i = 0; i < 20; i++)
+    digest[i] = s->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+//
+// base64
+//
+// Encodes size bytes into text, which must have room for 4 characters per 3 bytes and a
+// terminator.
+//
+static void base64(const uint8_t *data, uint8_t size, char *text)
+{
+  static const char PROGMEM digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  for (uint8_t i = 0; i < size; i += 3)
+  {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < size)
+      group |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < size)
+      group |= data[i + 2];
+
+    *text++ = pgm_read_byte(&digits[(group >> 18) & 0x3f]);
+    *text++ = pgm_read_byte(&digits[(group >> 12) & 0x3f]);
+    *text++ = i + 1 < size ? pgm_read_byte(&digits[(group >> 6) & 0x3f]) : '=';
+    *text++ = i + 2 < size ? pgm_read_byte(&digits[group & 0x3f]) : '=';
+  }
+  *text = 0;
+}
+
+//
+// WebSocket
+//
+int WebSocket::accept(const HttpRequest &request, HttpResponse &response)
+{
+  if (!(request.flags & HTTP_REQUEST_UPGRADE) || !request.websocket_key[0])
+  {
+    response.begin(400, NULL, 0);
+    return EFAIL;
+  }
+  if (sd >= 0)
+  {
+    response.begin(503, NULL, 0);
+    return EFAIL;
+  }
+
+  // Sec-WebSocket-Accept is the base64 SHA-1 of the client's key and a fixed GUID.
+  sha1 s;
+  sha1_begin(&s);
+  for (const char *p = request.websocket_key; *p; p++)
+    sha1_byte(&s, *p);
+  for (const char PROGMEM *p = PSTR("258EAFA5-E914-47DA-95CA-C5AB0DC85B11"); uint8_t b = pgm_read_byte(p); p++)
+    sha1_byte(&s, b);
+
+  uint8_t digest[20];
+  char key[29];
+  sha1_end(&s, digest);
+  base64(digest, sizeof(digest), key);
+
+  response.begin(101, NULL, 0);
+  response.header_P(PSTR("Upgrade"), PSTR("websocket"));
+  response.header(PSTR("Sec-WebSocket-Accept"), key);
+
+  int result = response.detach();
+  if (result < 0)
+    return EFAIL;
+
+  sd = result;
+  state = WEBSOCKET_STATE_HEADER;
+  header_length = 0;
+  header_needed = 2;
+  message_opcode = 0;
+  return ESUCCESS;
+}
+
+void WebSocket::poll(void)
+{
+  if (sd < 0)
+    return;
+
+  fd_set readsds;
+  FD_ZERO(&readsds);
+  FD_SET(sd, &readsds);
+  timeval timeout = {0, WEBSOCKET_POLL_US};
+  if (select(sd + 1, &readsds, NULL, NULL, &timeout) <= 0 || !FD_ISSET(sd, &readsds))
+    return;
+
+  int count = recv(sd, rx_buffer, sizeof(rx_buffer), 0);
+  if (count <= 0)
+  {
+    closesocket(sd);
+    sd = -1;
+    return;
+  }
+
+  receive(rx_buffer, count);
+}
+
+//
+// WebSocket::receive
+//
+// Decodes received bytes, unmasking payloads in place.
+//
+void WebSocket::receive(uint8_t *data, size_t size)
+{
+  while (size && sd >= 0)
+  {
+    if (state == WEBSOCKET_STATE_HEADER)
+    {
+      header[header_length++] = *data++;
+      size--;
+
+      if (header_length == 2)
+      {
+        uint8_t length = header[1] & 0x7f;
+        header_needed = 2 + (length == 126 ? 2 : length == 127 ? 8 : 0) + (header[1] & 0x80 ? 4 : 0);
+      }
+      if (header_length == header_needed && !begin_payload())
+        return;
+      continue;
+    }
+
+    size_t count = size < payload_remaining ? size : payload_remaining;
+    for (size_t i = 0; i < count; i++)
+      data[i] ^= mask[mask_index++ & 3];
+    payload_remaining -= count;
+
+    if (opcode & 0x08)
+    {
+      for (size_t i = 0; i < count && control_length < WEBSOCKET_MAX_CONTROL; i++)
+        control[control_length++] = data[i];
+    }
+    else
+    {
+      uint8_t flags = message_flags;
+      if (!payload_remaining && (header[0] & 0x80))
+        flags |= WEBSOCKET_FINAL;
+      message_flags = 0;
+      handler(*this, message_opcode, data, count, flags);
+    }
+
+    data += count;
+    size -= count;
+    if (!payload_remaining)
+      end_frame();
+  }
+}
+
+//
+// WebSocket::begin_payload
+//
+// Checks a complete frame header; returns 0 if the connection was closed.
+//
+uint8_t WebSocket::begin_payload(void)
+{
+  uint8_t final = header[0] & 0x80;
+  uint8_t length = header[1] & 0x7f;
+  opcode = header[0] & 0x0f;
+
+  payload_remaining = length;
+  if (length == 126)
+    payload_remaining = ((uint16_t)header[2] << 8) | header[3];
+  else if (length == 127)
+  {
+    if (header[2] | header[3] | header[4] | header[5])
+    {
+      close(WEBSOCKET_CLOSE_TOO_BIG);
+      return 0;
+    }
+    payload_remaining = ((uint32_t)header[6] << 24) | ((uint32_t)header[7] << 16) |
+                        ((uint32_t)header[8] << 8) | header[9];
+  }
+  memcpy(mask, header + header_length - 4, 4);
+  mask_index = 0;
+
+  // Client frames must be masked, and reserved bits and opcodes are not used.
+  uint8_t error = !(header[1] & 0x80) || (header[0] & 0x70);
+  if (opcode & 0x08)
+  {
+    // Control frames are never fragmented; pings are echoed, so must fit the buffer.
+    error |= !final || length > 125 || opcode > WEBSOCKET_PONG;
+    if (!error && opcode == WEBSOCKET_PING && payload_remaining > WEBSOCKET_MAX_CONTROL)
+    {
+      close(WEBSOCKET_CLOSE_TOO_BIG);
+      return 0;
+    }
+    control_length = 0;
+  }
+  else if (opcode == WEBSOCKET_CONTINUATION)
+    error |= !message_opcode;
+  else
+  {
+    error |= message_opcode || opcode > WEBSOCKET_BINARY;
+    message_opcode = opcode;
+    message_flags = WEBSOCKET_FIRST;
+  }
+
+  if (error)
+  {
+    close(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+    return 0;
+  }
+
+  state = WEBSOCKET_STATE_PAYLOAD;
+  if (!payload_remaining)
+  {
+    // An empty frame still ends a message.
+    if (!(opcode & 0x08) && final)
+      handler(*this, message_opcode, NULL, 0, message_flags | WEBSOCKET_FINAL);
+    end_frame();
+  }
+  return sd >= 0;
+}
+
+//
+// WebSocket::end_frame
+//
+// Acts on a complete frame.
+//
+void WebSocket::end_frame(void)
+{
+  state = WEBSOCKET_STATE_HEADER;
+  header_length = 0;
+  header_needed = 2;
+
+  switch (opcode)
+  {
+    case WEBSOCKET_PING:
+      frame(WEBSOCKET_PONG, control, control_length, 0);
+      break;
+
+    case WEBSOCKET_CLOSE:
+      // Echo the status code and close.
+      frame(WEBSOCKET_CLOSE, control, control_length < 2 ? control_length : 2, 0);
+      if (sd >= 0)
+        closesocket(sd);
+      sd = -1;
+      break;
+
+    case WEBSOCKET_PONG:
+      break;
+
+    default:
+      if (header[0] & 0x80)
+        message_opcode = 0;
+      break;
+  }
+}
+
+//
+// WebSocket::frame
+//
+// Sends a frame.  The header goes out in the same data packet as the start of the payload, and
+// payloads larger than a packet continue in further packets.
+//
+int WebSocket::frame(uint8_t opcode, const uint8_t *data, size_t size, uint8_t flash)
+{
+  if (sd < 0 || size > 0xffff)
+    return EFAIL;
+
+  uint8_t frame_header[4];
+  uint8_t length = 2;
+  frame_header[0] = 0x80 | opcode;
+  if (size < 126)
+    frame_header[1] = size;
+  else
+  {
+    frame_header[1] = 126;
+    frame_header[2] = size >> 8;
+    frame_header[3] = size;
+    length = 4;
+  }
+
+  int mtu = send_mtu();
+  do
+  {
+    size_t chunk = size < (size_t)(mtu - length) ? size : mtu - length;
+
+    int result = send_begin(sd, length + chunk, 0);
+    if (result >= 0)
+    {
+      send_data(frame_header, length);
+      if (flash)
+        send_data_P(data, chunk);
+      else
+        send_data(data, chunk);
+      result = send_end();
+    }
+    if (result < 0)
+    {
+      closesocket(sd);
+      sd = -1;
+      return EFAIL;
+    }
+
+    length = 0;
+    data += chunk;
+    size -= chunk;
+  } while (size);
+
+  return ESUCCESS;
+}
+
+int WebSocket::send(uint8_t opcode, const void *data, size_t size)
+{
+  return frame(opcode, (const uint8_t *)data, size, 0);
+}
+
+int WebSocket::send_P(uint8_t opcode, const void PROGMEM *data, size_t size)
+{
+  return frame(opcode, (const uint8_t *)data, size, 1);
+}
+
+void WebSocket::close(uint16_t code)
+{
+  if (sd < 0)
+    return;
+
+  uint8_t payload[2] = { (uint8_t)(code >> 8), (uint8_t)code };
+  frame(WEBSOCKET_CLOSE, payload, sizeof(payload), 0);
+  if (sd >= 0)
+    closesocket(sd);
+  sd = -1;
+}
@@ -0,0 +1,147 @@
+/*
+All of tinyhci is licensed under the MIT license.
+
+Copyright (c) 2014 by Wade Brainerd <wadeb@wadeb.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+and associated documentation files (the "Software"), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute,
+sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or
+substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef __TINYHCI_WEBSOCKET_H__
+#define __TINYHCI_WEBSOCKET_H__
+
+#include <Arduino.h>
+#include "tinyhci.h"
+#include "tinyhci_http.h"
+
+//
+// WebSocket server endpoint
+//
+// Takes over an HttpServer connection whose request asked for an upgrade, and then exchanges
+// messages over it for as long as the client stays connected.  Pushing an update costs a single
+// data packet, instead of the connection setup and request of an HTTP poll.
+//
+// Received frames are unmasked in place in the receive buffer and passed to the handler as they
+// arrive, so messages of any length are received in a fixed amount of RAM; a message may be
+// delivered in several pieces.  Sent frames are built around the caller's data in the data
+// packet that carries them.
+//
+// Example:
+//
+//   void on_message(WebSocket &socket, uint8_t opcode, const uint8_t *data, size_t size, uint8_t flags)
+//   {
+//     ...
+//   }
+//
+//   WebSocket dashboard(on_message);
+//
+//   void serve_updates(const HttpRequest &request, HttpResponse &response)
+//   {
+//     dashboard.accept(request, response);
+//   }
+//
+//   void loop()
+//   {
+//     server.poll();
+//     dashboard.poll();
+//     if (dashboard.connected() && ...)
+//       dashboard.send_text(reading);
+//   }
+//
+#define WEBSOCKET_RX_BUFFER       32
+#define WEBSOCKET_MAX_CONTROL     16      // longest ping or close payload that is answered
+#define WEBSOCKET_POLL_US         5000    // select timeout per poll
+
+//
+// Opcodes
+//
+#define WEBSOCKET_CONTINUATION    0x0
+#define WEBSOCKET_TEXT            0x1
+#define WEBSOCKET_BINARY          0x2
+#define WEBSOCKET_CLOSE           0x8
+#define WEBSOCKET_PING            0x9
+#define WEBSOCKET_PONG            0xa
+
+//
+// Close status codes
+//
+#define WEBSOCKET_CLOSE_NORMAL          1000
+#define WEBSOCKET_CLOSE_PROTOCOL_ERROR  1002
+#define WEBSOCKET_CLOSE_TOO_BIG         1009
+
+//
+// Handler flags
+//
+#define WEBSOCKET_FIRST           0x01    // the data starts a message
+#define WEBSOCKET_FINAL           0x02    // the data ends a message
+
+class WebSocket;
+
+// Receives a piece of a text or binary message.  opcode is that of the whole message.
+typedef void (*WebSocketHandler)(WebSocket &socket, uint8_t opcode, const uint8_t *data, size_t size, uint8_t flags);
+
+class WebSocket
+{
+public:
+  WebSocket(WebSocketHandler handler) : handler(handler), sd(-1) {}
+  ~WebSocket() { close(WEBSOCKET_CLOSE_NORMAL); }
+
+  // Answers an upgrade request from an HttpServer handler and takes over its connection.
+  // Requests that are not upgrades get a 400, and a 503 if a client is already connected.
+  int accept(const HttpRequest &request, HttpResponse &response);
+
+  bool connected(void) const { return sd >= 0; }
+
+  // Receives any frames that have arrived and passes their messages to the handler.  Answers
+  // pings and close frames.  Call from loop().
+  void poll(void);
+
+  // Sends a message in one frame.  On failure the connection is closed.
+  int send(uint8_t opcode, const void *data, size_t size);
+  int send_P(uint8_t opcode, const void PROGMEM *data, size_t size);
+  int send_text(const char *text) { return send(WEBSOCKET_TEXT, text, strlen(text)); }
+
+  // Sends a close frame and closes the connection.
+  void close(uint16_t code);
+
+private:
+  WebSocket(const WebSocket &);
+  WebSocket &operator=(const WebSocket &);
+
+  int frame(uint8_t opcode, const uint8_t *data, size_t size, uint8_t flash);
+  void receive(uint8_t *data, size_t size);
+  uint8_t begin_payload(void);
+  void end_frame(void);
+
+  WebSocketHandler handler;
+  int sd;
+
+  // Frame decoder
+  uint8_t state;
+  uint8_t header[14];
+  uint8_t header_length;
+  uint8_t header_needed;
+  uint8_t opcode;                         // of the frame being received
+  uint8_t message_opcode;                 // of the message being received, 0 if none
+  uint8_t message_flags;
+  uint8_t mask[4];
+  uint8_t mask_index;
+  uint32_t payload_remaining;
+  uint8_t control[WEBSOCKET_MAX_CONTROL];
+  uint8_t control_length;
+
+  uint8_t rx_buffer[WEBSOCKET_RX_BUFFER];
+};
+
+#endif
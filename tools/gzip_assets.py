@@ -0,0 +1,135 @@
+#!/usr/bin/env python
+#
+# gzip_assets.py
+#
+# Compresses static web assets into a header of PROGMEM blobs and HttpRoute entries for
+# tinyhci_http.  Each asset is gzip compressed once at build time, so the server sends the
+# compressed bytes straight from flash with a precomputed Content-Length and ETag.
+#
+# Usage:
+#
+#   python tools/gzip_assets.py <asset directory> <output header>
+#
+# Files are served at their path relative to the asset directory; index.html is also served
+# at the path of its directory.  The header defines ASSET_ROUTES, a list of route initializers
+# to place in an HttpRoute table:
+#
+#   #include "assets.h"
+#
+#   const HttpRoute routes[] PROGMEM =
+#   {
+#     ASSET_ROUTES
+#     { api_path, NULL, NULL, 0, serve_api },
+#   };
+#
+# Assets that do not get smaller when compressed are stored uncompressed.
+#
+import gzip
+import hashlib
+import io
+import os
+import re
+import sys
+
+CONTENT_TYPES = {
+    '.html': 'text/html',
+    '.htm':  'text/html',
+    '.css':  'text/css',
+    '.js':   'application/javascript',
+    '.json': 'application/json',
+    '.svg':  'image/svg+xml',
+    '.png':  'image/png',
+    '.jpg':  'image/jpeg',
+    '.gif':  'image/gif',
+    '.ico':  'image/x-icon',
+    '.txt':  'text/plain',
+}
+
+def compress(data):
+    # mtime=0 keeps the output, and so the ETag, identical between builds.
+    out = io.BytesIO()
+    with gzip.GzipFile(fileobj=out, mode='wb', compresslevel=9, mtime=0) as f:
+        f.write(data)
+    return out.getvalue()
+
+def c_string(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write('usage: %s <asset directory> <output header>\n' % sys.argv[0])
+        return 1
+
+    root, output = sys.argv[1], sys.argv[2]
+
+    assets = []
+    for directory, _, files in sorted(os.walk(root)):
+        for name in sorted(files):
+            filename = os.path.join(directory, name)
+            path = '/' + os.path.relpath(filename, root).replace(os.sep, '/')
+            content_type = CONTENT_TYPES.get(os.path.splitext(name)[1].lower(), 'application/octet-stream')
+            with open(filename, 'rb') as f:
+                data = f.read()
+            assets.append((path, content_type, data))
+
+    lines = [
+        '//',
+        '// Generated by tools/gzip_assets.py from %s; do not edit.' % os.path.basename(os.path.normpath(root)),
+        '//',
+        '#ifndef __ASSETS_H__',
+        '#define __ASSETS_H__',
+        '',
+        '#include "tinyhci_http.h"',
+        '',
+    ]
+    routes = []
+    total_raw = total_sent = 0
+
+    for i, (path, content_type, data) in enumerate(assets):
+        body = compress(data)
+        flags = 'HTTP_ROUTE_GZIP'
+        if len(body) >= len(data):
+            body, flags = data, '0'
+        if len(body) > 0xffff:
+            sys.stderr.write('%s: too large for a route (%d bytes)\n' % (path, len(body)))
+            return 1
+
+        # The ETag identifies the bytes sent, so it changes whenever the asset does.
+        etag = '"%s"' % hashlib.sha1(body).hexdigest()[:8]
+        symbol = 'asset_%d_%s' % (i, re.sub('[^0-9A-Za-z]', '_', path.strip('/')) or 'root')
+
+        lines.append('// %s: %d bytes, %d sent' % (path, len(data), len(body)))
+        lines.append('const char %s_type[] PROGMEM = %s;' % (symbol, c_string(content_type)))
+        lines.append('const char %s_etag[] PROGMEM = %s;' % (symbol, c_string(etag)))
+        lines.append('const uint8_t %s_body[] PROGMEM =' % symbol)
+        lines.append('{')
+        for offset in range(0, len(body), 16):
+            lines.append('  ' + ' '.join('0x%02x,' % b for b in bytearray(body[offset:offset + 16])))
+        lines.append('};')
+
+        paths = [path]
+        if path == '/index.html' or path.endswith('/index.html'):
+            paths.append(path[:-len('index.html')])
+        for j, p in enumerate(paths):
+            lines.append('const char %s_path%d[] PROGMEM = %s;' % (symbol, j, c_string(p)))
+            routes.append('  { %s_path%d, %s_type, (const char *)%s_body, %d, NULL, %s_etag, %s },' %
+                          (symbol, j, symbol, symbol, len(body), symbol, flags))
+        lines.append('')
+
+        total_raw += len(data)
+        total_sent += len(body)
+
+    lines.append('#define ASSET_ROUTES \\')
+    lines.extend(r + ' \\' for r in routes)
+    lines.append('')
+    lines.append('#endif')
+    lines.append('')
+
+    with open(output, 'w') as f:
+        f.write('\n'.join(lines))
+
+    sys.stdout.write('%d assets, %d bytes, %d sent\n' % (len(assets), total_raw, total_sent))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+#
+# route_hash.py
+#
+# Generates a perfect hash over the paths of an HttpServer route table.  With it the server
+# finds a route with one hash, which the parser computes while the path arrives, and one
+# compare, instead of comparing the path against every route.
+#
+# Usage:
+#
+#   python tools/route_hash.py <output header> <path>...
+#
+# Paths must be given in the same order as the routes in the table.  If the table changes
+# without regenerating the header, HttpServer::begin notices and falls back to a linear search.
+#
+# The header defines ROUTE_HASH_SEED and route_hash_slots, which are passed to HttpServer:
+#
+#   HttpServer server(routes, route_count, ROUTE_HASH_SEED, route_hash_slots, sizeof(route_hash_slots));
+#
+import sys
+
+EMPTY = 0xff
+MAX_SLOTS = 128     # the table size is passed to HttpServer as a uint8_t
+SEEDS = 1 << 16
+
+def http_hash(seed, path):
+    # Matches http_hash_begin and http_hash_step in tinyhci_http_parser.h.
+    h = 2166136261 ^ seed
+    for b in bytearray(path.encode('ascii')):
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+def search(paths, size):
+    mask = size - 1
+    for seed in range(SEEDS):
+        slots = [EMPTY] * size
+        for i, path in enumerate(paths):
+            slot = (http_hash(seed, path) >> 24) & mask     # http_hash_slot
+            if slots[slot] != EMPTY:
+                break
+            slots[slot] = i
+        else:
+            return seed, slots
+    return None
+
+def main():
+    if len(sys.argv) < 3:
+        sys.stderr.write('usage: %s <output header> <path>...\n' % sys.argv[0])
+        return 1
+
+    output, paths = sys.argv[1], sys.argv[2:]
+    if len(set(paths)) != len(paths):
+        sys.stderr.write('duplicate paths\n')
+        return 1
+    if len(paths) >= EMPTY:
+        sys.stderr.write('too many routes\n')
+        return 1
+
+    # Use the smallest power of two table for which a seed can be found.
+    size = 1
+    while size < len(paths):
+        size *= 2
+
+    result = None
+    while size <= MAX_SLOTS and not result:
+        result = search(paths, size)
+        if not result:
+            size *= 2
+    if not result:
+        sys.stderr.write('no perfect hash found; leave the table unhashed\n')
+        return 1
+
+    seed, slots = result
+
+    lines = [
+        '//',
+        '// Generated by tools/route_hash.py; do not edit.',
+        '//',
+    ]
+    lines.extend('//   %d: %s' % (i, path) for i, path in enumerate(paths))
+    lines.extend([
+        '//',
+        '#ifndef __ROUTE_HASH_H__',
+        '#define __ROUTE_HASH_H__',
+        '',
+        '#define ROUTE_HASH_SEED 0x%08xUL' % seed,
+        '',
+        'const uint8_t route_hash_slots[] PROGMEM =',
+        '{',
+        '  ' + ' '.join('0x%02x,' % s for s in slots),
+        '};',
+        '',
+        '#endif',
+        '',
+    ])
+
+    with open(output, 'w') as f:
+        f.write('\n'.join(lines))
+
+    sys.stdout.write('%d routes, %d slots, seed 0x%08x\n' % (len(paths), size, seed))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())